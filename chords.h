@@ -0,0 +1,183 @@
+/**
+	@file
+	chords - chord progressions read once from a file, any number of chords and voices per line
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Structs
+
+typedef struct chord {
+	int* pitches; // Points into the library's pitch array
+	int voices;
+} chord;
+
+typedef struct progression {
+	chord* chords; // Points into the library's chord array
+	int length;
+	unsigned short key; // Pitch class mask of the key that fits the chords best
+} progression;
+
+typedef struct chord_library {
+	progression* rows; // One per non-empty line of the file
+	int row_count;
+	chord* chords;
+	int chord_count;
+	int* pitches;
+	int pitch_count;
+} chord_library;
+
+/*
+Walks a progression file held in memory. Chords are separated by commas and progressions by
+newlines. With fill set to 0 it only counts rows, chords and pitches so the arrays can be
+allocated, with fill set to 1 it writes them.
+*/
+void chords_scan(chord_library* lib, const char* text, int fill) {
+	int rows = 0;
+	int chords = 0;
+	int pitches = 0;
+	int row_start = 0; // First chord of the current row
+	int chord_start = 0; // First pitch of the current chord
+	const char* c = text;
+
+	for (;;) {
+		if ((*c >= '0' && *c <= '9') || *c == '-') {
+			char* end;
+			long value = strtol(c, &end, 10);
+			if (end == c) { // A lone '-'
+				c++;
+				continue;
+			}
+			if (fill) {
+				lib->pitches[pitches] = (int)value;
+			}
+			pitches++;
+			c = end;
+			continue;
+		}
+
+		if (*c == ',' || *c == '\n' || *c == 0) {
+			// Close the current chord
+			if (pitches > chord_start) {
+				if (fill) {
+					lib->chords[chords].pitches = lib->pitches + chord_start;
+					lib->chords[chords].voices = pitches - chord_start;
+				}
+				chords++;
+				chord_start = pitches;
+			}
+		}
+
+		if (*c == '\n' || *c == 0) {
+			// Close the current row
+			if (chords > row_start) {
+				if (fill) {
+					lib->rows[rows].chords = lib->chords + row_start;
+					lib->rows[rows].length = chords - row_start;
+				}
+				rows++;
+				row_start = chords;
+			}
+		}
+
+		if (*c == 0) {
+			break;
+		}
+		c++;
+	}
+
+	lib->row_count = rows;
+	lib->chord_count = chords;
+	lib->pitch_count = pitches;
+}
+
+chord_library* chords_load(char* filename) {
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		post("Could not open file %s", filename);
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char* text = (char*)malloc(size + 1);
+	size = (long)fread(text, 1, size, fp);
+	text[size] = 0;
+	fclose(fp);
+
+	chord_library* lib = (chord_library*)malloc(sizeof(chord_library));
+	chords_scan(lib, text, 0);
+	lib->rows = (progression*)malloc(sizeof(progression) * (lib->row_count + 1));
+	lib->chords = (chord*)malloc(sizeof(chord) * (lib->chord_count + 1));
+	lib->pitches = (int*)malloc(sizeof(int) * (lib->pitch_count + 1));
+	chords_scan(lib, text, 1);
+
+	// Work out each progression's key now so sections can change key for free
+	for (int r = 0; r < lib->row_count; r++) {
+		progression* p = &lib->rows[r];
+		unsigned short classes = 0;
+		for (int c = 0; c < p->length; c++) {
+			classes |= scale_of(p->chords[c].pitches, p->chords[c].voices);
+		}
+		p->key = scale_fit(classes, SCALE_HOME);
+	}
+
+	free(text);
+	return lib;
+}
+
+void chords_free(chord_library* lib) {
+	if (lib == NULL) {
+		return;
+	}
+	free(lib->rows);
+	free(lib->chords);
+	free(lib->pitches);
+	free(lib);
+}
+
+// Progression lookup
+
+// Returns the progression on a line, counting from 1, or NULL if there is no such line
+progression* chords_row(chord_library* lib, int row) {
+	if (lib == NULL || row < 1 || row > lib->row_count) {
+		return NULL;
+	}
+	return &lib->rows[row - 1];
+}
+
+// Picks a line at random, counting from 1, or returns 0 for an empty library
+int chords_random_row(chord_library* lib, unsigned int* rng) {
+	if (lib == NULL || lib->row_count < 1) {
+		return 0;
+	}
+	return get_random(rng, 1, lib->row_count);
+}
+
+/*
+A progression is spread over the four measures of a phrase. Four chords get a measure each,
+eight get half a measure each, and shorter progressions hold chords over several measures.
+Returns how many chords sound in a measure and sets first to the index of the first one.
+*/
+int progression_measure(progression* p, int measure, int* first) {
+	int start = (measure * p->length) / 4;
+	int end = ((measure + 1) * p->length) / 4;
+	*first = start;
+	return end > start ? end - start : 1;
+}
+
+// The chord sounding at a beat within a measure
+chord* progression_chord_at(progression* p, int measure, float beat) {
+	int first;
+	int count = progression_measure(p, measure, &first);
+	int index = (int)(beat * count / 4.0);
+	if (index >= count) {
+		index = count - 1;
+	}
+	return &p->chords[first + index];
+}
@@ -0,0 +1,257 @@
+/**
+	@file
+	eventlog - records the notes an object plays into a binary log, and maps logs back for replay
+	Caden Kesey
+*/
+
+/*
+Layout of a log file, all values little endian:
+
+	offset 0	uint32	magic, EVENTLOG_MAGIC ("MBXL")
+	offset 4	uint32	version, EVENTLOG_VERSION
+	offset 8	uint32	record size in bytes, 12
+	offset 12	uint32	count, records in the file
+	offset 16	float	tempo in bpm when recording started
+	offset 20	uint32	seed when recording started
+	offset 24	...	padding up to 32 bytes
+	offset 32	records, count of them, in the order they were played
+
+	Each record:
+	offset 0	float	time, beats since recording started
+	offset 4	float	length, beats
+	offset 8	int16	value, midi note, 0 or less for a rest
+	offset 10	uint8	track, TRACK_PIANO to TRACK_KICK
+	offset 11	uint8	unused, 0
+
+Times are in beats, so a log plays back at whatever tempo the object is set to. They count from
+when recording started and carry on across a bang that starts the song over, so they never go
+backwards. Records that share a time were played by one clock callback, and piano records that
+share a time are one chord.
+
+Recording appends to a buffer allocated up front, so playing never allocates or touches the disk;
+the log is written out in one go when recording stops. Replay maps the file and reads records in
+place. Like ring.h this needs nothing from Max.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define EVENTLOG_MAGIC 0x4c58424du // "MBXL"
+#define EVENTLOG_VERSION 1
+#define EVENTLOG_HEADER 32
+#define EVENTLOG_DEFAULT_EVENTS 65536 // About 12 minutes of busy playing, 768 KB
+
+// Structs
+
+typedef struct eventlog_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int record_size;
+	unsigned int count;
+	float tempo;
+	unsigned int seed;
+	char padding[EVENTLOG_HEADER - 24];
+} eventlog_header;
+
+typedef struct eventlog_record {
+	float time;
+	float length;
+	short value;
+	unsigned char track;
+	unsigned char unused;
+} eventlog_record;
+
+// A log being recorded
+typedef struct eventlog {
+	eventlog_header header;
+	eventlog_record* records;
+	long count;
+	long size;
+	long dropped; // Records that didn't fit
+} eventlog;
+
+// A log mapped for replay
+typedef struct eventlog_map {
+	const eventlog_header* header;
+	const eventlog_record* records;
+	long count;
+	long longest; // Most records that share a time
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} eventlog_map;
+
+// Recording
+
+eventlog* eventlog_new(long size, float tempo, unsigned int seed) {
+	eventlog* log = (eventlog*)malloc(sizeof(eventlog));
+	memset(&log->header, 0, sizeof(eventlog_header));
+	log->header.magic = EVENTLOG_MAGIC;
+	log->header.version = EVENTLOG_VERSION;
+	log->header.record_size = sizeof(eventlog_record);
+	log->header.tempo = tempo;
+	log->header.seed = seed;
+	log->size = size > 0 ? size : EVENTLOG_DEFAULT_EVENTS;
+	log->records = (eventlog_record*)malloc(sizeof(eventlog_record) * log->size);
+	log->count = 0;
+	log->dropped = 0;
+	if (log->records == NULL) {
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+void eventlog_free(eventlog* log) {
+	if (log == NULL) {
+		return;
+	}
+	free(log->records);
+	free(log);
+}
+
+void eventlog_add(eventlog* log, float time, float length, int track, int value) {
+	if (log->count == log->size) {
+		log->dropped++;
+		return;
+	}
+	eventlog_record* r = &log->records[log->count++];
+	r->time = time;
+	r->length = length;
+	r->value = (short)value;
+	r->track = (unsigned char)track;
+	r->unused = 0;
+}
+
+// Returns 1 if the whole log was written
+int eventlog_save(eventlog* log, const char* filename) {
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		return 0;
+	}
+	log->header.count = (unsigned int)log->count;
+	int written = fwrite(&log->header, sizeof(eventlog_header), 1, fp) == 1
+		&& fwrite(log->records, sizeof(eventlog_record), log->count, fp) == (size_t)log->count;
+	return fclose(fp) == 0 && written;
+}
+
+// Replay
+
+void eventlog_close(eventlog_map* m) {
+	if (m == NULL) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile((void*)m->header);
+	CloseHandle(m->mapping);
+	CloseHandle(m->file);
+#else
+	munmap((void*)m->header, m->size);
+#endif
+	free(m);
+}
+
+/*
+Maps a log read only and checks it: the header has to match, the file has to hold every record
+it claims and the times can't go backwards. Returns NULL if any of that fails, with error set to
+why, worded to follow the file name.
+*/
+eventlog_map* eventlog_open(const char* filename, const char** error) {
+	*error = "could not be opened";
+	eventlog_map* m = (eventlog_map*)malloc(sizeof(eventlog_map));
+	memset(m, 0, sizeof(eventlog_map));
+
+#ifdef _WIN32
+	m->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m->file == INVALID_HANDLE_VALUE) {
+		free(m);
+		return NULL;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(m->file, &size);
+	m->size = (size_t)size.QuadPart;
+	m->mapping = m->size >= EVENTLOG_HEADER ? CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (m->mapping == NULL) {
+		CloseHandle(m->file);
+		free(m);
+		return NULL;
+	}
+	m->header = (const eventlog_header*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m->header == NULL) {
+		CloseHandle(m->mapping);
+		CloseHandle(m->file);
+		free(m);
+		return NULL;
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		free(m);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < EVENTLOG_HEADER) {
+		*error = "is not a musicbox event log";
+		close(fd);
+		free(m);
+		return NULL;
+	}
+	m->size = (size_t)st.st_size;
+	void* mapped = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		free(m);
+		return NULL;
+	}
+	m->header = (const eventlog_header*)mapped;
+#endif
+
+	m->records = (const eventlog_record*)((const char*)m->header + EVENTLOG_HEADER);
+	m->count = (long)m->header->count;
+	if (m->header->magic != EVENTLOG_MAGIC || m->header->version != EVENTLOG_VERSION
+		|| m->header->record_size != sizeof(eventlog_record)) {
+		*error = "is not a musicbox event log";
+		eventlog_close(m);
+		return NULL;
+	}
+	if ((m->size - EVENTLOG_HEADER) / sizeof(eventlog_record) < (size_t)m->count) {
+		*error = "is cut short, it holds fewer records than its header says";
+		eventlog_close(m);
+		return NULL;
+	}
+
+	long run = 0;
+	for (long i = 0; i < m->count; i++) {
+		if (i > 0 && m->records[i].time < m->records[i - 1].time) {
+			*error = "has times out of order";
+			eventlog_close(m);
+			return NULL;
+		}
+		run = i > 0 && m->records[i].time == m->records[i - 1].time ? run + 1 : 1;
+		if (run > m->longest) {
+			m->longest = run;
+		}
+	}
+	return m;
+}
+
+// Index of the first record after the ones that share a time with record first
+long eventlog_group_end(const eventlog_map* m, long first) {
+	long last = first;
+	while (last < m->count && m->records[last].time == m->records[first].time) {
+		last++;
+	}
+	return last;
+}
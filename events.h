@@ -0,0 +1,163 @@
+/**
+	@file
+	events - flattens a song into timed note events, one list per track
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEASURE_BEATS 4 // Beats in a measure
+#define SECTION_MEASURES 4 // Measures in one pass through a section
+
+// Structs
+
+typedef struct event {
+	float time; // Beats from the start of the song
+	float length; // Beats
+	int value; // Midi note
+	int track;
+} event;
+
+typedef struct event_list {
+	event* events;
+	long count;
+	long size;
+	long longest; // Most events that share a time, set by song_timeline
+} event_list;
+
+void events_init(event_list* list) {
+	list->events = NULL;
+	list->count = 0;
+	list->size = 0;
+	list->longest = 0;
+}
+
+void events_clear(event_list* list) {
+	free(list->events);
+	events_init(list);
+}
+
+void events_add(event_list* list, float time, float length, int value, int track) {
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		list->events = (event*)realloc(list->events, sizeof(event) * list->size);
+	}
+	list->events[list->count].time = time;
+	list->events[list->count].length = length;
+	list->events[list->count].value = value;
+	list->events[list->count].track = track;
+	list->count++;
+}
+
+/*
+The phrase heard in a measure of a section. Phrases play in order, each for its number of
+repetitions, the same way musicbox_measure_task steps through them. Doesn't change the song.
+*/
+phrase* section_phrase_at(section* current_section, int measure) {
+	phrase* p = current_section->head;
+	int start = 0;
+	while (p->next != NULL) {
+		int reps = p->repetitions > 0 ? p->repetitions : 1;
+		if (measure < start + reps || p->next->next == NULL) {
+			return p;
+		}
+		start += reps;
+		p = p->next;
+	}
+	return p;
+}
+
+/*
+Adds every note of a track to list, in time order. Sections are walked like musicbox_task walks
+them, but without using up the repetition counts, so this works on a song that has been played.
+Chords add an event for each pitch, or only the pitch of one voice when voice isn't -1.
+Returns the length of the track in beats.
+*/
+float section_voice_events(section* current_section, int track, int voice, event_list* list) {
+	float song_time = 0;
+
+	while (current_section != NULL && current_section->next != NULL) { // The last section is always empty
+		int reps = current_section->repetitions > 0 ? current_section->repetitions : 1;
+		for (int r = 0; r < reps; r++) {
+			for (int m = 0; m < SECTION_MEASURES; m++) {
+				phrase* p = section_phrase_at(current_section, m);
+				float t = 0;
+				for (int c = 0; c < p->chord_count && t < MEASURE_BEATS; c++) {
+					chord_event* e = &p->chords[c];
+					for (int v = 0; v < e->voices; v++) {
+						if (e->pitches[v] > 0 && (voice < 0 || voice == v)) {
+							events_add(list, song_time + t, e->length, e->pitches[v], track);
+						}
+					}
+					t += e->length;
+				}
+				for (note* n = p->head; n != NULL && n->next != NULL; n = n->next) {
+					if (t >= MEASURE_BEATS) { // The next measure cuts the phrase off
+						break;
+					}
+					if (n->value > 0) {
+						events_add(list, song_time + t, n->length, n->value, track);
+					}
+					t += n->length;
+				}
+				song_time += MEASURE_BEATS;
+			}
+		}
+		current_section = current_section->next;
+	}
+	return song_time;
+}
+
+float section_events(section* current_section, int track, event_list* list) {
+	return section_voice_events(current_section, track, -1, list);
+}
+
+// Orders events by time, then track, then pitch, so simultaneous events always come out the same way
+int events_compare(const void* a, const void* b) {
+	const event* ea = (const event*)a;
+	const event* eb = (const event*)b;
+	if (ea->time != eb->time) {
+		return ea->time < eb->time ? -1 : 1;
+	}
+	if (ea->track != eb->track) {
+		return ea->track - eb->track;
+	}
+	return ea->value - eb->value;
+}
+
+/*
+Every note of every track in one list, in time order. Events that share a time are next to each
+other. Returns the length of the song in beats.
+*/
+float song_timeline(song* s, event_list* timeline) {
+	section* sections[TRACK_COUNT] = {
+		s->piano_section, s->bass_section, s->melody_section,
+		s->hat_section, s->ghost_section, s->snare_section, s->kick_section
+	};
+	int tracks[TRACK_COUNT] = {
+		TRACK_PIANO, TRACK_BASS, TRACK_MELODY, TRACK_HAT, TRACK_GHOST, TRACK_SNARE, TRACK_KICK
+	};
+	float beats = 0;
+
+	timeline->count = 0;
+	for (int i = 0; i < TRACK_COUNT; i++) {
+		float length = section_events(sections[i], tracks[i], timeline);
+		if (length > beats) {
+			beats = length;
+		}
+	}
+	qsort(timeline->events, timeline->count, sizeof(event), events_compare);
+
+	timeline->longest = 0;
+	for (long first = 0, last = 0; first < timeline->count; first = last) {
+		while (last < timeline->count && timeline->events[last].time == timeline->events[first].time) {
+			last++;
+		}
+		if (last - first > timeline->longest) {
+			timeline->longest = last - first;
+		}
+	}
+	return beats;
+}
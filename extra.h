@@ -8,7 +8,8 @@
 #include <stdlib.h>
 #include <string.h>
 
-static int phrase_rep_hold[6] = {0,0,0,0,0,0};
+#define MAX_BEATS 20 // Size of the buffer callers give get_beats, enough for any shipped pattern
+#define CHORD_MAX_VOICES 8 // Most pitches one chord event can hold
 
 typedef struct note {
 	int value;
@@ -16,9 +17,19 @@ typedef struct note {
 	struct note* next;
 } note;
 
+// Pitches that start together and last the same time, kept in one event so a chord is one step
+typedef struct chord_event {
+	float length;
+	int voices;
+	int pitches[CHORD_MAX_VOICES];
+} chord_event;
+
 typedef struct phrase {
 	struct note* head;
+	struct chord_event* chords; // Chord tracks only, their notes are left empty
+	int chord_count;
 	int repetitions;
+	int shared; // Set when head and chords belong to the song's interned phrases rather than this phrase
 	struct phrase* next;
 } phrase;
 
@@ -28,6 +39,82 @@ typedef struct section {
 	struct section* next;
 } section;
 
+// List allocation
+
+note* note_new(void) {
+	note* n = (note*)malloc(sizeof(note));
+	n->value = 0;
+	n->length = 0;
+	n->next = NULL;
+	return n;
+}
+
+phrase* phrase_new(void) {
+	phrase* p = (phrase*)malloc(sizeof(phrase));
+	p->head = note_new();
+	p->chords = NULL;
+	p->chord_count = 0;
+	p->repetitions = 0;
+	p->shared = 0;
+	p->next = NULL;
+	return p;
+}
+
+section* section_new(void) {
+	section* s = (section*)malloc(sizeof(section));
+	s->head = phrase_new();
+	s->repetitions = 0;
+	s->next = NULL;
+	return s;
+}
+
+void free_notes(note* n) {
+	while (n != NULL) {
+		note* next = n->next;
+		free(n);
+		n = next;
+	}
+}
+
+void free_phrases(phrase* p) {
+	while (p != NULL) {
+		phrase* next = p->next;
+		if (!p->shared) {
+			free_notes(p->head);
+			free(p->chords);
+		}
+		free(p);
+		p = next;
+	}
+}
+
+void free_sections(section* s) {
+	while (s != NULL) {
+		section* next = s->next;
+		free_phrases(s->head);
+		free(s);
+		s = next;
+	}
+}
+
+// Random numbers
+
+/*
+Same generator as the MSVC runtime's rand(), but with the state held by the caller
+so songs can be generated on several threads at once. Existing seeds keep their songs.
+*/
+int next_random(unsigned int* state)
+{
+	*state = *state * 214013u + 2531011u;
+	return (int)((*state >> 16) & 0x7fff);
+}
+
+int get_random(unsigned int* state, int lower, int upper)
+{
+	int num = (next_random(state) % (upper - lower + 1)) + lower;
+	return num;
+}
+
 void printList(struct note* n) {
 	int i = 0;
 	while (n != NULL) {
@@ -37,8 +124,22 @@ void printList(struct note* n) {
 	}
 }
 
-float* get_beats(struct note* n) {
-	static float r[20]; // Hold
+/*
+Fills r, which holds size floats, with where each note that isn't a rest starts, ending in -1.
+A phrase with more notes than that gets a buffer allocated to fit instead, which the caller frees
+when it isn't r.
+*/
+float* get_beats(struct note* n, float* r, int size) {
+	int needed = 1; // The -1 at the end
+	for (note* c = n; c != NULL; c = c->next) {
+		if (c->value > -1) {
+			needed++;
+		}
+	}
+	if (needed > size) {
+		r = (float*)malloc(sizeof(float) * needed);
+	}
+
 	int i = 0;
 	float sum = 0;
 	while (n != NULL) {
@@ -87,72 +188,19 @@ int number_of_lines(char* filename)
 	return count_lines;
 }
 
-int** load_chords(char* filename) {
-	static int chord_1[4] = { 0,0,0,0 };
-	static int chord_2[4] = { 0,0,0,0 };
-	static int chord_3[4] = { 0,0,0,0 };
-	static int chord_4[4] = { 0,0,0,0 };
-	static int* progression[4] = {chord_1, chord_2, chord_3, chord_4};
-
-	FILE* fp;
-	char str[MAXCHAR];
-	int line = 1;
-	int rand_line = get_random(1, number_of_lines(filename));
-
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		post("Could not open file %s", filename);
-	}
-	else {
-		while (fgets(str, MAXCHAR, fp) != NULL) {
-			if (line == rand_line) {
-				char* token_A;
-				char* rest_A = str;
-				int i = 0;
-				while ((token_A = strtok_s(rest_A, ",", &rest_A))) {
-					if (token_A[strlen(token_A) - 1] == '\n') {
-						token_A[strlen(token_A) - 1] = 0;
-					}
-
-					char* token_copy = "";
-					strcpy(token_copy, token_A);
-					char* rest_B = token_copy;
-					const char delim_B[2] = " ";
-					char* token_B;
-					int j = 0;
-					while ((token_B = strtok_s(rest_B, " ", &rest_B))) {
-						progression[i][j] = (int)strtol(token_B, (char**)NULL, 10);
-						//post("IN THE OTHER [%d] [%d]: %d", i, j, progression[i][j]);
-						j++;
-					}
-					i++;
-				}
-			}
-			line++;
-		}
-		fclose(fp);
-	}
-	return progression;
-}
-
-int get_random(int lower, int upper)
-{
-	int num = (rand() % (upper - lower + 1)) + lower;
-	return num;
-}
-
-phrase* next_phrase(phrase* current_phrase, int inst) {
+// hold keeps the repetitions a phrase started with so it can be restored, one per player
+phrase* next_phrase(phrase* current_phrase, int* hold) {
 	if (current_phrase->repetitions < 1) {
 		if (current_phrase->next != NULL) {
-			//post("SETTING REPETITIONS OF %d TO %d", inst, phrase_rep_hold[inst]);
-			current_phrase->repetitions = phrase_rep_hold[inst];
+			//post("SETTING REPETITIONS TO %d", *hold);
+			current_phrase->repetitions = *hold;
 			current_phrase = current_phrase->next;
-			phrase_rep_hold[inst] = 0;
+			*hold = 0;
 		}
 	}
 
-	if (current_phrase->repetitions > phrase_rep_hold[inst]) {
-		phrase_rep_hold[inst] = current_phrase->repetitions;
+	if (current_phrase->repetitions > *hold) {
+		*hold = current_phrase->repetitions;
 	}
 
 	current_phrase->repetitions = current_phrase->repetitions - 1;
@@ -160,9 +208,9 @@ phrase* next_phrase(phrase* current_phrase, int inst) {
 	return current_phrase;
 }
 
-phrase* reset_phrase(phrase* current_phrase, int inst) {
-	//post("RESETTING REPETITIONS OF %d TO %d", inst, phrase_rep_hold[inst]);
-	current_phrase->repetitions = phrase_rep_hold[inst];
+phrase* reset_phrase(phrase* current_phrase, int* hold) {
+	//post("RESETTING REPETITIONS TO %d", *hold);
+	current_phrase->repetitions = *hold;
 	return current_phrase;
 }
 
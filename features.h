@@ -0,0 +1,425 @@
+/**
+	@file
+	features - measures many generated songs at once into one fixed vector of numbers each
+	Caden Kesey
+*/
+
+/*
+Songs are flattened a batch at a time into columns: the times, lengths and pitches of every note
+of every song, each song's tracks one after another. The arithmetic done for every note (which
+sixteenth it starts on, whether it starts exactly on one, its pitch class) runs over the columns
+of the whole batch four notes at a time with SSE2 where the compiler has it. Each song's vector is
+then counted from those columns with small per song tables, without walking any linked lists.
+
+The vector, FEATURE_COUNT floats:
+
+	FEATURE_DENSITY + track	notes per measure of each track, TRACK_PIANO to TRACK_KICK, a chord
+				counting once for each voice
+	FEATURE_PITCH + class	share of piano, bass and melody notes in each pitch class, C first
+	FEATURE_SYNCOPATION + 0	share of bass notes that don't start with a kick or snare hit
+	FEATURE_SYNCOPATION + 1	the same for the melody
+	FEATURE_COVERAGE + 0	share of bass notes whose pitch class is in the piano chord sounding
+	FEATURE_COVERAGE + 1	the same for the melody
+	FEATURE_LENGTH		length of the song in beats
+
+analyze writes the vectors of a range of seeds to a file, all values little endian:
+
+	offset 0	uint32	magic, FEATURES_MAGIC ("MBXF")
+	offset 4	uint32	version, FEATURES_VERSION
+	offset 8	uint32	FEATURE_COUNT
+	offset 12	uint32	count, rows in the file
+	offset 16	rows, count of them in seed order: uint32 seed, then FEATURE_COUNT floats
+
+Seeds whose songs break the object's constraints are left out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FEATURES_SSE 1
+#endif
+
+#define FEATURE_SONGS 64 // Songs measured together in one batch
+#define FEATURE_CELLS_PER_BEAT 4 // Sixteenths
+#define FEATURES_MAX_THREADS 32
+#define FEATURES_MAGIC 0x4658424du // "MBXF"
+#define FEATURES_VERSION 1
+
+enum {
+	FEATURE_DENSITY = 0,
+	FEATURE_PITCH = FEATURE_DENSITY + TRACK_COUNT,
+	FEATURE_SYNCOPATION = FEATURE_PITCH + 12,
+	FEATURE_COVERAGE = FEATURE_SYNCOPATION + 2,
+	FEATURE_LENGTH = FEATURE_COVERAGE + 2,
+	FEATURE_COUNT
+};
+
+// Structs
+
+typedef struct feature_batch {
+	long songs;
+	long starts[FEATURE_SONGS * TRACK_COUNT + 1]; // Notes of song i, track t begin at starts[i * TRACK_COUNT + t]
+	float beats[FEATURE_SONGS];
+
+	// Columns, one entry per note
+
+	float* time;
+	float* length;
+	float* value;
+	int* cell; // Sixteenth the note starts in
+	int* on_cell; // -1 if it starts exactly on it, 0 if after
+	int* pitch_class;
+	long count;
+	long size;
+
+	// Per song tables, reused
+
+	event_list notes;
+	unsigned char* hits; // Cells where the kick or snare starts a note
+	unsigned short* chord; // Pitch classes of the piano chord sounding in each cell
+	long cells;
+} feature_batch;
+
+// A range of seeds being measured on several threads
+typedef struct analysis {
+	constraints limits;
+	tables* tables; // Shared, the instance that started it keeps them attached
+	int piano_voices;
+
+	unsigned int first_seed;
+	long count;
+	long next; // Seeds handed out so far
+	long done;
+	volatile int stop;
+	float* features; // count vectors, in seed order
+	unsigned char* kept; // 1 for seeds that met the constraints
+
+	long thread_count;
+	long running;
+	t_systhread threads[FEATURES_MAX_THREADS];
+	t_systhread_mutex lock;
+	void* report; // Qelem set when a worker finishes
+	double started;
+} analysis;
+
+// Batches
+
+void features_batch_init(feature_batch* b) {
+	memset(b, 0, sizeof(feature_batch));
+	events_init(&b->notes);
+}
+
+void features_batch_clear(feature_batch* b) {
+	free(b->time);
+	free(b->length);
+	free(b->value);
+	free(b->cell);
+	free(b->on_cell);
+	free(b->pitch_class);
+	free(b->hits);
+	free(b->chord);
+	events_clear(&b->notes);
+	features_batch_init(b);
+}
+
+void features_batch_reset(feature_batch* b) {
+	b->songs = 0;
+	b->count = 0;
+	b->starts[0] = 0;
+}
+
+// Appends a song's notes to the columns, returns 0 when the batch is full
+int features_add_song(feature_batch* b, song* s) {
+	if (b->songs == FEATURE_SONGS) {
+		return 0;
+	}
+	float beats = 0;
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		b->notes.count = 0;
+		float length = section_events(song_track_section(s, t), t, &b->notes);
+		if (length > beats) {
+			beats = length;
+		}
+		if (b->count + b->notes.count > b->size) {
+			b->size = (b->count + b->notes.count) * 2;
+			b->time = (float*)realloc(b->time, sizeof(float) * b->size);
+			b->length = (float*)realloc(b->length, sizeof(float) * b->size);
+			b->value = (float*)realloc(b->value, sizeof(float) * b->size);
+			b->cell = (int*)realloc(b->cell, sizeof(int) * b->size);
+			b->on_cell = (int*)realloc(b->on_cell, sizeof(int) * b->size);
+			b->pitch_class = (int*)realloc(b->pitch_class, sizeof(int) * b->size);
+		}
+		for (long i = 0; i < b->notes.count; i++) {
+			b->time[b->count + i] = b->notes.events[i].time;
+			b->length[b->count + i] = b->notes.events[i].length;
+			b->value[b->count + i] = (float)b->notes.events[i].value;
+		}
+		b->count += b->notes.count;
+		b->starts[b->songs * TRACK_COUNT + t + 1] = b->count;
+	}
+	b->beats[b->songs] = beats;
+	b->songs++;
+	return 1;
+}
+
+// Kernels
+
+/*
+Cell, whether the note starts exactly on it and pitch class, for every note in the batch. Times
+and pitches are positive. 1/12 rounds up as a float, so truncating value / 12 never falls short.
+*/
+void features_columns(feature_batch* b) {
+	long i = 0;
+#ifdef FEATURES_SSE
+	const __m128 cells = _mm_set1_ps((float)FEATURE_CELLS_PER_BEAT);
+	const __m128 twelfth = _mm_set1_ps(1.0f / 12.0f);
+	const __m128 twelve = _mm_set1_ps(12.0f);
+	for (; i + 4 <= b->count; i += 4) {
+		__m128 position = _mm_mul_ps(_mm_loadu_ps(b->time + i), cells);
+		__m128i cell = _mm_cvttps_epi32(position);
+		__m128 exact = _mm_cmpeq_ps(_mm_cvtepi32_ps(cell), position);
+		_mm_storeu_si128((__m128i*)(b->cell + i), cell);
+		_mm_storeu_si128((__m128i*)(b->on_cell + i), _mm_castps_si128(exact));
+
+		__m128 value = _mm_loadu_ps(b->value + i);
+		__m128 octaves = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(value, twelfth)));
+		__m128i pitch_class = _mm_cvttps_epi32(_mm_sub_ps(value, _mm_mul_ps(octaves, twelve)));
+		_mm_storeu_si128((__m128i*)(b->pitch_class + i), pitch_class);
+	}
+#endif
+	for (; i < b->count; i++) {
+		float position = b->time[i] * FEATURE_CELLS_PER_BEAT;
+		b->cell[i] = (int)position;
+		b->on_cell[i] = (float)b->cell[i] == position ? -1 : 0;
+		float octaves = (float)(int)(b->value[i] * (1.0f / 12.0f));
+		b->pitch_class[i] = (int)(b->value[i] - octaves * 12.0f);
+	}
+}
+
+// Counts song i's vector from the columns
+void features_song(feature_batch* b, long i, float* out) {
+	const long* starts = b->starts + i * TRACK_COUNT;
+	float measures = b->beats[i] / MEASURE_BEATS;
+	long cells = (long)(b->beats[i] * FEATURE_CELLS_PER_BEAT) + 1;
+	if (cells > b->cells) {
+		b->cells = cells * 2;
+		b->hits = (unsigned char*)realloc(b->hits, b->cells);
+		b->chord = (unsigned short*)realloc(b->chord, sizeof(unsigned short) * b->cells);
+	}
+	memset(b->hits, 0, cells);
+	memset(b->chord, 0, sizeof(unsigned short) * cells);
+	memset(out, 0, sizeof(float) * FEATURE_COUNT);
+
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		out[FEATURE_DENSITY + t] = measures > 0 ? (starts[t + 1] - starts[t]) / measures : 0;
+	}
+
+	// Pitch classes of the pitched tracks, which come first
+
+	long pitched = starts[TRACK_MELODY + 1] - starts[TRACK_PIANO];
+	for (long n = starts[TRACK_PIANO]; n < starts[TRACK_MELODY + 1]; n++) {
+		out[FEATURE_PITCH + b->pitch_class[n]] += 1;
+	}
+	for (int c = 0; c < 12 && pitched > 0; c++) {
+		out[FEATURE_PITCH + c] /= pitched;
+	}
+
+	// Tables of the drum hits and the chord in each cell
+
+	for (long n = starts[TRACK_SNARE]; n < starts[TRACK_KICK + 1]; n++) {
+		if (b->on_cell[n] && b->cell[n] < cells) {
+			b->hits[b->cell[n]] = 1;
+		}
+	}
+	for (long n = starts[TRACK_PIANO]; n < starts[TRACK_PIANO + 1]; n++) {
+		long last = (long)((b->time[n] + b->length[n]) * FEATURE_CELLS_PER_BEAT);
+		for (long c = b->cell[n]; c < last && c < cells; c++) {
+			b->chord[c] |= (unsigned short)(1 << b->pitch_class[n]);
+		}
+	}
+
+	// Bass and melody against them
+
+	const int tracks[2] = { TRACK_BASS, TRACK_MELODY };
+	for (int k = 0; k < 2; k++) {
+		long first = starts[tracks[k]];
+		long last = starts[tracks[k] + 1];
+		long off = 0;
+		long covered = 0;
+		for (long n = first; n < last; n++) {
+			long c = b->cell[n] < cells ? b->cell[n] : cells - 1;
+			off += !(b->on_cell[n] && b->hits[c]);
+			covered += (b->chord[c] >> b->pitch_class[n]) & 1;
+		}
+		if (last > first) {
+			out[FEATURE_SYNCOPATION + k] = (float)off / (last - first);
+			out[FEATURE_COVERAGE + k] = (float)covered / (last - first);
+		}
+	}
+	out[FEATURE_LENGTH] = b->beats[i];
+}
+
+// Vectors of every song in the batch, songs rows of FEATURE_COUNT
+void features_extract(feature_batch* b, float* out) {
+	features_columns(b);
+	for (long i = 0; i < b->songs; i++) {
+		features_song(b, i, out + i * FEATURE_COUNT);
+	}
+}
+
+// Squared distance between two vectors, for ranking seeds against a target song
+float features_distance(const float* a, const float* b) {
+	int i = 0;
+	float sum = 0;
+#ifdef FEATURES_SSE
+	__m128 sums = _mm_setzero_ps();
+	for (; i + 4 <= FEATURE_COUNT; i += 4) {
+		__m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+		sums = _mm_add_ps(sums, _mm_mul_ps(d, d));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, sums);
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; i < FEATURE_COUNT; i++) {
+		float d = a[i] - b[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+// Workers
+
+void* analysis_worker(analysis* job) {
+	feature_batch batch;
+	features_batch_init(&batch);
+	song* songs[FEATURE_SONGS];
+	long seeds[FEATURE_SONGS];
+	float* rows = (float*)malloc(sizeof(float) * FEATURE_SONGS * FEATURE_COUNT);
+
+	for (;;) {
+		systhread_mutex_lock(job->lock);
+		long start = job->next;
+		long end = start + FEATURE_SONGS < job->count ? start + FEATURE_SONGS : job->count;
+		job->next = end;
+		systhread_mutex_unlock(job->lock);
+		if (start >= end || job->stop) {
+			break;
+		}
+
+		features_batch_reset(&batch);
+		long n = 0;
+		for (long i = start; i < end; i++) {
+			song* s = song_new(job->tables);
+			s->rng = job->first_seed + (unsigned int)i;
+			s->limits = &job->limits;
+			s->piano_voices = job->piano_voices;
+			if (musicbox_generate(s)) {
+				s->limits = NULL;
+				features_add_song(&batch, s);
+				songs[n] = s;
+				seeds[n++] = i;
+			}
+			else {
+				song_free(s);
+			}
+		}
+		features_extract(&batch, rows);
+		for (long k = 0; k < n; k++) {
+			memcpy(job->features + seeds[k] * FEATURE_COUNT, rows + k * FEATURE_COUNT, sizeof(float) * FEATURE_COUNT);
+			job->kept[seeds[k]] = 1;
+			song_free(songs[k]);
+		}
+
+		systhread_mutex_lock(job->lock);
+		job->done += end - start;
+		systhread_mutex_unlock(job->lock);
+	}
+
+	free(rows);
+	features_batch_clear(&batch);
+	systhread_mutex_lock(job->lock);
+	job->running--;
+	systhread_mutex_unlock(job->lock);
+	qelem_set(job->report);
+
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+// Analysis lifetime
+
+analysis* analysis_start(constraints* limits, tables* shared, int piano_voices, unsigned int first_seed, long count, long thread_count, void* report) {
+	analysis* job = (analysis*)malloc(sizeof(analysis));
+	memset(job, 0, sizeof(analysis));
+	job->limits = *limits;
+	job->tables = shared;
+	job->piano_voices = piano_voices;
+	job->first_seed = first_seed;
+	job->count = count > 0 ? count : 0;
+	job->features = (float*)malloc(sizeof(float) * FEATURE_COUNT * (job->count > 0 ? job->count : 1));
+	job->kept = (unsigned char*)calloc(job->count > 0 ? job->count : 1, 1);
+	job->report = report;
+	job->started = systimer_gettime();
+	if (job->features == NULL || job->kept == NULL) {
+		free(job->features);
+		free(job->kept);
+		free(job);
+		return NULL;
+	}
+
+	job->thread_count = thread_count < 1 ? 1 : thread_count > FEATURES_MAX_THREADS ? FEATURES_MAX_THREADS : thread_count;
+	job->running = job->thread_count;
+	systhread_mutex_new(&job->lock, 0);
+	for (long i = 0; i < job->thread_count; i++) {
+		systhread_create((method)analysis_worker, job, 0, 0, 0, &job->threads[i]);
+	}
+	return job;
+}
+
+int analysis_finished(analysis* job) {
+	systhread_mutex_lock(job->lock);
+	int finished = job->running == 0;
+	systhread_mutex_unlock(job->lock);
+	return finished;
+}
+
+void analysis_free(analysis* job) {
+	unsigned int ret;
+	if (job == NULL) {
+		return;
+	}
+	job->stop = 1;
+	for (long i = 0; i < job->thread_count; i++) {
+		systhread_join(job->threads[i], &ret);
+	}
+	systhread_mutex_free(job->lock);
+	free(job->features);
+	free(job->kept);
+	free(job);
+}
+
+// Writes the kept vectors, returns how many or -1 if the file couldn't be written
+long analysis_save(analysis* job, const char* filename) {
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		return -1;
+	}
+	unsigned int header[4] = { FEATURES_MAGIC, FEATURES_VERSION, FEATURE_COUNT, 0 };
+	for (long i = 0; i < job->count; i++) {
+		header[3] += job->kept[i];
+	}
+	int ok = fwrite(header, sizeof(header), 1, fp) == 1;
+	for (long i = 0; i < job->count && ok; i++) {
+		if (job->kept[i]) {
+			unsigned int seed = job->first_seed + (unsigned int)i;
+			ok = fwrite(&seed, sizeof(seed), 1, fp) == 1
+				&& fwrite(job->features + i * FEATURE_COUNT, sizeof(float), FEATURE_COUNT, fp) == FEATURE_COUNT;
+		}
+	}
+	return fclose(fp) == 0 && ok ? (long)header[3] : -1;
+}
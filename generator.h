@@ -0,0 +1,953 @@
+/**
+	@file
+	generator - builds the sections, phrases and notes of a song
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tracks that constraints can refer to
+
+enum {
+	TRACK_PIANO,
+	TRACK_BASS,
+	TRACK_MELODY,
+	TRACK_HAT,
+	TRACK_GHOST,
+	TRACK_SNARE,
+	TRACK_KICK,
+	TRACK_COUNT
+};
+
+// Pattern and chord file lines picked while generating
+
+enum {
+	ROW_HAT,
+	ROW_GHOST,
+	ROW_SNARE,
+	ROW_KICK,
+	ROW_VERSE,
+	ROW_CHORUS,
+	ROW_COUNT
+};
+
+// Structs
+
+typedef struct constraints {
+	int low[TRACK_COUNT]; // Lowest allowed pitch, 0 for no limit
+	int high[TRACK_COUNT]; // Highest allowed pitch, 0 for no limit
+	int min_notes[TRACK_COUNT]; // Fewest notes per pass through a section, 0 for no limit
+	int max_notes[TRACK_COUNT]; // Most notes per pass through a section, 0 for no limit
+	int rows[ROW_COUNT]; // Required pattern or chord line, 0 for any
+} constraints;
+
+#define SONG_INTERN_BUCKETS 64
+
+/*
+Regeneration graph. Each section of each track is a node, and so are the chords of each section.
+A node records the nodes its notes were made from, so remaking one node means remaking everything
+downstream of it and nothing else.
+*/
+#define SONG_SECTIONS 2 // The first section uses the chorus chords, the second the verse chords
+#define NODE_CHORDS TRACK_COUNT // Node kinds are the tracks, then the chords
+#define NODE_COUNT ((TRACK_COUNT + 1) * SONG_SECTIONS)
+#define NODE(kind, section) ((kind) * SONG_SECTIONS + (section))
+#define NODE_BIT(kind, section) (1u << NODE(kind, section))
+#define PIANO_VOICES 4 // Pitches in each piano chord unless the song asks for more or fewer
+
+// The notes of a phrase, stored once however many phrases of the song hold the same notes
+typedef struct interned {
+	unsigned int hash;
+	pattern_file* file; // Pattern the notes were copied from, NULL for generated notes
+	int row;
+	int count; // Notes, including the empty one at the end
+	note* notes; // One buffer, linked in order like any other phrase's notes
+	int chord_count;
+	chord_event* chords;
+	struct interned* next;
+} interned;
+
+typedef struct song {
+	section* piano_section; // Chords rather than notes
+
+	section* bass_section;
+	section* melody_section;
+	section* hat_section;
+	section* ghost_section;
+	section* snare_section;
+	section* kick_section;
+
+	int rows[ROW_COUNT]; // Lines chosen from the pattern and chord files
+
+	interned* phrase_pool[SONG_INTERN_BUCKETS]; // Phrase notes by content hash, shared between tracks and sections
+	pattern_token* building; // Notes of the phrase being made, before it is interned
+	int building_count;
+	int building_size;
+	chord_event* building_chords; // Chords of the phrase being made
+	int building_chord_count;
+	int building_chord_size;
+	int piano_voices; // Pitches in each piano chord, 1 to CHORD_MAX_VOICES
+
+	tables* tables; // Patterns, chords and melody model to pick from, only read
+
+	unsigned int rng; // Random number state, starts as the seed
+	constraints* limits; // Set when searching, generation stops at the first violation
+
+	double deadline; // systimer_gettime after which melody and bass measures are placeholders, 0 for none
+	int placeholders; // Measures left as placeholders because the deadline passed
+
+	unsigned int inputs[NODE_COUNT]; // NODE_BITs of the nodes each node was made from
+
+	taskgraph_pool* pool; // Threads to make tracks on at the same time, NULL to make them in order
+} song;
+
+// How a track's notes are made
+
+enum {
+	PART_PATTERN, // Copied from a line of a pattern file
+	PART_MELODY, // Notes of the key, fitted to another track's back beats
+	PART_BASS, // Notes of the chords, fitted to another track's back beats
+	PART_PIANO // Every chord, as chord events
+};
+
+#define PART_MAX_PHRASES 4
+
+typedef struct part {
+	int track;
+	int kind;
+	int phrases; // Phrases in each section
+	int repetitions[PART_MAX_PHRASES]; // Times each phrase plays
+	int section_repetitions;
+
+	pattern_file** patterns; // Patterns, one file for each section
+	int row; // Patterns, the line copied
+	phrase* follow; // Melody and bass, the phrase whose notes are the back beats
+	int follow_track; // Track follow is the first phrase of
+	progression** progressions; // Chords for each section
+} part;
+
+#ifdef _MSC_VER
+#define GENERATOR_INLINE static __forceinline
+#else
+#define GENERATOR_INLINE static inline __attribute__((always_inline))
+#endif
+
+// One track to make, a task of the generation graph
+typedef struct track_job {
+	song* song;
+	int track;
+	int alone; // Made at the same time as other tracks, in view
+	song view;
+	pattern_file* files[SONG_SECTIONS];
+	progression* progressions[SONG_SECTIONS];
+} track_job;
+
+// Function prototypes
+
+int musicbox_generate(song* s);
+void song_view(song* s, song* view);
+int song_make_track(track_job* job);
+void song_gather(song* s, track_job* job);
+part part_pattern(int track, pattern_file** patterns, int row);
+part part_melody(phrase* follow, int follow_track, progression** progressions);
+part part_bass(phrase* follow, int follow_track, progression** progressions);
+part part_piano(progression** progressions);
+part song_part(song* s, int track, pattern_file** files, progression** progressions);
+int musicbox_create_part(song* s, section* current_section, part* p);
+int musicbox_make_phrase(song* s, part* p, float* back_beat, int section_index, int measure, phrase* current_phrase);
+int musicbox_create_measure(song* s, part* p, float* back_beat, int section_index, int measure);
+int musicbox_create_placeholder(song* s, part* p, int section_index, int measure);
+int musicbox_copy_row(song* s, pattern_file* file, int row, int track);
+unsigned int song_downstream(song* s, unsigned int changed);
+section* song_track_section(song* s, int track);
+unsigned int song_regenerate(song* s, int kind, int section_index);
+// Song lifetime
+
+song* song_new(tables* tables) {
+	song* s = (song*)malloc(sizeof(song));
+
+	s->piano_section = section_new();
+
+	s->bass_section = section_new();
+	s->melody_section = section_new();
+	s->hat_section = section_new();
+	s->ghost_section = section_new();
+	s->snare_section = section_new();
+	s->kick_section = section_new();
+
+	for (int i = 0; i < ROW_COUNT; i++) {
+		s->rows[i] = 0;
+	}
+	for (int i = 0; i < SONG_INTERN_BUCKETS; i++) {
+		s->phrase_pool[i] = NULL;
+	}
+	s->building = NULL;
+	s->building_count = 0;
+	s->building_size = 0;
+	s->building_chords = NULL;
+	s->building_chord_count = 0;
+	s->building_chord_size = 0;
+	s->piano_voices = PIANO_VOICES;
+
+	s->tables = tables;
+
+	s->rng = 0;
+	s->limits = NULL;
+	s->deadline = 0;
+	s->placeholders = 0;
+	for (int i = 0; i < NODE_COUNT; i++) {
+		s->inputs[i] = 0;
+	}
+	s->pool = NULL;
+	return s;
+}
+
+void song_free(song* s) {
+	if (s == NULL) {
+		return;
+	}
+	free_sections(s->piano_section);
+	free_sections(s->bass_section);
+	free_sections(s->melody_section);
+	free_sections(s->hat_section);
+	free_sections(s->ghost_section);
+	free_sections(s->snare_section);
+	free_sections(s->kick_section);
+	for (int i = 0; i < SONG_INTERN_BUCKETS; i++) {
+		interned* e = s->phrase_pool[i];
+		while (e != NULL) {
+			interned* next = e->next;
+			free(e->notes);
+			free(e->chords);
+			free(e);
+			e = next;
+		}
+	}
+	free(s->building);
+	free(s->building_chords);
+	free(s);
+}
+
+// Interning
+
+/*
+Phrases with the same notes share them. A phrase is made in the song's building buffer, then
+hashed; if the song already holds those notes the phrase points at them, otherwise they are
+copied into one buffer of linked notes and kept. Drum lines are also found by file and row, so
+a line used again isn't copied at all. Shared notes are never changed after this. Chords are
+made and shared the same way, alongside the notes.
+*/
+void song_add_note(song* s, int value, float length) {
+	if (s->building_count == s->building_size) {
+		s->building_size = s->building_size > 0 ? s->building_size * 2 : 64;
+		s->building = (pattern_token*)realloc(s->building, sizeof(pattern_token) * s->building_size);
+	}
+	pattern_token* n = &s->building[s->building_count++];
+	n->value = value;
+	n->length = length;
+}
+
+// A chord with room for every voice, which the caller fills in
+chord_event* song_add_chord(song* s, float length, int voices) {
+	if (s->building_chord_count == s->building_chord_size) {
+		s->building_chord_size = s->building_chord_size > 0 ? s->building_chord_size * 2 : 16;
+		s->building_chords = (chord_event*)realloc(s->building_chords, sizeof(chord_event) * s->building_chord_size);
+	}
+	chord_event* c = &s->building_chords[s->building_chord_count++];
+	c->length = length;
+	c->voices = voices;
+	return c;
+}
+
+unsigned int song_hash_notes(pattern_token* notes, int count, chord_event* chords, int chord_count) {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < count; i++) {
+		unsigned int length;
+		memcpy(&length, &notes[i].length, sizeof(length));
+		hash = (hash ^ (unsigned int)notes[i].value) * 16777619u;
+		hash = (hash ^ length) * 16777619u;
+	}
+	for (int i = 0; i < chord_count; i++) {
+		unsigned int length;
+		memcpy(&length, &chords[i].length, sizeof(length));
+		hash = (hash ^ length) * 16777619u;
+		for (int v = 0; v < chords[i].voices; v++) {
+			hash = (hash ^ (unsigned int)chords[i].pitches[v]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+int song_same_notes(note* a, pattern_token* b, int count) {
+	for (int i = 0; i < count; i++, a = a->next) {
+		if (a->value != b[i].value || a->length != b[i].length) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int song_same_chords(chord_event* a, chord_event* b, int count) {
+	for (int i = 0; i < count; i++) {
+		if (a[i].length != b[i].length || a[i].voices != b[i].voices
+			|| memcmp(a[i].pitches, b[i].pitches, sizeof(int) * a[i].voices) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void phrase_share(phrase* p, interned* e) {
+	if (!p->shared) {
+		free_notes(p->head);
+		free(p->chords);
+	}
+	p->head = e->notes;
+	p->chords = e->chords;
+	p->chord_count = e->chord_count;
+	p->shared = 1;
+}
+
+// The notes copied from a pattern line, or NULL if the line hasn't been used yet
+interned* song_find_row(song* s, pattern_file* file, int row) {
+	for (int i = 0; i < SONG_INTERN_BUCKETS; i++) {
+		for (interned* e = s->phrase_pool[i]; e != NULL; e = e->next) {
+			if (e->file == file && e->row == row) {
+				return e;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Gives the phrase the notes and chords in the building buffers, then empties them
+void song_intern(song* s, phrase* p, pattern_file* file, int row) {
+	int count = s->building_count;
+	int chord_count = s->building_chord_count;
+	unsigned int hash = song_hash_notes(s->building, count, s->building_chords, chord_count);
+	interned** bucket = &s->phrase_pool[hash % SONG_INTERN_BUCKETS];
+	s->building_count = 0;
+	s->building_chord_count = 0;
+
+	for (interned* e = *bucket; e != NULL; e = e->next) {
+		if (e->hash == hash && e->count == count && e->chord_count == chord_count
+			&& song_same_notes(e->notes, s->building, count)
+			&& song_same_chords(e->chords, s->building_chords, chord_count)) {
+			phrase_share(p, e);
+			return;
+		}
+	}
+
+	interned* e = (interned*)malloc(sizeof(interned));
+	e->hash = hash;
+	e->file = file;
+	e->row = row;
+	e->count = count;
+	e->notes = (note*)malloc(sizeof(note) * count);
+	for (int i = 0; i < count; i++) {
+		e->notes[i].value = s->building[i].value;
+		e->notes[i].length = s->building[i].length;
+		e->notes[i].next = i + 1 < count ? &e->notes[i + 1] : NULL;
+	}
+	e->chord_count = chord_count;
+	e->chords = NULL;
+	if (chord_count > 0) {
+		e->chords = (chord_event*)malloc(sizeof(chord_event) * chord_count);
+		memcpy(e->chords, s->building_chords, sizeof(chord_event) * chord_count);
+	}
+	e->next = *bucket;
+	*bucket = e;
+	phrase_share(p, e);
+}
+
+// Constraint checks, each returns 0 as soon as the song can no longer match
+
+int song_check_note(song* s, int track, int value) {
+	if (s->limits == NULL || value < 1) { // Rests always pass
+		return 1;
+	}
+	if (s->limits->low[track] > 0 && value < s->limits->low[track]) {
+		return 0;
+	}
+	if (s->limits->high[track] > 0 && value > s->limits->high[track]) {
+		return 0;
+	}
+	return 1;
+}
+
+int song_check_row(song* s, int row) {
+	if (s->limits == NULL || s->limits->rows[row] == 0) {
+		return 1;
+	}
+	return s->rows[row] == s->limits->rows[row];
+}
+
+int song_check_section(song* s, int track, section* current_section) {
+	if (s->limits == NULL) {
+		return 1;
+	}
+
+	// Notes heard in one pass through the section, a chord counts once however many voices it has
+	int count = 0;
+	phrase* p = current_section->head;
+	while (p != NULL) {
+		int notes = p->chord_count;
+		for (note* n = p->head; n != NULL; n = n->next) {
+			if (n->value > 0) {
+				notes++;
+			}
+		}
+		count += notes * (p->repetitions > 0 ? p->repetitions : 1);
+		p = p->next;
+	}
+
+	if (s->limits->min_notes[track] > 0 && count < s->limits->min_notes[track]) {
+		return 0;
+	}
+	if (s->limits->max_notes[track] > 0 && count > s->limits->max_notes[track]) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+Song generation, returns 0 if the song was abandoned for breaking a constraint.
+
+Every random choice of pattern line and chords is made first, in the order it always has been.
+The tracks are then a small graph: the drums and the piano only copy lines and chords, so they
+can be made at the same time, the bass follows the kick and the melody follows the snare. The
+bass and melody draw their notes from the song's random numbers one after the other, so the
+melody waits for the bass too and a seed makes the same song on any number of threads.
+*/
+
+int musicbox_generate(song* s) {
+	// Drum patterns, already read into the shared tables
+
+	pattern_file** patterns = s->tables->patterns;
+	for (int i = 0; i < PATTERN_COUNT; i++) {
+		if (patterns[i] == NULL) {
+			post("No drum patterns loaded");
+			return 0;
+		}
+	}
+
+	s->rows[ROW_HAT] = get_random(&s->rng, 1, patterns[PATTERN_HAT]->lines);
+	s->rows[ROW_GHOST] = get_random(&s->rng, 1, patterns[PATTERN_GHOST]->lines);
+	s->rows[ROW_SNARE] = get_random(&s->rng, 1, patterns[PATTERN_SNARE]->lines);
+	s->rows[ROW_KICK] = get_random(&s->rng, 1, patterns[PATTERN_KICK]->lines);
+
+	// Load chords
+
+	s->rows[ROW_VERSE] = chords_random_row(s->tables->verse_chords, &s->rng);
+	s->rows[ROW_CHORUS] = chords_random_row(s->tables->chorus_chords, &s->rng);
+	if (chords_row(s->tables->verse_chords, s->rows[ROW_VERSE]) == NULL
+		|| chords_row(s->tables->chorus_chords, s->rows[ROW_CHORUS]) == NULL) {
+		post("No chord progressions loaded");
+		return 0;
+	}
+	for (int i = 0; i < ROW_COUNT; i++) {
+		if (!song_check_row(s, i)) {
+			return 0;
+		}
+	}
+
+	// Tracks, in the order they are made without threads
+
+	track_job jobs[TRACK_COUNT];
+	task tasks[TRACK_COUNT];
+	const int order[TRACK_COUNT] = { TRACK_HAT, TRACK_GHOST, TRACK_SNARE, TRACK_KICK, TRACK_PIANO, TRACK_BASS, TRACK_MELODY };
+	const unsigned int after[TRACK_COUNT] = { 0, 0, 0, 0, 0, 1u << 3, (1u << 2) | (1u << 5) };
+	for (int i = 0; i < TRACK_COUNT; i++) {
+		track_job* job = &jobs[order[i]];
+		job->song = s;
+		job->track = order[i];
+		job->alone = s->pool != NULL && order[i] != TRACK_BASS && order[i] != TRACK_MELODY;
+		if (job->alone) { // Taken now, the song changes under tasks that run alongside
+			song_view(s, &job->view);
+		}
+		tasks[i].fn = (task_method)song_make_track;
+		tasks[i].arg = job;
+		tasks[i].after = after[i];
+	}
+	int ok = taskgraph_run(s->pool, tasks, TRACK_COUNT);
+
+	for (int i = 0; i < TRACK_COUNT; i++) {
+		if (jobs[order[i]].alone) {
+			song_gather(s, &jobs[order[i]]);
+		}
+	}
+	return ok;
+}
+
+/*
+A track made alone, while other tracks are made on other threads, builds and interns its phrases
+in a view of the song with its own buffers and pool, gathered back into the song once every track
+is done. Tracks that draw random numbers are never made alone.
+*/
+void song_view(song* s, song* view) {
+	*view = *s;
+	view->building = NULL;
+	view->building_count = 0;
+	view->building_size = 0;
+	view->building_chords = NULL;
+	view->building_chord_count = 0;
+	view->building_chord_size = 0;
+	for (int i = 0; i < SONG_INTERN_BUCKETS; i++) {
+		view->phrase_pool[i] = NULL;
+	}
+}
+
+int song_make_track(track_job* job) {
+	song* s = job->alone ? &job->view : job->song;
+	part p = song_part(s, job->track, job->files, job->progressions);
+	return musicbox_create_part(s, song_track_section(s, job->track), &p);
+}
+
+// Moves what a track made alone into the song
+void song_gather(song* s, track_job* job) {
+	song* view = &job->view;
+	for (int i = 0; i < SONG_SECTIONS; i++) {
+		s->inputs[NODE(job->track, i)] = view->inputs[NODE(job->track, i)];
+	}
+	for (int i = 0; i < SONG_INTERN_BUCKETS; i++) {
+		while (view->phrase_pool[i] != NULL) {
+			interned* e = view->phrase_pool[i];
+			view->phrase_pool[i] = e->next;
+			e->next = s->phrase_pool[i];
+			s->phrase_pool[i] = e;
+		}
+	}
+	free(view->building);
+	free(view->building_chords);
+}
+
+/*
+Copies a line of a pattern file, counting from 1, into the building buffer. A note name sets
+the next note's value and a length finishes it, so a name after the last length ends up on the
+empty note that ends the phrase.
+*/
+int musicbox_copy_row(song* s, pattern_file* file, int row, int track) {
+	int value = 0;
+	if (row < 1 || row > file->row_count) {
+		song_add_note(s, 0, 0); // Past the last line, the phrase stays empty
+		return 1;
+	}
+	TRACE_BEGIN(span);
+	pattern_token* t = file->tokens + file->row_start[row - 1];
+	pattern_token* end = file->tokens + file->row_start[row];
+	for (; t < end; t++) {
+		if (t->value == 0) {
+			song_add_note(s, value, t->length);
+			value = 0;
+		}
+		else {
+			if (!song_check_note(s, track, t->value)) {
+				TRACE_END(span, "musicbox_copy_row");
+				return 0;
+			}
+			value = t->value;
+		}
+	}
+	song_add_note(s, value, 0);
+	TRACE_END(span, "musicbox_copy_row");
+	return 1;
+}
+
+/*
+One measure of melody, bass or piano. kind is a constant wherever this is called, so each
+instrument gets its own copy of the loop with the other instruments' branches left out.
+back_beat holds where the followed track's notes start, ending in -1. The piano makes chord events
+rather than notes, with as many pitches as the song's piano_voices.
+*/
+GENERATOR_INLINE int musicbox_create_line(song* s, const int kind, int track,
+	float* back_beat, progression* chords, int measure) {
+	float current_beat = 0.0; // Current beat
+	float rand_length = 0.0; // Current note length
+	int rand_note = 0; // Current note value
+	int b = 0; // First back beat not before the current beat
+	unsigned short key = chords->key;
+
+	markov_model* model = s->tables->melody_model;
+	markov_history history;
+	int pitch_symbol = 0;
+	markov_begin(model, &history);
+
+	int first = 0;
+	int count = 0;
+	if (kind == PART_PIANO) {
+		count = progression_measure(chords, measure, &first); // One note per chord
+	}
+
+	for (int k = 0; kind == PART_PIANO ? k < count : current_beat < 4.0; k++) {
+		// Test to see if current note is on the back beat, the back beats are in order so carry on from the last note
+		int on_back_beat = 0;
+		if (kind != PART_PIANO) {
+			while (*(back_beat + b) != -1 && *(back_beat + b) < current_beat) {
+				b++;
+			}
+			on_back_beat = *(back_beat + b) == current_beat;
+		}
+
+		if (kind == PART_PIANO) {
+			chord* current_chord = &chords->chords[first + k];
+			rand_length = 4.0 / count;
+			chord_event* c = song_add_chord(s, rand_length, s->piano_voices);
+			for (int v = 0; v < c->voices; v++) {
+				c->pitches[v] = scale_nearest(key, current_chord->pitches[v % current_chord->voices]) + 24; // Narrow chords double their voices
+				if (!song_check_note(s, track, c->pitches[v])) {
+					return 0;
+				}
+			}
+			current_beat = current_beat + rand_length;
+			continue; // A chord is one event, it has no note of its own
+		}
+		else if (kind == PART_MELODY) {
+			int upper_note = 0;
+			if (model != NULL) { // Follow on from the notes before
+				int length_symbol = markov_sample(&model->length, history.length, &s->rng);
+				pitch_symbol = markov_sample(&model->pitch, history.pitch, &s->rng);
+				rand_length = model->length.symbols[length_symbol] / 4.0;
+				upper_note = scale_nearest(key, model->pitch.symbols[pitch_symbol]);
+			}
+			else {
+				rand_length = ((float)get_random(&s->rng, 1, 16)) / 4.0; //Get a random note length
+				upper_note = scale_step(key, 57, get_random(&s->rng, 0, 6)); // Seven notes of the key from A3
+			}
+			rand_note = on_back_beat ? upper_note : upper_note - 12; // Drop an octave off the back beat
+		}
+		else { // PART_BASS
+			rand_length = ((float)get_random(&s->rng, 1, 16)) / 4.0; //Get a random note length
+
+			chord* scale = progression_chord_at(chords, measure, current_beat); // The chord is the scale
+			int rand_note_index = get_random(&s->rng, 1, scale->voices > 1 ? scale->voices - 1 : 1);
+			if (rand_note_index >= scale->voices) {
+				rand_note_index = 0;
+			}
+			rand_note = scale_nearest(key, scale->pitches[on_back_beat ? 0 : rand_note_index]); // Root on the back beat
+		}
+
+		// Abandon the song as soon as a note falls outside the search constraints
+		if (!song_check_note(s, track, rand_note)) {
+			return 0;
+		}
+
+		// Cut the note off at the next back beat, or the end of the measure
+		if (kind != PART_PIANO) {
+			float next_beat = *(back_beat + (on_back_beat ? b + 1 : b));
+			if (next_beat == -1) {
+				if ((rand_length + current_beat) > 4.0) {
+					rand_length = 4.0 - current_beat;
+				}
+			}
+			else if ((rand_length + current_beat) > next_beat) {
+				rand_length = next_beat - current_beat;
+			}
+		}
+
+		if (kind == PART_MELODY && model != NULL) { // Remember the note as it was cut to the back beat
+			history.pitch = markov_push(&model->pitch, history.pitch, pitch_symbol);
+			history.length = markov_push(&model->length, history.length, markov_nearest(&model->length, (int)(rand_length * 4.0 + 0.5)));
+		}
+
+		song_add_note(s, rand_note, rand_length);
+
+		current_beat = current_beat + rand_length;
+	}
+	song_add_note(s, 0, 0); // Every phrase ends in an empty note
+	return 1;
+}
+
+// Parts
+
+part part_pattern(int track, pattern_file** patterns, int row) {
+	part p = { track, PART_PATTERN, 1, { 4 }, 2, patterns, row, NULL, -1, NULL };
+	return p;
+}
+
+part part_melody(phrase* follow, int follow_track, progression** progressions) {
+	part p = { TRACK_MELODY, PART_MELODY, 2, { 3, 1 }, 2, NULL, 0, follow, follow_track, progressions };
+	return p;
+}
+
+part part_bass(phrase* follow, int follow_track, progression** progressions) {
+	part p = { TRACK_BASS, PART_BASS, 4, { 1, 1, 1, 1 }, 2, NULL, 0, follow, follow_track, progressions };
+	return p;
+}
+
+part part_piano(progression** progressions) {
+	part p = { TRACK_PIANO, PART_PIANO, 4, { 1, 1, 1, 1 }, 2, NULL, 0, NULL, -1, progressions };
+	return p;
+}
+
+/*
+The part that makes a track from the song's current rows. This is where the edges of the
+regeneration graph come from: the piano plays its section's chords, the bass fits them to the
+kick and the melody fits them to the snare. files and progressions are filled in for the part.
+*/
+part song_part(song* s, int track, pattern_file** files, progression** progressions) {
+	pattern_file** patterns = s->tables->patterns;
+	progressions[1] = chords_row(s->tables->verse_chords, s->rows[ROW_VERSE]);
+	progressions[0] = chords_row(s->tables->chorus_chords, s->rows[ROW_CHORUS]);
+
+	switch (track) {
+	case TRACK_PIANO:
+		return part_piano(progressions);
+	case TRACK_BASS:
+		return part_bass(s->kick_section->head, TRACK_KICK, progressions);
+	case TRACK_MELODY:
+		return part_melody(s->snare_section->head, TRACK_SNARE, progressions);
+	case TRACK_HAT:
+		files[0] = patterns[PATTERN_HAT];
+		files[1] = patterns[PATTERN_HAT2];
+		return part_pattern(TRACK_HAT, files, s->rows[ROW_HAT]);
+	case TRACK_GHOST:
+		files[0] = files[1] = patterns[PATTERN_GHOST];
+		return part_pattern(TRACK_GHOST, files, s->rows[ROW_GHOST]);
+	case TRACK_SNARE:
+		files[0] = files[1] = patterns[PATTERN_SNARE];
+		return part_pattern(TRACK_SNARE, files, s->rows[ROW_SNARE]);
+	default:
+		files[0] = files[1] = patterns[PATTERN_KICK];
+		return part_pattern(TRACK_KICK, files, s->rows[ROW_KICK]);
+	}
+}
+
+/*
+Builds both sections of a track. Every track is laid out the same way, phrase after phrase,
+so only the part says what goes in the notes and how often each phrase repeats.
+*/
+int musicbox_create_part(song* s, section* current_section, part* p) {
+	TRACE_BEGIN(span);
+	int ok = 1;
+	float beats[MAX_BEATS];
+	float* back_beat = NULL;
+	if (p->follow != NULL) {
+		back_beat = get_beats(p->follow->head, beats, MAX_BEATS); // The same for every phrase, so found once
+	}
+
+	for (int i = 0; i < SONG_SECTIONS && ok; i++) {
+		s->inputs[NODE(p->track, i)] = (p->progressions != NULL ? NODE_BIT(NODE_CHORDS, i) : 0)
+			| (p->follow != NULL ? NODE_BIT(p->follow_track, 0) : 0);
+
+		phrase* current_phrase = current_section->head;
+		for (int m = 0; m < p->phrases && ok; m++) {
+			ok = musicbox_make_phrase(s, p, back_beat, i, m, current_phrase);
+			if (!ok) {
+				break;
+			}
+			current_phrase->repetitions = p->repetitions[m];
+
+			current_phrase->next = phrase_new();
+			current_phrase = current_phrase->next;
+		}
+		if (!ok) {
+			break;
+		}
+		current_section->repetitions = p->section_repetitions;
+		ok = song_check_section(s, p->track, current_section);
+		if (!ok) {
+			break;
+		}
+
+		current_section->next = section_new();
+		current_section = current_section->next;
+	}
+	if (back_beat != beats) {
+		free(back_beat);
+	}
+	TRACE_END(span, "musicbox_create_part");
+	return ok;
+}
+
+/*
+Gives a phrase its notes, interned with the rest of the song. Only the notes change, so a phrase
+that is playing carries on with the notes it had until it next starts.
+*/
+int musicbox_make_phrase(song* s, part* p, float* back_beat, int section_index, int measure, phrase* current_phrase) {
+	pattern_file* file = p->kind == PART_PATTERN ? *(p->patterns + section_index) : NULL;
+	interned* known = file != NULL ? song_find_row(s, file, p->row) : NULL;
+	if (known != NULL) { // Checked against the constraints when it was first copied
+		phrase_share(current_phrase, known);
+		return 1;
+	}
+
+	int ok;
+	if (p->follow != NULL && s->deadline > 0 && systimer_gettime() > s->deadline) {
+		ok = musicbox_create_placeholder(s, p, section_index, measure);
+	}
+	else {
+		ok = musicbox_create_measure(s, p, back_beat, section_index, measure);
+	}
+	if (!ok) {
+		s->building_count = 0;
+		s->building_chord_count = 0;
+		return 0;
+	}
+	song_intern(s, current_phrase, file, p->row);
+	return 1;
+}
+
+// The notes of one phrase, measure counts the phrases of the section from 0
+int musicbox_create_measure(song* s, part* p, float* back_beat, int section_index, int measure) {
+	TRACE_BEGIN(span);
+	progression* chords = p->progressions != NULL ? *(p->progressions + section_index) : NULL;
+	int ok;
+
+	switch (p->kind) {
+	case PART_MELODY:
+		ok = musicbox_create_line(s, PART_MELODY, TRACK_MELODY, back_beat, chords, measure);
+		break;
+	case PART_BASS:
+		ok = musicbox_create_line(s, PART_BASS, TRACK_BASS, back_beat, chords, measure);
+		break;
+	case PART_PIANO:
+		ok = musicbox_create_line(s, PART_PIANO, TRACK_PIANO, back_beat, chords, measure);
+		break;
+	default:
+		ok = musicbox_copy_row(s, *(p->patterns + section_index), p->row, p->track);
+		break;
+	}
+	TRACE_END(span, "musicbox_create_measure");
+	return ok;
+}
+
+/*
+A measure of melody or bass that costs almost nothing, for when the deadline has passed: the bass
+holds the root of each chord and the melody rests. Draws no random numbers.
+*/
+int musicbox_create_placeholder(song* s, part* p, int section_index, int measure) {
+	progression* chords = *(p->progressions + section_index);
+	s->placeholders++;
+	if (p->kind == PART_BASS) {
+		int first = 0;
+		int count = progression_measure(chords, measure, &first);
+		for (int k = 0; k < count; k++) {
+			int root = scale_nearest(chords->key, chords->chords[first + k].pitches[0]);
+			if (!song_check_note(s, p->track, root)) {
+				return 0;
+			}
+			song_add_note(s, root, 4.0 / count);
+		}
+	}
+	else {
+		song_add_note(s, 0, 4.0);
+	}
+	song_add_note(s, 0, 0);
+	return 1;
+}
+
+// Regeneration
+
+// Every node made from a node in changed, directly or further down, together with changed
+unsigned int song_downstream(song* s, unsigned int changed) {
+	unsigned int remade = changed;
+	int grew = 1;
+	while (grew) {
+		grew = 0;
+		for (int n = 0; n < NODE_COUNT; n++) {
+			if (!(remade & (1u << n)) && (s->inputs[n] & remade)) {
+				remade |= 1u << n;
+				grew = 1;
+			}
+		}
+	}
+	return remade;
+}
+
+section* song_track_section(song* s, int track) {
+	section* sections[TRACK_COUNT] = {
+		s->piano_section, s->bass_section, s->melody_section,
+		s->hat_section, s->ghost_section, s->snare_section, s->kick_section
+	};
+	return sections[track];
+}
+
+/*
+Makes part of a song again with the next random numbers and keeps everything that doesn't depend
+on it. kind is a track or NODE_CHORDS, section_index 0, 1 or -1 for both. Drum tracks copy one
+pattern line into both sections so they always change together, and the piano plays its chords
+as they are, so remaking it picks new chords. Phrases keep their place in the song and only get
+new notes, so this can run between the measures of a song that is playing.
+Returns the NODE_BITs of every node remade, 0 if it failed.
+*/
+unsigned int song_regenerate(song* s, int kind, int section_index) {
+	const int track_rows[TRACK_COUNT] = { -1, -1, -1, ROW_HAT, ROW_GHOST, ROW_SNARE, ROW_KICK };
+	pattern_file* files[SONG_SECTIONS];
+	progression* progressions[SONG_SECTIONS];
+	int drums = kind < TRACK_COUNT && track_rows[kind] >= 0;
+	if (kind == TRACK_PIANO) {
+		kind = NODE_CHORDS;
+	}
+
+	unsigned int changed = 0;
+	for (int i = 0; i < SONG_SECTIONS; i++) {
+		if (section_index < 0 || section_index == i || drums) {
+			changed |= NODE_BIT(kind, i);
+		}
+	}
+
+	// New choices for the nodes asked for, the nodes downstream only follow them
+
+	int kept[ROW_COUNT];
+	for (int i = 0; i < ROW_COUNT; i++) {
+		kept[i] = s->rows[i];
+	}
+	if (kind == NODE_CHORDS) {
+		if (changed & NODE_BIT(NODE_CHORDS, 0)) {
+			s->rows[ROW_CHORUS] = chords_random_row(s->tables->chorus_chords, &s->rng);
+		}
+		if (changed & NODE_BIT(NODE_CHORDS, 1)) {
+			s->rows[ROW_VERSE] = chords_random_row(s->tables->verse_chords, &s->rng);
+		}
+	}
+	else if (drums) {
+		song_part(s, kind, files, progressions);
+		s->rows[track_rows[kind]] = get_random(&s->rng, 1, files[0]->lines);
+	}
+	for (int i = 0; i < ROW_COUNT; i++) {
+		if (!song_check_row(s, i)) { // The constraints pin this choice, so the song stays as it was
+			for (int k = 0; k < ROW_COUNT; k++) {
+				s->rows[k] = kept[k];
+			}
+			return 0;
+		}
+	}
+	unsigned int remade = song_downstream(s, changed);
+
+	// Remade in the order musicbox_generate makes them, so tracks that are followed come first
+
+	const int order[TRACK_COUNT] = { TRACK_HAT, TRACK_GHOST, TRACK_SNARE, TRACK_KICK, TRACK_PIANO, TRACK_BASS, TRACK_MELODY };
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		int track = order[t];
+		if (!(remade & (NODE_BIT(track, 0) | NODE_BIT(track, 1)))) {
+			continue;
+		}
+		part p = song_part(s, track, files, progressions);
+		if (p.progressions != NULL && (progressions[0] == NULL || progressions[1] == NULL)) {
+			return 0;
+		}
+		float beats[MAX_BEATS];
+		float* back_beat = p.follow != NULL ? get_beats(p.follow->head, beats, MAX_BEATS) : NULL;
+
+		int ok = 1;
+		section* current_section = song_track_section(s, track);
+		for (int i = 0; i < SONG_SECTIONS && ok; i++, current_section = current_section->next) {
+			if (!(remade & NODE_BIT(track, i))) {
+				continue;
+			}
+			phrase* current_phrase = current_section->head;
+			for (int m = 0; m < p.phrases && ok; m++, current_phrase = current_phrase->next) {
+				ok = musicbox_make_phrase(s, &p, back_beat, i, m, current_phrase);
+			}
+		}
+		if (back_beat != beats) {
+			free(back_beat);
+		}
+		if (!ok) {
+			return 0;
+		}
+	}
+	return remade;
+}
@@ -25,6 +25,22 @@ typedef struct {
 
 // Hash Functions
 
+unsigned int hash(const char* key) {
+	unsigned long int value = 0;
+	unsigned int i = 0;
+	unsigned int key_len = strlen(key);
+
+	// do several rounds of multiplication
+	for (; i < key_len; ++i) {
+		value = value * 37 + key[i];
+	}
+
+	// make sure value is 0 <= value < table size
+	value = value % TABLE_SIZE;
+
+	return value;
+}
+
 ht_t* ht_create(void) {
 	// allocate table
 	ht_t* hashtable = malloc(sizeof(ht_t) * 1);
@@ -43,9 +59,8 @@ ht_t* ht_create(void) {
 
 entry_t* ht_pair(const char* key, const int value) {
 	// allocate the entry
-	entry_t* entry = malloc(sizeof(entry) * 1);
+	entry_t* entry = malloc(sizeof(entry_t) * 1);
 	entry->key = malloc(strlen(key) + 1);
-	entry->value = malloc(sizeof(int));
 
 	// copy the key and value in place
 	strcpy(entry->key, key);
@@ -76,8 +91,6 @@ void ht_set(ht_t* hashtable, const char* key, const int value) {
 		// check key
 		if (strcmp(entry->key, key) == 0) {
 			// match found, replace value
-			free(entry->value);
-			entry->value = malloc(sizeof(int));
 			entry->value = value;
 			return;
 		}
@@ -99,7 +112,7 @@ int ht_get(ht_t* hashtable, const char* key) {
 
 	// no slot means no entry
 	if (entry == NULL) {
-		return NULL;
+		return 0;
 	}
 
 	// walk through each entry in the slot, which could just be a single thing
@@ -114,7 +127,7 @@ int ht_get(ht_t* hashtable, const char* key) {
 	}
 
 	// reaching here means there were >= 1 entries but no key match
-	return NULL;
+	return 0;
 }
 
 void ht_dump(ht_t* hashtable) {
@@ -141,18 +154,19 @@ void ht_dump(ht_t* hashtable) {
 	}
 }
 
-unsigned int hash(const char* key) {
-	unsigned long int value = 0;
-	unsigned int i = 0;
-	unsigned int key_len = strlen(key);
-
-	// do several rounds of multiplication
-	for (; i < key_len; ++i) {
-		value = value * 37 + key[i];
+void ht_free(ht_t* hashtable) {
+	if (hashtable == NULL) {
+		return;
 	}
-
-	// make sure value is 0 <= value < table size
-	value = value % TABLE_SIZE;
-
-	return value;
-}
\ No newline at end of file
+	for (int i = 0; i < TABLE_SIZE; ++i) {
+		entry_t* entry = hashtable->entries[i];
+		while (entry != NULL) {
+			entry_t* next = entry->next;
+			free(entry->key);
+			free(entry);
+			entry = next;
+		}
+	}
+	free(hashtable->entries);
+	free(hashtable);
+}
@@ -0,0 +1,308 @@
+/**
+	@file
+	markov - melody pitch and length chosen from the notes before them, read from a model file
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MARKOV_MAX_SYMBOLS 32 // Most pitches or lengths a model can list
+#define MARKOV_MAX_CONTEXTS 4096 // Most histories a table can tell apart
+#define MARKOV_ONE 32768 // Probability 1 in alias thresholds, one more than next_random can return
+#define MARKOV_NEAREST 64 // Symbols below this get their nearest index from a table
+
+// Structs
+
+/*
+One cell per symbol per history. To sample, pick a column with the top of a random number and
+keep it if the bottom is under its threshold, or take its alias otherwise (Vose's alias method),
+so a draw costs one random number whatever the weights were.
+*/
+typedef struct markov_cell {
+	unsigned short threshold;
+	unsigned char alias;
+	unsigned char unused;
+} markov_cell;
+
+typedef struct markov_table {
+	int symbols[MARKOV_MAX_SYMBOLS]; // Midi notes, or lengths in 16th notes
+	int count;
+	int contexts; // count to the power of the order
+	markov_cell* cells; // contexts + 1 rows of count cells, the last for the start of a phrase
+	unsigned char nearest[MARKOV_NEAREST]; // Index of the closest symbol to each small value
+} markov_table;
+
+typedef struct markov_model {
+	int order; // Notes of history each choice depends on
+	markov_table pitch;
+	markov_table length;
+} markov_model;
+
+// Where a melody is, as row numbers into the two tables
+typedef struct markov_history {
+	int pitch;
+	int length;
+} markov_history;
+
+// Building tables
+
+// Turns one row of weights into alias cells
+void markov_alias(markov_cell* row, double* weights, int count) {
+	double scaled[MARKOV_MAX_SYMBOLS];
+	int small[MARKOV_MAX_SYMBOLS];
+	int large[MARKOV_MAX_SYMBOLS];
+	int small_count = 0;
+	int large_count = 0;
+	double total = 0;
+
+	for (int i = 0; i < count; i++) {
+		total += weights[i] > 0 ? weights[i] : 0;
+	}
+	for (int i = 0; i < count; i++) {
+		scaled[i] = total > 0 ? (weights[i] > 0 ? weights[i] : 0) * count / total : 1.0; // No weights means uniform
+		if (scaled[i] < 1.0) {
+			small[small_count++] = i;
+		}
+		else {
+			large[large_count++] = i;
+		}
+	}
+
+	while (small_count > 0 && large_count > 0) {
+		int s = small[--small_count];
+		int l = large[--large_count];
+		row[s].threshold = (unsigned short)(scaled[s] * MARKOV_ONE);
+		row[s].alias = (unsigned char)l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0) {
+			small[small_count++] = l;
+		}
+		else {
+			large[large_count++] = l;
+		}
+	}
+	// What is left is 1 apart from rounding
+	while (large_count > 0) {
+		int l = large[--large_count];
+		row[l].threshold = MARKOV_ONE;
+		row[l].alias = (unsigned char)l;
+	}
+	while (small_count > 0) {
+		int s = small[--small_count];
+		row[s].threshold = MARKOV_ONE;
+		row[s].alias = (unsigned char)s;
+	}
+}
+
+int markov_index(markov_table* t, int symbol) {
+	for (int i = 0; i < t->count; i++) {
+		if (t->symbols[i] == symbol) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Index of the closest symbol, for lengths cut short by the back beat
+int markov_nearest(markov_table* t, int symbol) {
+	if (symbol >= 0 && symbol < MARKOV_NEAREST) {
+		return t->nearest[symbol];
+	}
+	int best = 0;
+	for (int i = 1; i < t->count; i++) {
+		if (abs(t->symbols[i] - symbol) < abs(t->symbols[best] - symbol)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+int markov_table_init(markov_table* t, int order) {
+	t->contexts = 1;
+	for (int i = 0; i < order; i++) {
+		t->contexts *= t->count;
+		if (t->contexts > MARKOV_MAX_CONTEXTS) {
+			return 0;
+		}
+	}
+	t->cells = (markov_cell*)malloc(sizeof(markov_cell) * (t->contexts + 1) * t->count);
+
+	for (int v = 0; v < MARKOV_NEAREST; v++) {
+		int best = 0;
+		for (int i = 1; i < t->count; i++) {
+			if (abs(t->symbols[i] - v) < abs(t->symbols[best] - v)) {
+				best = i;
+			}
+		}
+		t->nearest[v] = (unsigned char)best;
+	}
+
+	// Uniform until the file says otherwise
+	double weights[MARKOV_MAX_SYMBOLS];
+	for (int i = 0; i < t->count; i++) {
+		weights[i] = 1.0;
+	}
+	for (int c = 0; c <= t->contexts; c++) {
+		markov_alias(t->cells + c * t->count, weights, t->count);
+	}
+	return 1;
+}
+
+// Reads whitespace separated numbers, returns how many were read
+int markov_numbers(char* text, int* values, int max) {
+	int n = 0;
+	char* end;
+	for (;;) {
+		long v = strtol(text, &end, 10);
+		if (end == text || n == max) {
+			return n;
+		}
+		values[n++] = (int)v;
+		text = end;
+	}
+}
+
+/*
+A row of weights. "pitch 60 62 : ..." applies after 60 then 62, "pitch start : ..." to the first
+note of a phrase, and "pitch : ..." to every history without a row of its own, the start of a
+phrase included. Rows are applied in file order.
+*/
+int markov_row(markov_model* m, markov_table* t, char* text) {
+	char* colon = strchr(text, ':');
+	int history[MARKOV_MAX_SYMBOLS];
+	int values[MARKOV_MAX_SYMBOLS];
+	double weights[MARKOV_MAX_SYMBOLS];
+
+	if (colon == NULL || t->cells == NULL) {
+		return 0;
+	}
+	*colon = 0;
+	int history_count = markov_numbers(text, history, MARKOV_MAX_SYMBOLS);
+	if (markov_numbers(colon + 1, values, MARKOV_MAX_SYMBOLS) != t->count) {
+		return 0;
+	}
+	for (int i = 0; i < t->count; i++) {
+		weights[i] = values[i];
+	}
+
+	while (*text == ' ' || *text == '\t') {
+		text++;
+	}
+	if (strncmp(text, "start", 5) == 0) {
+		markov_alias(t->cells + t->contexts * t->count, weights, t->count);
+		return 1;
+	}
+	if (history_count == 0) {
+		for (int c = 0; c <= t->contexts; c++) {
+			markov_alias(t->cells + c * t->count, weights, t->count);
+		}
+		return 1;
+	}
+	if (history_count != m->order) {
+		return 0;
+	}
+	int context = 0;
+	for (int i = 0; i < history_count; i++) {
+		int index = markov_index(t, history[i]);
+		if (index < 0) {
+			return 0;
+		}
+		context = context * t->count + index;
+	}
+	markov_alias(t->cells + context * t->count, weights, t->count);
+	return 1;
+}
+
+void markov_free(markov_model* m) {
+	if (m == NULL) {
+		return;
+	}
+	free(m->pitch.cells);
+	free(m->length.cells);
+	free(m);
+}
+
+/*
+Model files are plain text:
+	order <n>
+	pitches <midi notes>
+	lengths <16th notes>
+	pitch [<n earlier pitches> | start] : <a weight for each pitch>
+	length [<n earlier lengths> | start] : <a weight for each length>
+The order, pitches and lengths come first. Lines starting with # are ignored.
+*/
+markov_model* markov_load(char* filename) {
+	FILE* fp = fopen(filename, "r");
+	char line[1024];
+	int line_number = 0;
+
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	markov_model* m = (markov_model*)malloc(sizeof(markov_model));
+	memset(m, 0, sizeof(markov_model));
+	m->order = 1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line_number++;
+		int ok = 1;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || line[0] == 0) {
+			continue;
+		}
+		if (strncmp(line, "order", 5) == 0) {
+			m->order = atoi(line + 5);
+			ok = m->order >= 1 && m->order <= 4;
+		}
+		else if (strncmp(line, "pitches", 7) == 0) {
+			m->pitch.count = markov_numbers(line + 7, m->pitch.symbols, MARKOV_MAX_SYMBOLS);
+			ok = m->pitch.count > 0 && markov_table_init(&m->pitch, m->order);
+		}
+		else if (strncmp(line, "lengths", 7) == 0) {
+			m->length.count = markov_numbers(line + 7, m->length.symbols, MARKOV_MAX_SYMBOLS);
+			ok = m->length.count > 0 && markov_table_init(&m->length, m->order);
+		}
+		else if (strncmp(line, "pitch", 5) == 0) {
+			ok = markov_row(m, &m->pitch, line + 5);
+		}
+		else if (strncmp(line, "length", 6) == 0) {
+			ok = markov_row(m, &m->length, line + 6);
+		}
+		else {
+			ok = 0;
+		}
+		if (!ok) {
+			post("%s line %d: not understood", filename, line_number);
+		}
+	}
+	fclose(fp);
+
+	if (m->pitch.cells == NULL || m->length.cells == NULL) {
+		post("%s: needs pitches and lengths", filename);
+		markov_free(m);
+		return NULL;
+	}
+	return m;
+}
+
+// Sampling
+
+int markov_sample(markov_table* t, int context, unsigned int* rng) {
+	unsigned int u = (unsigned int)next_random(rng) * (unsigned int)t->count; // Below count * MARKOV_ONE
+	unsigned int column = u >> 15;
+	markov_cell* cell = t->cells + context * t->count + column;
+	return (u & (MARKOV_ONE - 1)) < cell->threshold ? (int)column : cell->alias;
+}
+
+// Adds a symbol to a history, dropping the oldest. From the start row this gives the symbol's own row.
+int markov_push(markov_table* t, int context, int symbol) {
+	return (context * t->count + symbol) % t->contexts;
+}
+
+// Puts a phrase at its start, before any notes, so the first note is drawn from the start rows
+void markov_begin(markov_model* m, markov_history* h) {
+	h->pitch = m != NULL ? m->pitch.contexts : 0;
+	h->length = m != NULL ? m->length.contexts : 0;
+}
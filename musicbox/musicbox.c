@@ -6,13 +6,42 @@
 
 #include "ext.h"
 #include "ext_obex.h"
+#include "ext_systhread.h"
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "D:/music_algorithm/trace.h"
 #include "D:/music_algorithm/hash.h"
 #include "D:/music_algorithm/midi_notes.h"
 #include "D:/music_algorithm/extra.h"
+#include "D:/music_algorithm/scales.h"
+#include "D:/music_algorithm/chords.h"
+#include "D:/music_algorithm/markov.h"
+#include "D:/music_algorithm/tables.h"
+#include "D:/music_algorithm/taskgraph.h"
+#include "D:/music_algorithm/generator.h"
+#include "D:/music_algorithm/search.h"
+#include "D:/music_algorithm/playlist.h"
+#include "D:/music_algorithm/events.h"
+#include "D:/music_algorithm/features.h"
+#include "D:/music_algorithm/render.h"
+#include "D:/music_algorithm/ring.h"
+#include "D:/music_algorithm/eventlog.h"
+#include "D:/music_algorithm/tempo.h"
+#include "D:/music_algorithm/transport.h"
+
+#define REGEN_PENDING 8 // Regenerate requests that can wait for the next measure
+
+// Everything scheduled by song position, each on its own clock or on a shared transport
+enum {
+	STREAM_SECTION, // m_clock
+	STREAM_MEASURE,
+	STREAM_TRACK, // One for each track, TRACK_PIANO first
+	STREAM_BATCH = STREAM_TRACK + TRACK_COUNT,
+	STREAM_REPLAY,
+	STREAM_COUNT
+};
 
 // OBJECT STRUCT
 
@@ -22,7 +51,10 @@ typedef struct _musicbox
 
 	// Outlets
 
-	void* piano_outlet_length; // rightmost outlet
+	void* batch_outlet; // One list per timestamp in batch mode, rightmost outlet
+	void* search_outlet; // Seeds found by search, right of the piano outlets
+
+	void* piano_outlet_length; // Rightmost of the note outlets, left of the search outlet
 	void* piano_outlet_value_1;
 	void* piano_outlet_value_2;
 	void* piano_outlet_value_3;
@@ -58,13 +90,13 @@ typedef struct _musicbox
 	void* ghost_clock;
 	void* snare_clock;
 	void* kick_clock;
+	void* batch_clock;
+	void* replay_clock;
+	void* regen_clock;
 
 	// Linked lists
 
-	note* piano1_current;
-	note* piano2_current;
-	note* piano3_current;
-	note* piano4_current;
+	int piano_chord; // The piano plays chords, this is the index of the current one in piano_phrase
 
 	note* bass_current;
 	note* melody_current;
@@ -75,25 +107,18 @@ typedef struct _musicbox
 
 	// Phrases
 
-	phrase* piano1_phrase;
-	phrase* piano2_phrase;
-	phrase* piano3_phrase;
-	phrase* piano4_phrase;
-	
+	phrase* piano_phrase;
 	phrase* bass_phrase;
 	phrase* melody_phrase;
 	phrase* hat_phrase;
 	phrase* ghost_phrase;
 	phrase* snare_phrase;
 	phrase* kick_phrase;
+	int phrase_hold[6]; // Repetitions each phrase player started its phrase with, see next_phrase
 
 	// Sections
 
-	section* piano1_section;
-	section* piano2_section;
-	section* piano3_section;
-	section* piano4_section;
-
+	section* piano_section;
 	section* bass_section;
 	section* melody_section;
 	section* hat_section;
@@ -108,10 +133,81 @@ typedef struct _musicbox
 	float beat; // Beat length in milliseconds
 	long runs; // Loop repetitions
 	long measures;
+	long voices; // Pitches in each piano chord
+	double budget; // Milliseconds a bang may spend generating, 0 for no limit
+	taskgraph_pool* pool; // Threads that help a bang make its song's tracks, NULL for none
 
 	int play;
 
-	ht_t* hash_note_names; // Hashtable for getting Midi note values
+	// Timing
+
+	tempo_map timing; // Song position to scheduler time, shared by every track
+	double position[TRACK_COUNT]; // Song position of each track's current note, in beats
+	double measure_position; // Start of the next measure
+	double section_position; // Start of the next pass through the sections
+	int measure_armed; // Set while measure_clock waits, so a tempo change can move it
+	int section_armed; // Set while m_clock waits
+	int track_armed[TRACK_COUNT]; // Set while a track's clock waits for its next note
+
+	// Shared transport
+
+	transport* transport; // Tempo and scheduling shared with other instances, NULL to use the clocks above
+	transport_stream streams[STREAM_COUNT]; // Stand in for the clocks while on a transport
+	void* stream_clocks[STREAM_COUNT]; // The clocks, in stream order
+	double origin; // Transport position of the song's beat 0, 0 without a transport
+
+	tables* tables; // Note names, patterns, chords and melody model, shared with every other instance
+
+	song* song; // Generated material, the sections above walk through it
+
+	// Seed search
+
+	constraints limits; // Set by the constrain message
+	search* search; // Running search, NULL when idle
+	void* search_qelem; // Streams matches out of the search outlet
+
+	// Feature analysis
+
+	analysis* analysis; // Running analysis, NULL when idle
+	t_symbol* analysis_file; // Where its vectors are written when it finishes
+	void* analysis_qelem;
+
+	// Offline rendering
+
+	render_batch* renders; // Running range of seeds, NULL when idle
+	void* render_qelem;
+
+	// Playlist
+
+	playlist* playlist; // Songs to play after this one, NULL until something is queued
+
+	// Batch mode
+
+	int batch; // Send simultaneous events as one list instead of the per track outlets
+	event_list timeline; // Every note of the song in time order
+	long timeline_next; // Next event to send
+	t_atom* batch_list; // Room for the longest group of events in the timeline
+	long batch_list_size; // Events it has room for
+
+	// Shared memory export
+
+	ring* ring; // Every note played is also published here, NULL when off
+
+	// Recording and replay
+
+	eventlog* recording; // Every note played is also appended here, NULL when off
+	t_symbol* record_file; // Where the recording is written when it stops
+	double record_offset; // Beats recorded before the song's beat 0, so times carry on across a bang
+	eventlog_map* replay; // Log that bang plays instead of generating, NULL when off
+	t_symbol* replay_file;
+	long replay_next; // Next record to send
+	t_atom* replay_list; // Room for the longest group of records in the log, batch mode and wide chords
+
+	// Regeneration
+
+	int regen_kind[REGEN_PENDING]; // Waiting to be applied at the next measure, see musicbox_regenerate
+	int regen_section[REGEN_PENDING];
+	int regen_count;
 
 } t_musicbox;
 
@@ -120,7 +216,23 @@ typedef struct _musicbox
 void musicbox_bang(t_musicbox* x);
 void musicbox_in1(t_musicbox* x, long n);
 void musicbox_in2(t_musicbox* x, unsigned int n);
+void musicbox_tempo(t_musicbox* x, double bpm, double beats);
+void musicbox_retime(t_musicbox* x, double bpm, double beats);
+tempo_map* musicbox_timing(t_musicbox* x);
+double musicbox_now(t_musicbox* x);
+double musicbox_delay(t_musicbox* x, double beat);
+double musicbox_ms(t_musicbox* x, double beat, double length);
+double musicbox_length(t_musicbox* x, int track, float length);
+void musicbox_advance(t_musicbox* x, int track, float length);
+void musicbox_start(t_musicbox* x, double bpm);
+void musicbox_arm(t_musicbox* x, int stream, int armed);
+void musicbox_at(t_musicbox* x, int stream, double beat);
+void musicbox_soon(t_musicbox* x, int stream, double beat);
+void musicbox_unset(t_musicbox* x, int stream);
+void musicbox_transport(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
 void *musicbox_new(t_symbol *s, long argc, t_atom *argv);
+void musicbox_prepare(t_musicbox* x);
+tables* musicbox_tables(t_musicbox* x);
 void musicbox_free(t_musicbox *x);
 void musicbox_assist(t_musicbox *x, void *b, long m, long a, char *s);
 void musicbox_task(t_musicbox* x);
@@ -132,18 +244,38 @@ void musicbox_hat_task(t_musicbox* x);
 void musicbox_ghost_task(t_musicbox* x);
 void musicbox_snare_task(t_musicbox* x);
 void musicbox_kick_task(t_musicbox* x);
-void musicbox_create_phrase(t_musicbox* x, phrase* current_phrase, char* filename, int rand_line);
-void musicbox_create_section(t_musicbox* x, section* current_section, char** filename, int rand_line);
-void musicbox_loadfile(t_musicbox* x, note* current_note, char* filename, int rand_line);
-void musicbox_create_melody(t_musicbox* x, note* current_note, note* follow_beat);
-void musicbox_create_melody_phrase(t_musicbox* x, phrase* current_phrase, phrase* follow_phrase);
-void musicbox_create_melody_section(t_musicbox* x, section* current_section, phrase* follow_phrase);
-void musicbox_create_bass(t_musicbox* x, note* current_note, note* follow_beat, int* scale);
-void musicbox_create_bass_phrase(t_musicbox* x, phrase* current_phrase, phrase* follow_phrase, int** progression);
-void musicbox_create_bass_section(t_musicbox* x, section* current_section, phrase* follow_phrase, int*** progressions);
-void musicbox_create_piano(t_musicbox* x, note* current_note, int* scale, int piano_note);
-void musicbox_create_piano_phrase(t_musicbox* x, phrase* current_phrase, int** progression, int piano_note);
-void musicbox_create_piano_section(t_musicbox* x, section* current_section, int*** progressions, int piano_note);
+void musicbox_batch_task(t_musicbox* x);
+void musicbox_timeline(t_musicbox* x);
+void musicbox_batch(t_musicbox* x, long n);
+void musicbox_voices(t_musicbox* x, long n);
+void musicbox_budget(t_musicbox* x, double ms);
+void musicbox_threads(t_musicbox* x, long n);
+void musicbox_export(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_publish(t_musicbox* x, int track, int value, float length);
+void musicbox_publish_at(t_musicbox* x, double beat, int track, int value, float length);
+void musicbox_record(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_record_stop(t_musicbox* x);
+void musicbox_replay(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_replay_stop(t_musicbox* x);
+void musicbox_replay_task(t_musicbox* x);
+void musicbox_cue(t_musicbox* x);
+void musicbox_regenerate(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_regen_apply(t_musicbox* x);
+int musicbox_handoff(t_musicbox* x);
+playlist* musicbox_playlist(t_musicbox* x);
+void musicbox_queue(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_prefetch(t_musicbox* x, long n);
+void musicbox_constrain(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_search(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_search_report(t_musicbox* x);
+void musicbox_analyze(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_analyze_report(t_musicbox* x);
+int musicbox_pitch(t_musicbox* x, t_atom* a);
+void musicbox_render(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_render_report(t_musicbox* x);
+void musicbox_trace(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
+void musicbox_startup(t_musicbox* x, long n);
+void musicbox_ingest(t_musicbox* x, t_symbol* s, long argc, t_atom* argv);
 
 // GLOBAL CLASS POINTER VARIABLE
 
@@ -165,6 +297,26 @@ void ext_main(void *r)
 
 	class_addmethod(c, (method)musicbox_in1, "in1", A_LONG, 0);
 	class_addmethod(c, (method)musicbox_in2, "in2", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_tempo, "tempo", A_FLOAT, A_DEFFLOAT, 0);
+	class_addmethod(c, (method)musicbox_transport, "transport", A_GIMME, 0);
+
+	class_addmethod(c, (method)musicbox_constrain, "constrain", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_search, "search", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_analyze, "analyze", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_render, "render", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_queue, "queue", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_prefetch, "prefetch", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_batch, "batch", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_voices, "voices", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_budget, "budget", A_FLOAT, 0);
+	class_addmethod(c, (method)musicbox_threads, "threads", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_export, "export", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_record, "record", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_replay, "replay", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_regenerate, "regenerate", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_trace, "trace", A_GIMME, 0);
+	class_addmethod(c, (method)musicbox_startup, "startup", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_ingest, "ingest", A_GIMME, 0);
 
 	class_register(CLASS_BOX, c); /* CLASS_NOBOX */
 	musicbox_class = c;
@@ -186,6 +338,8 @@ void* musicbox_new(t_symbol* s, long argc, t_atom* argv)
 
 	// Outlets
 
+	x->batch_outlet = listout(x);
+	x->search_outlet = intout(x);
 	x->piano_outlet_length = floatout(x);
 	x->piano_outlet_value_1 = intout(x);
 	x->piano_outlet_value_2 = intout(x);
@@ -210,59 +364,12 @@ void* musicbox_new(t_symbol* s, long argc, t_atom* argv)
 	x->kick_outlet_length = floatout(x);
 	x->kick_outlet_value = intout(x);
 
-	// Clocks
+	// Clocks, tables, song and search are made when first needed, see musicbox_prepare
 
-	x->m_clock = clock_new((t_musicbox*)x, (method)musicbox_task);
-	x->measure_clock = clock_new((t_musicbox*)x, (method)musicbox_measure_task);
-	x->piano_clock = clock_new((t_musicbox*)x, (method)musicbox_piano_task);
-	x->bass_clock = clock_new((t_musicbox*)x, (method)musicbox_bass_task);
-	x->melody_clock = clock_new((t_musicbox*)x, (method)musicbox_melody_task);
-	x->hat_clock = clock_new((t_musicbox*)x, (method)musicbox_hat_task);
-	x->ghost_clock = clock_new((t_musicbox*)x, (method)musicbox_ghost_task);
-	x->snare_clock = clock_new((t_musicbox*)x, (method)musicbox_snare_task);
-	x->kick_clock = clock_new((t_musicbox*)x, (method)musicbox_kick_task);
-
-	// Phrases & Linked Lists
-
-	x->piano1_section = (struct section*)malloc(sizeof(struct section));
-	x->piano1_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->piano1_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->piano2_section = (struct section*)malloc(sizeof(struct section));
-	x->piano2_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->piano2_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->piano3_section = (struct section*)malloc(sizeof(struct section));
-	x->piano3_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->piano3_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->piano4_section = (struct section*)malloc(sizeof(struct section));
-	x->piano4_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->piano4_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->bass_section = (struct section*)malloc(sizeof(struct section));
-	x->bass_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->bass_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->melody_section = (struct section*)malloc(sizeof(struct section));
-	x->melody_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->melody_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->hat_section = (struct section*)malloc(sizeof(struct section));
-	x->hat_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->hat_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->ghost_section = (struct section*)malloc(sizeof(struct section));
-	x->ghost_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->ghost_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->snare_section = (struct section*)malloc(sizeof(struct section));
-	x->snare_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->snare_section->head->head = (struct note*)malloc(sizeof(struct note));
-
-	x->kick_section = (struct section*)malloc(sizeof(struct section));
-	x->kick_section->head = (struct phrase*)malloc(sizeof(struct phrase));
-	x->kick_section->head->head = (struct note*)malloc(sizeof(struct note));
+	x->m_clock = NULL;
+	x->tables = NULL;
+	x->song = NULL;
+	x->search_qelem = NULL;
 
 	// Other variables
 
@@ -270,19 +377,107 @@ void* musicbox_new(t_symbol* s, long argc, t_atom* argv)
 	x->runs = 0;
 	x->seed = 0;
 	x->measures = 0;
+	x->voices = PIANO_VOICES;
+	x->budget = 0;
+	x->pool = NULL;
+	for (int i = 0; i < 6; i++) {
+		x->phrase_hold[i] = 0;
+	}
 	x->play = 0;
+	x->batch = 0;
+	events_init(&x->timeline);
+	x->timeline_next = 0;
+	x->batch_list = NULL;
+	x->batch_list_size = 0;
+	x->ring = NULL;
+	x->recording = NULL;
+	x->record_file = NULL;
+	x->record_offset = 0;
+	x->replay = NULL;
+	x->replay_file = NULL;
+	x->replay_next = 0;
+	x->replay_list = NULL;
+	x->regen_count = 0;
+	tempo_start(&x->timing, 0, 0);
+	x->measure_position = 0;
+	x->section_position = 0;
+	x->measure_armed = 0;
+	x->section_armed = 0;
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		x->position[t] = 0;
+		x->track_armed[t] = 0;
+	}
+	x->transport = NULL;
+	x->origin = 0;
+	transport_stream_init(&x->streams[STREAM_SECTION], (transport_method)musicbox_task, x);
+	transport_stream_init(&x->streams[STREAM_MEASURE], (transport_method)musicbox_measure_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_PIANO], (transport_method)musicbox_piano_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_BASS], (transport_method)musicbox_bass_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_MELODY], (transport_method)musicbox_melody_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_HAT], (transport_method)musicbox_hat_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_GHOST], (transport_method)musicbox_ghost_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_SNARE], (transport_method)musicbox_snare_task, x);
+	transport_stream_init(&x->streams[STREAM_TRACK + TRACK_KICK], (transport_method)musicbox_kick_task, x);
+	transport_stream_init(&x->streams[STREAM_BATCH], (transport_method)musicbox_batch_task, x);
+	transport_stream_init(&x->streams[STREAM_REPLAY], (transport_method)musicbox_replay_task, x);
+
+	// Seed search
+
+	constraints_clear(&x->limits);
+	x->search = NULL;
+	x->analysis = NULL;
+	x->analysis_file = NULL;
+	x->analysis_qelem = NULL;
+	x->renders = NULL;
+	x->render_qelem = NULL;
+	x->playlist = NULL;
 
-	// Create hashtable for midi note values
-
-	x->hash_note_names = ht_create();
+	return(x);
+}
 
-	for (int i = 0; note_names[i]; ++i) {
-		ht_set(x->hash_note_names, note_names[i], i+21);
+/*
+Big patches hold hundreds of instances that may never play, so musicbox_new only sets fields.
+The clocks are made on the first bang and the shared tables are attached the first time
+anything needs them.
+*/
+void musicbox_prepare(t_musicbox* x)
+{
+	if (x->m_clock != NULL) {
+		return;
 	}
-	ht_set(x->hash_note_names, "rest", -1);
+	x->m_clock = clock_new((t_musicbox*)x, (method)musicbox_task);
+	x->measure_clock = clock_new((t_musicbox*)x, (method)musicbox_measure_task);
+	x->piano_clock = clock_new((t_musicbox*)x, (method)musicbox_piano_task);
+	x->bass_clock = clock_new((t_musicbox*)x, (method)musicbox_bass_task);
+	x->melody_clock = clock_new((t_musicbox*)x, (method)musicbox_melody_task);
+	x->hat_clock = clock_new((t_musicbox*)x, (method)musicbox_hat_task);
+	x->ghost_clock = clock_new((t_musicbox*)x, (method)musicbox_ghost_task);
+	x->snare_clock = clock_new((t_musicbox*)x, (method)musicbox_snare_task);
+	x->kick_clock = clock_new((t_musicbox*)x, (method)musicbox_kick_task);
+	x->batch_clock = clock_new((t_musicbox*)x, (method)musicbox_batch_task);
+	x->replay_clock = clock_new((t_musicbox*)x, (method)musicbox_replay_task);
+	x->regen_clock = clock_new((t_musicbox*)x, (method)musicbox_regen_apply);
+
+	x->stream_clocks[STREAM_SECTION] = x->m_clock;
+	x->stream_clocks[STREAM_MEASURE] = x->measure_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_PIANO] = x->piano_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_BASS] = x->bass_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_MELODY] = x->melody_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_HAT] = x->hat_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_GHOST] = x->ghost_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_SNARE] = x->snare_clock;
+	x->stream_clocks[STREAM_TRACK + TRACK_KICK] = x->kick_clock;
+	x->stream_clocks[STREAM_BATCH] = x->batch_clock;
+	x->stream_clocks[STREAM_REPLAY] = x->replay_clock;
+}
 
-	post("New music box object instance added to patch");
-	return(x);
+// Tables, loaded by the first instance that needs them
+tables* musicbox_tables(t_musicbox* x)
+{
+	if (x->tables == NULL) {
+		x->tables = tables_attach();
+	}
+	return x->tables;
 }
 
 void musicbox_assist(t_musicbox* x, void* b, long m, long a, char* s)
@@ -340,112 +535,156 @@ void musicbox_assist(t_musicbox* x, void* b, long m, long a, char* s)
 		if (a == 11) {
 			sprintf(s, "Bass note length");
 		}
+		if (a == 17) {
+			sprintf(s, "Seeds found by search");
+		}
+		if (a == 18) {
+			sprintf(s, "Batch mode: track pitch length for every note due at once");
+		}
 	}
 }
 
 void musicbox_free(t_musicbox* x)
 {
-	object_free(x->m_clock);
-	object_free(x->measure_clock);
-	object_free(x->piano_clock);
-	object_free(x->bass_clock);
-	object_free(x->melody_clock);
-	object_free(x->hat_clock);
-	object_free(x->ghost_clock);
-	object_free(x->snare_clock);
-	object_free(x->kick_clock);
+	musicbox_record_stop(x);
+	musicbox_replay_stop(x);
+	transport_detach(x->transport, x->streams, STREAM_COUNT);
+	if (x->m_clock != NULL) {
+		object_free(x->m_clock);
+		object_free(x->measure_clock);
+		object_free(x->piano_clock);
+		object_free(x->bass_clock);
+		object_free(x->melody_clock);
+		object_free(x->hat_clock);
+		object_free(x->ghost_clock);
+		object_free(x->snare_clock);
+		object_free(x->kick_clock);
+		object_free(x->batch_clock);
+		object_free(x->replay_clock);
+		object_free(x->regen_clock);
+	}
+
+	search_free(x->search);
+	playlist_free(x->playlist);
+	taskgraph_free(x->pool);
+	if (x->search_qelem != NULL) {
+		qelem_free(x->search_qelem);
+	}
+	analysis_free(x->analysis);
+	if (x->analysis_qelem != NULL) {
+		qelem_free(x->analysis_qelem);
+	}
+	render_batch_free(x->renders);
+	if (x->render_qelem != NULL) {
+		qelem_free(x->render_qelem);
+	}
+	song_free(x->song);
+	events_clear(&x->timeline);
+	free(x->batch_list);
+	ring_close(x->ring);
+	tables_detach(x->tables);
 }
 
 // INPUTS
 
 void musicbox_bang(t_musicbox* x)
 {
+	TRACE_BEGIN(span);
+	musicbox_prepare(x);
+
 	// Unset all clocks
 
-	clock_unset(x->m_clock);
-	clock_unset(x->measure_clock);
-	clock_unset(x->piano_clock);
-	clock_unset(x->bass_clock);
-	clock_unset(x->melody_clock);
-	clock_unset(x->hat_clock);
-	clock_unset(x->ghost_clock);
-	clock_unset(x->snare_clock);
-	clock_unset(x->kick_clock);
+	for (int i = 0; i < STREAM_COUNT; i++) {
+		musicbox_unset(x, i);
+	}
+	x->measure_armed = 0;
+	x->section_armed = 0;
 
 	if (x->play == 0) {
 
 		x->play = 1;
+		critical_enter(0);
+		x->regen_count = 0; // Meant for the last song
+		critical_exit(0);
+
+		// Play the loaded log instead, see musicbox_replay
+
+		if (x->replay != NULL) {
+			musicbox_start(x, x->tempo > 0 ? (double)x->tempo : (double)x->replay->header->tempo);
+			x->replay_next = 0;
+			if (x->replay->count > 0) {
+				musicbox_at(x, STREAM_REPLAY, x->replay->records[0].time);
+			}
+			TRACE_END(span, "musicbox_bang");
+			return;
+		}
 
-		// Set random number seed
-
-		srand(x->seed);
-
-		// Load instrument
-
-		char* f_hat = "D:/music_algorithm/patterns/hat.txt";
-		char* f_hat2 = "D:/music_algorithm/patterns/hat2.txt";
-		char* sections_hat[2] = { f_hat, f_hat2 };
-		int rand_line_hat = get_random(1, number_of_lines(f_hat));
-		musicbox_create_section(x, x->hat_section, sections_hat, rand_line_hat);
-
-		char* f_ghost = "D:/music_algorithm/patterns/ghost.txt";
-		char* sections_ghost[2] = {f_ghost, f_ghost};
-		int rand_line_ghost = get_random(1, number_of_lines(f_ghost));
-		musicbox_create_section(x, x->ghost_section, sections_ghost, rand_line_ghost);
-
-		char* f_snare = "D:/music_algorithm/patterns/snare.txt";
-		char* sections_snare[2] = {f_snare, f_snare};
-		int rand_line_snare = get_random(1, number_of_lines(f_snare));
-		musicbox_create_section(x, x->snare_section, sections_snare, rand_line_snare);
-
-		char* f_kick = "D:/music_algorithm/patterns/kick.txt";
-		char* sections_kick[2] = {f_kick, f_kick};
-		int rand_line_kick = get_random(1, number_of_lines(f_kick));
-		musicbox_create_section(x, x->kick_section, sections_kick, rand_line_kick);
-
-		// Load chords
-
-		static int** progressions[2];
-		static int chord_1_v[4] = { 0,0,0,0 };
-		static int chord_2_v[4] = { 0,0,0,0 };
-		static int chord_3_v[4] = { 0,0,0,0 };
-		static int chord_4_v[4] = { 0,0,0,0 };
-		static int* progression_verse[4] = { chord_1_v, chord_2_v, chord_3_v, chord_4_v };
-		static int chord_1_c[4] = { 0,0,0,0 };
-		static int chord_2_c[4] = { 0,0,0,0 };
-		static int chord_3_c[4] = { 0,0,0,0 };
-		static int chord_4_c[4] = { 0,0,0,0 };
-		static int* progression_chorus[4] = { chord_1_c, chord_2_c, chord_3_c, chord_4_c };
-		memcpy(load_chords("D:/music_algorithm/patterns/chords.txt"), progression_verse, 32);
-		memcpy(load_chords("D:/music_algorithm/patterns/chords2.txt"), progression_chorus, 32);
-		progressions[1] = progression_verse;
-		progressions[0] = progression_chorus;
-
-		musicbox_create_piano_section(x, x->piano1_section, progressions, 1);
-		musicbox_create_piano_section(x, x->piano2_section, progressions, 2);
-		musicbox_create_piano_section(x, x->piano3_section, progressions, 3);
-		musicbox_create_piano_section(x, x->piano4_section, progressions, 4);
-
-		musicbox_create_bass_section(x, x->bass_section, x->kick_section->head, progressions);
-		//musicbox_create_bass_phrase(x, x->bass_phrase, x->kick_phrase, progression);
-
-		musicbox_create_melody_section(x, x->melody_section, x->snare_section->head);
-		//musicbox_create_melody_phrase(x, x->melody_phrase, x->snare_phrase);
+		// Start the first queued song, or generate a new song from the seed
+
+		unsigned int queued_seed;
+		long queued_tempo = 0;
+		song* queued = x->playlist != NULL ? playlist_take(x->playlist, &queued_seed, &queued_tempo) : NULL;
+		song_free(x->song);
+		if (queued != NULL) {
+			x->song = queued;
+			if (queued_tempo > 0) {
+				x->tempo = queued_tempo;
+				x->beat = tempo_to_mil(x->tempo);
+			}
+		}
+		else {
+			double started = systimer_gettime();
+			x->song = song_new(musicbox_tables(x));
+			x->song->rng = x->seed;
+			x->song->piano_voices = (int)x->voices;
+			if (x->budget > 0) {
+				x->song->deadline = started + x->budget;
+			}
+			x->song->pool = x->pool;
+			TRACE_BEGIN(generate);
+			int generated = musicbox_generate(x->song);
+			TRACE_END(generate, "musicbox_generate");
+			if (!generated) {
+				x->play = 0;
+				TRACE_END(span, "musicbox_bang");
+				return;
+			}
+			if (x->budget > 0) {
+				double took = systimer_gettime() - started;
+				post("bang: generated in %.3f ms, %.0f%% of the %.3f ms budget, %d melody and bass measures left as placeholders",
+					took, took * 100.0 / x->budget, x->budget, x->song->placeholders);
+			}
+		}
+		musicbox_cue(x);
 
 		// Play song
 
+		musicbox_start(x, (double)x->tempo);
+		x->section_position = 0;
+
+		if (x->batch) {
+			musicbox_timeline(x);
+			x->timeline_next = 0;
+			musicbox_soon(x, STREAM_BATCH, 0);
+			TRACE_END(span, "musicbox_bang");
+			return;
+		}
+
 		x->runs = 4;
-		clock_fdelay(x->m_clock, 0.);
+		musicbox_soon(x, STREAM_SECTION, 0);
+		x->section_armed = 1;
 	}
 	else {
 		x->play = 0;
 	}
+	TRACE_END(span, "musicbox_bang");
 }
 
 void musicbox_in1(t_musicbox* x, long n)
 {
 	x->tempo = n;
 	x->beat = tempo_to_mil(x->tempo);
+	musicbox_retime(x, (double)n, 0);
 }
 
 void musicbox_in2(t_musicbox* x, unsigned int n)
@@ -457,16 +696,16 @@ void musicbox_in2(t_musicbox* x, unsigned int n)
 
 void musicbox_task(t_musicbox* x)
 {
+	TRACE_BEGIN(span);
 	x->measures = 4;
+	x->section_armed = 0;
 
-	x->piano1_section = next_section(x->piano1_section);
-	x->piano1_phrase = x->piano1_section->head;
-	x->piano2_section = next_section(x->piano2_section);
-	x->piano2_phrase = x->piano2_section->head;
-	x->piano3_section = next_section(x->piano3_section);
-	x->piano3_phrase = x->piano3_section->head;
-	x->piano4_section = next_section(x->piano4_section);
-	x->piano4_phrase = x->piano4_section->head;
+	if (x->runs <= 0) { // The song has ended, go straight on with the next one if any is queued
+		musicbox_handoff(x);
+	}
+
+	x->piano_section = next_section(x->piano_section);
+	x->piano_phrase = x->piano_section->head;
 
 	x->bass_section = next_section(x->bass_section);
 	x->bass_phrase = x->bass_section->head;
@@ -488,475 +727,1244 @@ void musicbox_task(t_musicbox* x)
 
 	if (x->runs > 0) {
 		//post("Runs: %ld", x->runs);
-		double measure = 4 * (double)x->beat;
-		clock_fdelay(x->m_clock, 4*measure);
-		clock_fdelay(x->measure_clock, .0);
+		x->measure_position = x->section_position;
+		x->section_position += SECTION_MEASURES * MEASURE_BEATS;
+		musicbox_at(x, STREAM_SECTION, x->section_position);
+		musicbox_at(x, STREAM_MEASURE, x->measure_position);
+		x->section_armed = 1;
+		x->measure_armed = 1;
 		x->runs -= 1;
 	}
 	else {
-		clock_unset(x->m_clock);
-		clock_unset(x->measure_clock);
-		clock_unset(x->piano_clock);
-		clock_unset(x->bass_clock);
-		clock_unset(x->melody_clock);
-		clock_unset(x->hat_clock);
-		clock_unset(x->ghost_clock);
-		clock_unset(x->snare_clock);
-		clock_unset(x->kick_clock);
+		x->measure_armed = 0;
+		for (int i = STREAM_SECTION; i < STREAM_TRACK + TRACK_COUNT; i++) {
+			musicbox_unset(x, i);
+		}
 	}
+	TRACE_END(span, "musicbox_task");
 }
 
 void musicbox_measure_task(t_musicbox* x)
 {
-	x->piano1_phrase = next_phrase(x->piano1_phrase, 0);
-	x->piano1_current = x->piano1_phrase->head;
-	x->piano2_phrase = next_phrase(x->piano2_phrase, 0);
-	x->piano2_current = x->piano2_phrase->head;
-	x->piano3_phrase = next_phrase(x->piano3_phrase, 0);
-	x->piano3_current = x->piano3_phrase->head;
-	x->piano4_phrase = next_phrase(x->piano4_phrase, 0);
-	x->piano4_current = x->piano4_phrase->head;
-	
-	x->bass_phrase = next_phrase(x->bass_phrase, 0);
+	TRACE_BEGIN(span);
+	x->measure_armed = 0;
+	musicbox_regen_apply(x); // Between measures, so every track picks up its new phrases together
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		x->position[t] = x->measure_position;
+	}
+
+	x->piano_phrase = next_phrase(x->piano_phrase, &x->phrase_hold[0]);
+	x->piano_chord = 0;
+
+	x->bass_phrase = next_phrase(x->bass_phrase, &x->phrase_hold[0]);
 	x->bass_current = x->bass_phrase->head;
 
-	x->melody_phrase = next_phrase(x->melody_phrase, 1);
+	x->melody_phrase = next_phrase(x->melody_phrase, &x->phrase_hold[1]);
 	x->melody_current = x->melody_phrase->head;
 
-	x->hat_phrase = next_phrase(x->hat_phrase, 2);
+	x->hat_phrase = next_phrase(x->hat_phrase, &x->phrase_hold[2]);
 	x->hat_current = x->hat_phrase->head;
 
-	x->ghost_phrase = next_phrase(x->ghost_phrase, 3);
+	x->ghost_phrase = next_phrase(x->ghost_phrase, &x->phrase_hold[3]);
 	x->ghost_current = x->ghost_phrase->head;
 
-	x->snare_phrase = next_phrase(x->snare_phrase, 4);
+	x->snare_phrase = next_phrase(x->snare_phrase, &x->phrase_hold[4]);
 	x->snare_current = x->snare_phrase->head;
 
-	x->kick_phrase = next_phrase(x->kick_phrase, 5);
+	x->kick_phrase = next_phrase(x->kick_phrase, &x->phrase_hold[5]);
 	x->kick_current = x->kick_phrase->head;
 	
 	if (x->measures < 2) {
-		x->piano1_phrase = reset_phrase(x->piano1_phrase, 0);
-		x->piano2_phrase = reset_phrase(x->piano2_phrase, 0);
-		x->piano3_phrase = reset_phrase(x->piano3_phrase, 0);
-		x->piano4_phrase = reset_phrase(x->piano4_phrase, 0);
-
-		x->bass_phrase = reset_phrase(x->bass_phrase, 0);
-		x->melody_phrase = reset_phrase(x->melody_phrase, 1);
-		x->hat_phrase = reset_phrase(x->hat_phrase, 2);
-		x->ghost_phrase = reset_phrase(x->ghost_phrase, 3);
-		x->snare_phrase = reset_phrase(x->snare_phrase, 4);
-		x->kick_phrase = reset_phrase(x->kick_phrase, 5);
+		x->piano_phrase = reset_phrase(x->piano_phrase, &x->phrase_hold[0]);
+		x->bass_phrase = reset_phrase(x->bass_phrase, &x->phrase_hold[0]);
+		x->melody_phrase = reset_phrase(x->melody_phrase, &x->phrase_hold[1]);
+		x->hat_phrase = reset_phrase(x->hat_phrase, &x->phrase_hold[2]);
+		x->ghost_phrase = reset_phrase(x->ghost_phrase, &x->phrase_hold[3]);
+		x->snare_phrase = reset_phrase(x->snare_phrase, &x->phrase_hold[4]);
+		x->kick_phrase = reset_phrase(x->kick_phrase, &x->phrase_hold[5]);
 	}
 
 	if (x->measures > 0) {
 		//post("Measures: %ld", x->measures);
-		clock_fdelay(x->measure_clock, 4 * (double)x->beat);
-
-		clock_fdelay(x->piano_clock, .0);
-		clock_fdelay(x->bass_clock, .0);
-		clock_fdelay(x->melody_clock, .0);
-		clock_fdelay(x->hat_clock, .0);
-		clock_fdelay(x->ghost_clock, .0);
-		clock_fdelay(x->snare_clock, .0);
-		clock_fdelay(x->kick_clock, .0);
+		x->measure_position += MEASURE_BEATS;
+		musicbox_at(x, STREAM_MEASURE, x->measure_position);
+		x->measure_armed = 1;
+
+		for (int t = 0; t < TRACK_COUNT; t++) {
+			musicbox_soon(x, STREAM_TRACK + t, x->position[t]);
+		}
 		x->measures -= 1;
 	}
+	TRACE_END(span, "musicbox_measure_task");
 }
 
+/*
+Plays one chord. The four value outlets get its first four voices, narrower chords repeat theirs.
+Chords wider than that also go out of the batch outlet as one list, in the batch mode format.
+*/
 void musicbox_piano_task(t_musicbox* x) {
-	note* current1 = x->piano1_current;
-	note* current2 = x->piano2_current;
-	note* current3 = x->piano3_current;
-	note* current4 = x->piano4_current;
-	outlet_int(x->piano_outlet_value_1, current1->value);
-	outlet_int(x->piano_outlet_value_2, current2->value);
-	outlet_int(x->piano_outlet_value_3, current3->value);
-	outlet_int(x->piano_outlet_value_4, current4->value);
-	outlet_float(x->piano_outlet_length, current1->length * (double)x->beat);
-	if (current1->next->value != NULL) {
-		clock_fdelay(x->piano_clock, current1->length * (double)x->beat);
-		x->piano1_current = current1->next;
-		x->piano2_current = current2->next;
-		x->piano3_current = current3->next;
-		x->piano4_current = current4->next;
+	x->track_armed[TRACK_PIANO] = 0;
+	phrase* p = x->piano_phrase;
+	if (x->piano_chord >= p->chord_count) {
+		return;
+	}
+	TRACE_BEGIN(span);
+	chord_event* c = &p->chords[x->piano_chord];
+	double length = musicbox_length(x, TRACK_PIANO, c->length);
+	void* outlets[4] = { x->piano_outlet_value_1, x->piano_outlet_value_2, x->piano_outlet_value_3, x->piano_outlet_value_4 };
+
+	if (c->voices > 4) {
+		t_atom list[3 * CHORD_MAX_VOICES];
+		for (int v = 0; v < c->voices; v++) {
+			atom_setlong(list + 3 * v, TRACK_PIANO);
+			atom_setlong(list + 3 * v + 1, c->pitches[v]);
+			atom_setfloat(list + 3 * v + 2, length);
+		}
+		outlet_list(x->batch_outlet, NULL, (short)(3 * c->voices), list);
+	}
+	for (int v = 0; v < 4; v++) {
+		outlet_int(outlets[v], c->pitches[v % c->voices]);
+	}
+	outlet_float(x->piano_outlet_length, length);
+	for (int v = 0; v < c->voices; v++) {
+		musicbox_publish(x, TRACK_PIANO, c->pitches[v], c->length);
 	}
+	if (x->piano_chord + 1 < p->chord_count) {
+		musicbox_advance(x, TRACK_PIANO, c->length);
+		x->piano_chord++;
+	}
+	TRACE_END(span, "musicbox_piano_task");
 }
 
 void musicbox_bass_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_BASS] = 0;
 	note* current = x->bass_current;
 	outlet_int(x->bass_outlet_value, current->value);
-	outlet_float(x->bass_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->bass_clock, current->length * (double)x->beat);
+	outlet_float(x->bass_outlet_length, musicbox_length(x, TRACK_BASS, current->length));
+	musicbox_publish(x, TRACK_BASS, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_BASS, current->length);
 		x->bass_current = current->next;
 	}
+	TRACE_END(span, "musicbox_bass_task");
 }
 
 void musicbox_melody_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_MELODY] = 0;
 	note* current = x->melody_current;
 	outlet_int(x->melody_outlet_value, current->value);
-	outlet_float(x->melody_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->melody_clock, current->length * (double)x->beat);
+	outlet_float(x->melody_outlet_length, musicbox_length(x, TRACK_MELODY, current->length));
+	musicbox_publish(x, TRACK_MELODY, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_MELODY, current->length);
 		x->melody_current = current->next;
 	}
+	TRACE_END(span, "musicbox_melody_task");
 }
 
 void musicbox_hat_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_HAT] = 0;
 	note* current = x->hat_current;
 	outlet_int(x->hat_outlet_value, current->value);
-	outlet_float(x->hat_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->hat_clock, current->length * (double)x->beat);
+	outlet_float(x->hat_outlet_length, musicbox_length(x, TRACK_HAT, current->length));
+	musicbox_publish(x, TRACK_HAT, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_HAT, current->length);
 		x->hat_current = current->next;
 	}
+	TRACE_END(span, "musicbox_hat_task");
 }
 
 void musicbox_ghost_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_GHOST] = 0;
 	note* current = x->ghost_current;
 	outlet_int(x->ghost_outlet_value, current->value);
-	outlet_float(x->ghost_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->ghost_clock, current->length * (double)x->beat);
+	outlet_float(x->ghost_outlet_length, musicbox_length(x, TRACK_GHOST, current->length));
+	musicbox_publish(x, TRACK_GHOST, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_GHOST, current->length);
 		x->ghost_current = current->next;
 	}
+	TRACE_END(span, "musicbox_ghost_task");
 }
 
 void musicbox_snare_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_SNARE] = 0;
 	note* current = x->snare_current;
 	outlet_int(x->snare_outlet_value, current->value);
-	outlet_float(x->snare_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->snare_clock, current->length * (double)x->beat);
+	outlet_float(x->snare_outlet_length, musicbox_length(x, TRACK_SNARE, current->length));
+	musicbox_publish(x, TRACK_SNARE, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_SNARE, current->length);
 		x->snare_current = current->next;
 	}
+	TRACE_END(span, "musicbox_snare_task");
 }
 
 void musicbox_kick_task(t_musicbox* x) {
+	TRACE_BEGIN(span);
+	x->track_armed[TRACK_KICK] = 0;
 	note* current = x->kick_current;
 	outlet_int(x->kick_outlet_value, current->value);
-	outlet_float(x->kick_outlet_length, current->length * (double)x->beat);
-	if (current->next->value != NULL) {
-		clock_fdelay(x->kick_clock, current->length * (double)x->beat);
+	outlet_float(x->kick_outlet_length, musicbox_length(x, TRACK_KICK, current->length));
+	musicbox_publish(x, TRACK_KICK, current->value, current->length);
+	if (current->next->value != 0) {
+		musicbox_advance(x, TRACK_KICK, current->length);
 		x->kick_current = current->next;
 	}
+	TRACE_END(span, "musicbox_kick_task");
 }
 
-// Additional
+/*
+Sends every note due now as one list of track, pitch and length triples, with tracks numbered
+like TRACK_PIANO to TRACK_KICK and lengths in milliseconds, then waits for the next timestamp.
+*/
+void musicbox_batch_task(t_musicbox* x) {
+	event* events = x->timeline.events;
+	long first = x->timeline_next;
+	long last = first;
+
+	if (first >= x->timeline.count) {
+		return;
+	}
+	TRACE_BEGIN(span);
+	while (last < x->timeline.count && events[last].time == events[first].time) {
+		last++;
+	}
 
-void musicbox_create_section(t_musicbox* x, section* current_section, char** filename, int rand_line) {
-	for (int i = 0; i < 2; i++) {
-		musicbox_create_phrase(x, current_section->head, *(filename + i), rand_line);
-		current_section->repetitions = 2;
+	long n = last - first;
+	t_atom* list = x->batch_list;
+	for (long i = 0; i < n; i++) {
+		event* e = &events[first + i];
+		atom_setlong(list + 3 * i, e->track);
+		atom_setlong(list + 3 * i + 1, e->value);
+		atom_setfloat(list + 3 * i + 2, musicbox_ms(x, e->time, e->length));
+		musicbox_publish_at(x, e->time, e->track, e->value, e->length);
+	}
+
+	x->timeline_next = last;
+	if (last < x->timeline.count) {
+		musicbox_at(x, STREAM_BATCH, events[last].time);
+	}
+	outlet_list(x->batch_outlet, NULL, (short)(3 * n), list);
+	TRACE_END(span, "musicbox_batch_task");
+}
 
-		current_section->next = (section*)malloc(sizeof(section));
-		current_section->next->head = (phrase*)malloc(sizeof(phrase));
-		current_section->next->head->head = (note*)malloc(sizeof(note));
-		current_section->next->repetitions = 0;
-		current_section->next->next = NULL;
-		current_section = current_section->next;
+// Lays the song out for batch mode, with room to send its longest group of events at once
+void musicbox_timeline(t_musicbox* x) {
+	song_timeline(x->song, &x->timeline);
+	if (x->timeline.longest > x->batch_list_size) {
+		x->batch_list_size = x->timeline.longest;
+		x->batch_list = (t_atom*)realloc(x->batch_list, sizeof(t_atom) * 3 * x->batch_list_size);
 	}
 }
 
-void musicbox_create_phrase(t_musicbox* x, phrase* current_phrase, char* filename, int rand_line) {
-	for (int i = 0; i < 1; i++) {
-		musicbox_loadfile(x, current_phrase->head, filename, rand_line);
-		current_phrase->repetitions = 4;
+// TIMING
+
+/*
+tempo <bpm> [<beats>]
+Changes tempo straight away, or ramps to it over a number of beats
+*/
+void musicbox_tempo(t_musicbox* x, double bpm, double beats)
+{
+	x->tempo = (long)bpm;
+	x->beat = tempo_to_mil(x->tempo);
+	musicbox_retime(x, bpm, beats);
+}
+
+/*
+Everything is scheduled by song position, so a tempo change moves every clock that is waiting,
+the tracks' next notes included, to where its position now falls. On a transport the tempo is the
+transport's, and every stream waits in beats, so nothing needs moving.
+*/
+void musicbox_retime(t_musicbox* x, double bpm, double beats)
+{
+	if (x->transport != NULL) {
+		transport_tempo(x->transport, bpm, beats);
+		return;
+	}
+
+	double now;
+	clock_getftime(&now);
+	tempo_change(&x->timing, now, bpm, beats);
 
-		current_phrase->next = (phrase*)malloc(sizeof(phrase));
-		current_phrase->next->head = (note*)malloc(sizeof(note));
-		current_phrase->next->repetitions = 0;
-		current_phrase->next->next = NULL;
-		current_phrase = current_phrase->next;
+	if (x->section_armed) {
+		musicbox_at(x, STREAM_SECTION, x->section_position);
+	}
+	if (x->measure_armed) {
+		musicbox_at(x, STREAM_MEASURE, x->measure_position);
+	}
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		if (x->track_armed[t]) {
+			musicbox_at(x, STREAM_TRACK + t, x->position[t]);
+		}
+	}
+	if (x->play && x->batch && x->timeline_next > 0 && x->timeline_next < x->timeline.count) {
+		musicbox_at(x, STREAM_BATCH, x->timeline.events[x->timeline_next].time);
 	}
+	if (x->play && x->replay != NULL && x->replay_next > 0 && x->replay_next < x->replay->count) {
+		musicbox_at(x, STREAM_REPLAY, x->replay->records[x->replay_next].time);
+	}
+}
+
+// Song position to scheduler time, the transport's when on one
+tempo_map* musicbox_timing(t_musicbox* x) {
+	return x->transport != NULL ? &x->transport->timing : &x->timing;
 }
 
-void musicbox_loadfile(t_musicbox* x, note* current_note, char* filename, int rand_line) {
-	FILE* fp;
-	char str[MAXCHAR];
+// Song position now
+double musicbox_now(t_musicbox* x) {
+	double now;
+	clock_getftime(&now);
+	return tempo_beat(musicbox_timing(x), now) - x->origin;
+}
+
+// Milliseconds from now until a song position
+double musicbox_delay(t_musicbox* x, double beat) {
+	double now;
+	clock_getftime(&now);
+	double delay = tempo_ms(musicbox_timing(x), x->origin + beat) - now;
+	return delay > 0 ? delay : 0;
+}
 
-	int local_test = NULL;
+// Milliseconds a note of length beats at a song position lasts
+double musicbox_ms(t_musicbox* x, double beat, double length) {
+	return tempo_length(musicbox_timing(x), x->origin + beat, length);
+}
 
-	int line = 1;
+// Length in milliseconds of a note of length beats at a track's current position
+double musicbox_length(t_musicbox* x, int track, float length) {
+	return musicbox_ms(x, x->position[track], length);
+}
 
-	//int rand_line = get_random(1, number_of_lines(filename));
+// Moves a track on past its current note and sets it to play the next one
+void musicbox_advance(t_musicbox* x, int track, float length) {
+	x->position[track] += length;
+	musicbox_at(x, STREAM_TRACK + track, x->position[track]);
+}
 
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		post("Could not open file %s", filename);
+// Puts beat 0 of the song now at bpm, or on a transport at its next bar line
+void musicbox_start(t_musicbox* x, double bpm) {
+	double recorded = musicbox_now(x) + x->record_offset; // Beats since recording started, the new song carries on from here
+	if (x->transport != NULL) {
+		x->origin = transport_cue(x->transport);
 	}
 	else {
-		while (fgets(str, MAXCHAR, fp) != NULL) {
-			const char delim[2] = " ";
-			char* token = strtok(str, delim);
-			while (token != NULL) {
-				if (token[strlen(token) - 1] == '\n') {
-					token[strlen(token) - 1] = 0;
-				}
-				local_test = ht_get(x->hash_note_names, token);
-				if (local_test == NULL) {
-					//post("Can't find %s", token);
-					//post("LINE & RAND: %ld %ld", line, rand_line);
-					if (line == rand_line) {
-						current_note->length = (float)strtof(token, (char**)NULL, 10);
-						current_note->next = (note*)malloc(sizeof(note));
-						current_note->next->value = NULL;
-						current_note->next->length = 0;
-						current_note->next->next = NULL;
-						current_note = current_note->next;
-					}
-				}
-				else {
-					//post("%s = %d", token, local_test);
-					//post("LINE & RAND: %ld %ld", line, rand_line);
-					if (line == rand_line) {
-						current_note->value = local_test;
-					}
-				}
-				token = strtok(NULL, delim);
-			}
+		double now;
+		clock_getftime(&now);
+		x->origin = 0;
+		tempo_start(&x->timing, now, bpm);
+	}
+	x->record_offset = recorded - musicbox_now(x);
+}
 
-			line++;
-		}
-		fclose(fp);
+// Notes whether a track stream is waiting, so a tempo change knows which tracks to move
+void musicbox_arm(t_musicbox* x, int stream, int armed) {
+	if (stream >= STREAM_TRACK && stream < STREAM_TRACK + TRACK_COUNT) {
+		x->track_armed[stream - STREAM_TRACK] = armed;
 	}
-	//printList(x->inst_a_head);
-	//printList(x->inst_b_head);
 }
 
-void musicbox_create_melody(t_musicbox* x, note* current_note, note* follow_beat) {
-	float* back_beat = get_beats(follow_beat); //Get beats to match to
+// Sets a stream to fire at a song position
+void musicbox_at(t_musicbox* x, int stream, double beat) {
+	musicbox_arm(x, stream, 1);
+	if (x->transport != NULL) {
+		transport_set(&x->streams[stream], x->origin + beat);
+	}
+	else {
+		clock_fdelay(x->stream_clocks[stream], musicbox_delay(x, beat));
+	}
+}
 
-	float current_beat = 0.0; // Current beat
-	float rand_length = 0.0; // Current note length
-	int rand_note = 0; // Current note value
+// Sets a stream to fire straight away, for a song position that is now
+void musicbox_soon(t_musicbox* x, int stream, double beat) {
+	musicbox_arm(x, stream, 1);
+	if (x->transport != NULL) {
+		transport_set(&x->streams[stream], x->origin + beat);
+	}
+	else {
+		clock_fdelay(x->stream_clocks[stream], 0.);
+	}
+}
 
-	int scale[7] = {57, 59, 60, 62, 64, 65, 67};
-	//int scale[3] = {57, 60, 64};
+void musicbox_unset(t_musicbox* x, int stream) {
+	musicbox_arm(x, stream, 0);
+	if (x->transport != NULL) {
+		transport_unset(&x->streams[stream]);
+	}
+	else {
+		clock_unset(x->stream_clocks[stream]);
+	}
+}
 
-	//Generate melody
-	while (current_beat < 4.0) {
-		// Test to see if current note is on the back beat
-		int on_back_beat = 0;
-		int i = 0;
-		while (*(back_beat + i) != -1) {
-			if (current_beat == *(back_beat + i)) {
-				on_back_beat = 1;
-				break;
-			}
-			else if (current_beat < *(back_beat + i)) {
-				break;
-			}
-			i++;
+/*
+transport <name>
+transport off
+transport stats
+Plays on the shared transport called name, made by the first instance to ask for it. Every
+instance on it plays at its tempo, and a bang starts the song at its next bar line so they stay
+in time together; tempo or the tempo inlet on any of them changes it for all. One clock plays
+every instance on it, see transport.h. Joining or leaving stops the song playing.
+*/
+void musicbox_transport(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("transport: expected <name>, off or stats");
+		return;
+	}
+	t_symbol* name = atom_getsym(argv);
+	if (name == gensym("stats")) {
+		if (x->transport == NULL) {
+			post("transport: not on one");
+		}
+		else {
+			transport_post_stats(x->transport);
 		}
+		return;
+	}
+	if (x->transport != NULL && x->transport->name == name) {
+		return;
+	}
 
-		rand_length = ((float)get_random(1, 16)) / 4.0; //Get a random note length
+	musicbox_prepare(x);
+	for (int i = 0; i < STREAM_COUNT; i++) {
+		musicbox_unset(x, i);
+	}
+	x->play = 0;
+	x->measure_armed = 0;
+	x->section_armed = 0;
+
+	transport_detach(x->transport, x->streams, STREAM_COUNT);
+	x->transport = NULL;
+	x->origin = 0;
+	if (name != gensym("off")) {
+		x->transport = transport_attach(name, x->streams, STREAM_COUNT);
+		if (x->transport->references == 1 && x->tempo > 0) { // A new transport starts at this instance's tempo
+			transport_tempo(x->transport, (double)x->tempo, 0);
+		}
+	}
+}
 
-		int rand_note_index = get_random(0, 6);
+// Additional
 
-		int j = 0;
-		if (on_back_beat == 1) { //On the back beat
-			j = i+1;
-			rand_note = scale[rand_note_index]; //+ 12;
-		}
-		else { //Not on backbeat
-			j = i;
-			rand_note = scale[rand_note_index] - 12;
+void musicbox_batch(t_musicbox* x, long n) {
+	x->batch = n != 0;
+}
+
+/*
+voices <n>
+Pitches in each piano chord from the next song on, 1 to CHORD_MAX_VOICES
+*/
+void musicbox_voices(t_musicbox* x, long n) {
+	if (n < 1 || n > CHORD_MAX_VOICES) {
+		post("voices: expected 1 to %d", CHORD_MAX_VOICES);
+		return;
+	}
+	x->voices = n;
+}
+
+/*
+budget <ms>
+Most time a bang may spend generating, 0 for no limit. Drums and chords are always made in full,
+then melody and bass measures that would start after the budget runs out are made as simple
+placeholders, see musicbox_create_placeholder. Each bang posts how much of it was used.
+*/
+void musicbox_budget(t_musicbox* x, double ms) {
+	x->budget = ms > 0 ? ms : 0;
+	musicbox_tables(x); // Load them now rather than in the first bang
+}
+
+/*
+threads <n>
+Threads that help each bang make its song, up to TASKGRAPH_MAX_THREADS. The drums and piano are
+made at the same time, then the bass and melody, and a seed makes the same song either way. 0, the
+default, makes the tracks one after another on the thread that banged.
+*/
+void musicbox_threads(t_musicbox* x, long n) {
+	if (n < 0 || n > TASKGRAPH_MAX_THREADS) {
+		post("threads: expected 0 to %d", TASKGRAPH_MAX_THREADS);
+		return;
+	}
+	taskgraph_free(x->pool);
+	x->pool = n > 0 ? taskgraph_new((int)n) : NULL;
+}
+
+void musicbox_cue(t_musicbox* x) {
+	x->piano_section = x->song->piano_section;
+	x->bass_section = x->song->bass_section;
+	x->melody_section = x->song->melody_section;
+	x->hat_section = x->song->hat_section;
+	x->ghost_section = x->song->ghost_section;
+	x->snare_section = x->song->snare_section;
+	x->kick_section = x->song->kick_section;
+	for (int i = 0; i < 6; i++) {
+		x->phrase_hold[i] = 0; // Each song starts its phrases the same whatever played before
+	}
+}
+
+// REGENERATION
+
+/*
+regenerate <track> [<section>]
+regenerate chords [<section>]
+Remakes one track, or the chords, with new random choices and remakes whatever follows it, so
+the bass changes with the kick and everything but the drums changes with the chords. Section is 0
+for the chorus or 1 for the verse, both when left out; drums always change in both. While playing
+the new notes start at the next measure, or the next note in batch mode.
+*/
+void musicbox_regenerate(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("regenerate: expected <track> [<section>]");
+		return;
+	}
+	char* name = atom_getsym(argv)->s_name;
+	int kind = strcmp(name, "chords") == 0 ? NODE_CHORDS : search_track_index(name);
+	int section_index = argc >= 2 ? (int)atom_getlong(argv + 1) : -1;
+	if (kind < 0 || section_index < -1 || section_index >= SONG_SECTIONS) {
+		post("regenerate: can't remake %s %d", name, section_index);
+		return;
+	}
+	if (x->song == NULL) {
+		post("regenerate: no song yet");
+		return;
+	}
+
+	int queued = 0;
+	critical_enter(0);
+	if (x->regen_count < REGEN_PENDING) {
+		x->regen_kind[x->regen_count] = kind;
+		x->regen_section[x->regen_count] = section_index;
+		x->regen_count++;
+		queued = 1;
+	}
+	critical_exit(0);
+	if (!queued) {
+		post("regenerate: %d requests already waiting", REGEN_PENDING);
+		return;
+	}
+	if (!(x->play && x->measure_armed)) { // Nothing will reach a measure boundary, so apply it now
+		clock_fdelay(x->regen_clock, 0.);
+	}
+}
+
+// Applies the waiting regenerate requests to the song, on the scheduler thread
+void musicbox_regen_apply(t_musicbox* x)
+{
+	int kinds[REGEN_PENDING];
+	int sections[REGEN_PENDING];
+	critical_enter(0);
+	int count = x->regen_count;
+	for (int i = 0; i < count; i++) {
+		kinds[i] = x->regen_kind[i];
+		sections[i] = x->regen_section[i];
+	}
+	x->regen_count = 0;
+	critical_exit(0);
+	if (count == 0 || x->song == NULL) {
+		return;
+	}
+
+	TRACE_BEGIN(span);
+	double start = systimer_gettime();
+	unsigned int remade = 0;
+	for (int i = 0; i < count; i++) {
+		unsigned int nodes = song_regenerate(x->song, kinds[i], sections[i]);
+		if (nodes == 0) {
+			post("regenerate: couldn't remake %s", kinds[i] == NODE_CHORDS ? "chords" : track_names[kinds[i]]);
 		}
+		remade |= nodes;
+	}
+	double took = systimer_gettime() - start;
 
-		if (*(back_beat + j) == -1) { //No more back beats
-			if ((rand_length + current_beat) > 4.0) {
-				rand_length = 4.0 - current_beat;
-			}
+	// Batch mode sends from the timeline, so it is rebuilt and picks up after the last time sent
+
+	if (x->batch && x->play && remade != 0) {
+		int sent = x->timeline_next > 0;
+		float last = sent ? x->timeline.events[x->timeline_next - 1].time : 0;
+		musicbox_timeline(x);
+		x->timeline_next = 0;
+		while (sent && x->timeline_next < x->timeline.count && x->timeline.events[x->timeline_next].time <= last) {
+			x->timeline_next++;
+		}
+		if (x->timeline_next < x->timeline.count) {
+			musicbox_at(x, STREAM_BATCH, x->timeline.events[x->timeline_next].time);
 		}
-		else { //Check for further beats
-			while (*(back_beat + j) != -1) {
-				if ((rand_length + current_beat) > * (back_beat + j)) {
-					rand_length = *(back_beat + j) - current_beat;
-					break;
-				}
-				j++;
+	}
+
+	char list[256] = "";
+	for (int kind = 0; kind <= NODE_CHORDS; kind++) {
+		for (int i = 0; i < SONG_SECTIONS; i++) {
+			if (remade & NODE_BIT(kind, i)) {
+				char item[32];
+				sprintf(item, "%s%s %d", list[0] ? ", " : "", kind == NODE_CHORDS ? "chords" : track_names[kind], i);
+				strcat(list, item);
 			}
 		}
+	}
+	if (remade != 0) {
+		post("regenerate: remade %s in %.3f ms", list, took);
+	}
+	TRACE_END(span, "musicbox_regen_apply");
+}
 
-		current_note->length = rand_length;
-		current_note->value = rand_note;
+// PLAYLIST
 
-		current_beat = current_beat + rand_length;
+/*
+Swaps in the first queued song where the current one ends. Song positions carry on from the end
+of the old song, so the new one starts on exactly the beat the old one would have stopped at.
+Returns 0 if nothing is queued.
+*/
+int musicbox_handoff(t_musicbox* x) {
+	unsigned int seed;
+	long tempo = 0;
+	if (x->playlist == NULL || x->batch) {
+		return 0;
+	}
+	song* next = playlist_take(x->playlist, &seed, &tempo);
+	if (next == NULL) {
+		return 0;
+	}
 
-		current_note->next = (note*)malloc(sizeof(note));
-		current_note->next->value = NULL;
-		current_note->next->length = 0;
-		current_note->next->next = NULL;
-		current_note = current_note->next;
+	playlist_retire(x->playlist, x->song); // Freed on the playlist thread
+	x->song = next;
+	musicbox_cue(x);
+	if (tempo > 0) {
+		x->tempo = tempo;
+		x->beat = tempo_to_mil(x->tempo);
+		if (x->transport == NULL) { // A transport keeps its own tempo
+			tempo_change(&x->timing, tempo_ms(&x->timing, x->section_position), (double)tempo, 0);
+		}
 	}
+	x->runs = 4;
+	return 1;
 }
 
-void musicbox_create_melody_phrase(t_musicbox* x, phrase* current_phrase, phrase* follow_phrase) {
-	for (int i = 0; i < 2; i++) {
-		musicbox_create_melody(x, current_phrase->head, follow_phrase->head);
+// Playlist, started the first time anything is queued
+playlist* musicbox_playlist(t_musicbox* x) {
+	if (x->playlist == NULL) {
+		x->playlist = playlist_new(musicbox_tables(x));
+	}
+	return x->playlist;
+}
 
-		if (i == 0) {
-			current_phrase->repetitions = 3;
+/*
+queue <seed> [<tempo>]
+queue clear
+queue stats
+Adds a song to play when the current one ends, with no gap, at its own tempo if one is given.
+Queued songs are generated ahead on a background thread, see playlist.h. Bang starts the first
+queued song when nothing is playing.
+*/
+void musicbox_queue(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc >= 1 && atom_gettype(argv) == A_SYM) {
+		char* name = atom_getsym(argv)->s_name;
+		if (strcmp(name, "clear") == 0) {
+			if (x->playlist != NULL) {
+				playlist_clear(x->playlist);
+			}
+		}
+		else if (strcmp(name, "stats") == 0) {
+			playlist_post_stats(musicbox_playlist(x));
 		}
 		else {
-			current_phrase->repetitions = 1;
+			post("queue: expected <seed> [<tempo>], clear or stats");
 		}
+		return;
+	}
+	if (argc < 1) {
+		post("queue: expected <seed> [<tempo>], clear or stats");
+		return;
+	}
+
+	unsigned int seed = (unsigned int)atom_getlong(argv);
+	long tempo = argc >= 2 ? atom_getlong(argv + 1) : 0;
+	playlist_add(musicbox_playlist(x), seed, tempo > 0 ? tempo : 0, (int)x->voices);
+}
 
-		current_phrase->next = (phrase*)malloc(sizeof(phrase));
-		current_phrase->next->head = (note*)malloc(sizeof(note));
-		current_phrase->next->repetitions = 0;
-		current_phrase->next->next = NULL;
-		current_phrase = current_phrase->next;
+/*
+prefetch <depth>
+How many queued songs are generated ahead of time, 0 to PLAYLIST_MAX_DEPTH. With 0 each song is
+only generated when it is due, like a bang.
+*/
+void musicbox_prefetch(t_musicbox* x, long n)
+{
+	if (n < 0 || n > PLAYLIST_MAX_DEPTH) {
+		post("prefetch: expected 0 to %d", PLAYLIST_MAX_DEPTH);
+		return;
 	}
+	playlist_set_depth(musicbox_playlist(x), n);
 }
 
-void musicbox_create_melody_section(t_musicbox* x, section* current_section, phrase* follow_phrase) {
-	for (int i = 0; i < 2; i++) {
-		musicbox_create_melody_phrase(x, current_section->head, follow_phrase);
-		current_section->repetitions = 2;
+// SEED SEARCH
 
-		current_section->next = (section*)malloc(sizeof(section));
-		current_section->next->head = (phrase*)malloc(sizeof(phrase));
-		current_section->next->head->head = (note*)malloc(sizeof(note));
-		current_section->next->repetitions = 0;
-		current_section->next->next = NULL;
-		current_section = current_section->next;
+int musicbox_pitch(t_musicbox* x, t_atom* a) {
+	if (atom_gettype(a) == A_SYM) {
+		return ht_get(musicbox_tables(x)->hash_note_names, atom_getsym(a)->s_name);
 	}
+	return (int)atom_getlong(a);
 }
 
-void musicbox_create_bass(t_musicbox* x, note* current_note, note* follow_beat, int* scale) {
-	float* back_beat = get_beats(follow_beat); //Get beats to match to
+/*
+constrain clear
+constrain <track> range <low> <high>
+constrain <track> density <min> [<max>]
+constrain <hat|ghost|snare|kick|verse|chorus> row <line>
+*/
+void musicbox_constrain(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc == 1 && atom_gettype(argv) == A_SYM && strcmp(atom_getsym(argv)->s_name, "clear") == 0) {
+		constraints_clear(&x->limits);
+		return;
+	}
+	if (argc < 3 || atom_gettype(argv) != A_SYM || atom_gettype(argv + 1) != A_SYM) {
+		post("constrain: expected <track> <range|density|row> <values>");
+		return;
+	}
 
-	float current_beat = 0.0; // Current beat
-	float rand_length = 0.0; // Current note length
-	int rand_note = 0; // Current note value
+	char* name = atom_getsym(argv)->s_name;
+	char* kind = atom_getsym(argv + 1)->s_name;
+	int track = search_track_index(name);
 
-	//int scale[7] = {57, 59, 60, 62, 64, 65, 67};
-	//int scale[3] = {48, 52, 57};
+	if (strcmp(kind, "range") == 0 && track >= 0 && argc >= 4) {
+		x->limits.low[track] = musicbox_pitch(x, argv + 2);
+		x->limits.high[track] = musicbox_pitch(x, argv + 3);
+	}
+	else if (strcmp(kind, "density") == 0 && track >= 0) {
+		x->limits.min_notes[track] = (int)atom_getlong(argv + 2);
+		x->limits.max_notes[track] = argc >= 4 ? (int)atom_getlong(argv + 3) : 0;
+	}
+	else if (strcmp(kind, "row") == 0 && search_row_index(name) >= 0) {
+		x->limits.rows[search_row_index(name)] = (int)atom_getlong(argv + 2);
+	}
+	else {
+		post("constrain: can't apply %s to %s", kind, name);
+	}
+}
 
-	//Generate melody
-	while (current_beat < 4.0) {
-		// Test to see if current note is on the back beat
-		int on_back_beat = 0;
-		int i = 0;
-		while (*(back_beat + i) != -1) {
-			if (current_beat == *(back_beat + i)) {
-				on_back_beat = 1;
-				break;
-			}
-			else if (current_beat < *(back_beat + i)) {
-				break;
-			}
-			i++;
-		}
+/*
+search <first seed> <count> [<threads>]
+search stop
+*/
+void musicbox_search(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	// Only one search runs at a time
+	search_free(x->search);
+	x->search = NULL;
+
+	if (argc >= 1 && atom_gettype(argv) == A_SYM) { // search stop
+		return;
+	}
+	if (argc < 2) {
+		post("search: expected <first seed> <count> [<threads>]");
+		return;
+	}
 
-		rand_length = ((float)get_random(1, 16)) / 4.0; //Get a random note length
+	unsigned int first_seed = (unsigned int)atom_getlong(argv);
+	long count = (long)atom_getlong(argv + 1);
+	long threads = argc >= 3 ? (long)atom_getlong(argv + 2) : 4;
+	if (x->search_qelem == NULL) {
+		x->search_qelem = qelem_new(x, (method)musicbox_search_report);
+	}
+	x->search = search_start(&x->limits, musicbox_tables(x), (int)x->voices, first_seed, count, threads, x->search_qelem);
+}
 
-		int rand_note_index = get_random(1, 3);
+void musicbox_search_report(t_musicbox* x)
+{
+	unsigned int seeds[64];
+	long n;
 
-		int j = 0;
-		if (on_back_beat == 1) { //On the back beat
-			j = i + 1;
-			rand_note = *(scale + 0);
-		}
-		else { //Not on backbeat
-			j = i;
-			rand_note = *(scale + rand_note_index);
+	if (x->search == NULL) {
+		return;
+	}
+	while ((n = search_take_matches(x->search, seeds, 64)) > 0) {
+		for (long i = 0; i < n; i++) {
+			outlet_int(x->search_outlet, seeds[i]);
 		}
+	}
+	if (search_finished(x->search)) {
+		post("Search finished: %ld of %ld seeds matched", x->search->matches, x->search->tried);
+		search_free(x->search);
+		x->search = NULL;
+	}
+}
 
-		if (*(back_beat + j) == -1) { //No more back beats
-			if ((rand_length + current_beat) > 4.0) {
-				rand_length = 4.0 - current_beat;
-			}
+// FEATURE ANALYSIS
+
+/*
+analyze <first seed> <count> <file> [<threads>]
+analyze stop
+Generates a range of seeds on several threads and writes a vector of features for each song that
+meets the constraints to a file, for studying what the generator makes or ranking seeds, see
+features.h for what is measured and the file layout
+*/
+void musicbox_analyze(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	// Only one analysis runs at a time
+	analysis_free(x->analysis);
+	x->analysis = NULL;
+
+	if (argc >= 1 && atom_gettype(argv) == A_SYM) { // analyze stop
+		return;
+	}
+	if (argc < 3 || atom_gettype(argv + 2) != A_SYM) {
+		post("analyze: expected <first seed> <count> <file> [<threads>]");
+		return;
+	}
+
+	unsigned int first_seed = (unsigned int)atom_getlong(argv);
+	long count = (long)atom_getlong(argv + 1);
+	long threads = argc >= 4 ? (long)atom_getlong(argv + 3) : 4;
+	if (x->analysis_qelem == NULL) {
+		x->analysis_qelem = qelem_new(x, (method)musicbox_analyze_report);
+	}
+	x->analysis_file = atom_getsym(argv + 2);
+	x->analysis = analysis_start(&x->limits, musicbox_tables(x), (int)x->voices, first_seed, count, threads, x->analysis_qelem);
+	if (x->analysis == NULL) {
+		post("analyze: not enough memory for %ld vectors", count);
+	}
+}
+
+void musicbox_analyze_report(t_musicbox* x)
+{
+	if (x->analysis == NULL || !analysis_finished(x->analysis)) {
+		return;
+	}
+	double took = systimer_gettime() - x->analysis->started;
+	long written = analysis_save(x->analysis, x->analysis_file->s_name);
+	if (written < 0) {
+		post("analyze: couldn't write %s", x->analysis_file->s_name);
+	}
+	else {
+		post("Analysis finished: %ld of %ld seeds measured in %.1f ms, %.0f songs a minute, written to %s",
+			written, x->analysis->count, took, took > 0 ? x->analysis->count * 60000.0 / took : 0, x->analysis_file->s_name);
+	}
+	analysis_free(x->analysis);
+	x->analysis = NULL;
+}
+
+// OFFLINE RENDERING
+
+/*
+render <file> [<seed>]
+render <file prefix> <first seed> <count>
+render stop
+Generates the song for the seed, or the current seed, and writes it to a WAV file at the current
+tempo. With a range the seeds are rendered on a worker thread to files named the prefix followed
+by the seed, and the time taken is posted when they are done; only one range renders at a time.
+*/
+void musicbox_render(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("render: expected <file> [<seed>], <file prefix> <first seed> <count> or stop");
+		return;
+	}
+
+	char* filename = atom_getsym(argv)->s_name;
+	double tempo = x->tempo > 0 ? (double)x->tempo : 120.0;
+
+	if (argc == 1 && strcmp(filename, "stop") == 0) {
+		render_batch_free(x->renders);
+		x->renders = NULL;
+		return;
+	}
+	if (argc >= 3) {
+		render_batch_free(x->renders);
+		if (x->render_qelem == NULL) {
+			x->render_qelem = qelem_new(x, (method)musicbox_render_report);
 		}
-		else { //Check for further beats
-			while (*(back_beat + j) != -1) {
-				if ((rand_length + current_beat) > * (back_beat + j)) {
-					rand_length = *(back_beat + j) - current_beat;
-					break;
-				}
-				j++;
-			}
+		x->renders = render_batch_start(musicbox_tables(x), (int)x->voices, tempo, filename,
+			(unsigned int)atom_getlong(argv + 1), (long)atom_getlong(argv + 2), x->render_qelem);
+		if (x->renders == NULL) {
+			post("render: file prefix %s is too long", filename);
 		}
+		return;
+	}
 
-		current_note->length = rand_length;
-		current_note->value = rand_note;
+	unsigned int seed = argc >= 2 ? (unsigned int)atom_getlong(argv + 1) : x->seed;
 
-		current_beat = current_beat + rand_length;
+	song* rendered = song_new(musicbox_tables(x));
+	rendered->rng = seed;
+	rendered->piano_voices = (int)x->voices;
+	if (musicbox_generate(rendered) && render_song(rendered, tempo, filename)) {
+		post("Rendered seed %u to %s", seed, filename);
+	}
+	song_free(rendered);
+}
 
-		current_note->next = (note*)malloc(sizeof(note));
-		current_note->next->value = NULL;
-		current_note->next->length = 0;
-		current_note->next->next = NULL;
-		current_note = current_note->next;
+void musicbox_render_report(t_musicbox* x)
+{
+	if (x->renders == NULL || !render_batch_finished(x->renders)) {
+		return;
 	}
+	double took = systimer_gettime() - x->renders->started;
+	render_batch* job = x->renders;
+	post("Render finished: %ld of %ld seeds written to %s<seed>.wav in %.1f ms, %.0f songs a minute",
+		job->rendered, job->count, job->prefix, took, took > 0 ? job->rendered * 60000.0 / took : 0);
+	if (job->failed > 0) {
+		post("render: %ld seeds did not generate or could not be written", job->failed);
+	}
+	render_batch_free(job);
+	x->renders = NULL;
 }
 
-void musicbox_create_bass_phrase(t_musicbox* x, phrase* current_phrase, phrase* follow_phrase, int** progression) {
-	for (int i = 0; i < 4; i++) {
-		musicbox_create_bass(x, current_phrase->head, follow_phrase->head, *(progression + i));
-		current_phrase->repetitions = 1;
+// SHARED MEMORY EXPORT
 
-		current_phrase->next = (phrase*)malloc(sizeof(phrase));
-		current_phrase->next->head = (note*)malloc(sizeof(note));
-		current_phrase->next->repetitions = 0;
-		current_phrase->next->next = NULL;
-		current_phrase = current_phrase->next;
+/*
+export <name> [<slots>]
+export off
+Publishes every note played into a shared memory ring that other processes can read, see ring.h
+*/
+void musicbox_export(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	ring_close(x->ring);
+	x->ring = NULL;
+
+	if (argc < 1 || atom_gettype(argv) != A_SYM || strcmp(atom_getsym(argv)->s_name, "off") == 0) {
+		return;
+	}
+
+	char* name = atom_getsym(argv)->s_name;
+	unsigned int slots = argc >= 2 ? (unsigned int)atom_getlong(argv + 1) : 0;
+	x->ring = ring_create(name, slots);
+	if (x->ring == NULL) {
+		post("export: could not create shared memory %s", name);
+	}
+}
+
+void musicbox_publish(t_musicbox* x, int track, int value, float length) {
+	musicbox_publish_at(x, x->position[track], track, value, length);
+}
+
+// Hands a note that has just been played to the recording and the shared memory ring
+void musicbox_publish_at(t_musicbox* x, double beat, int track, int value, float length) {
+	if (x->recording != NULL) {
+		eventlog_add(x->recording, (float)(x->record_offset + beat), length, track, value);
+	}
+	if (x->ring == NULL || value <= 0) {
+		return;
 	}
+	ring_publish(x->ring, (float)beat, length, track, value, (float)(60000.0 / tempo_at(musicbox_timing(x), x->origin + beat)));
 }
 
-void musicbox_create_bass_section(t_musicbox* x, section* current_section, phrase* follow_phrase, int*** progressions) {
-	for (int i = 0; i < 2; i++) {
-		musicbox_create_bass_phrase(x, current_section->head, follow_phrase, *(progressions + i));
-		current_section->repetitions = 2;
+// RECORDING AND REPLAY
+
+/*
+record <file> [<events>]
+record stop
+Appends every note played from now on, rests included, to a buffer that holds events notes
+(EVENTLOG_DEFAULT_EVENTS if not given). Stopping writes it to file, see eventlog.h for the layout.
+Times are beats since recording started, so a recording that spans a bang keeps going forward.
+*/
+void musicbox_record(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("record: expected <file> [<events>] or stop");
+		return;
+	}
+
+	musicbox_record_stop(x);
+	if (strcmp(atom_getsym(argv)->s_name, "stop") == 0) {
+		return;
+	}
 
-		current_section->next = (section*)malloc(sizeof(section));
-		current_section->next->head = (phrase*)malloc(sizeof(phrase));
-		current_section->next->head->head = (note*)malloc(sizeof(note));
-		current_section->next->repetitions = 0;
-		current_section->next->next = NULL;
-		current_section = current_section->next;
+	long size = argc >= 2 ? atom_getlong(argv + 1) : 0;
+	x->recording = eventlog_new(size, x->tempo > 0 ? (float)x->tempo : 120.f, x->seed);
+	if (x->recording == NULL) {
+		post("record: could not allocate %ld events", size);
+		return;
 	}
+	x->record_file = atom_getsym(argv);
+	x->record_offset = -musicbox_now(x);
 }
 
-void musicbox_create_piano(t_musicbox* x, note* current_note, int* scale, int piano_note) {
-	int index = piano_note - 1;
-	int note_value = *(scale + index);
-	current_note->length = 4.0;
-	current_note->value = note_value + 24;
+void musicbox_record_stop(t_musicbox* x)
+{
+	eventlog* log = x->recording;
+	if (log == NULL) {
+		return;
+	}
+	x->recording = NULL;
 
-	current_note->next = (note*)malloc(sizeof(note));
-	current_note->next->value = NULL;
-	current_note->next->length = 0;
-	current_note->next->next = NULL;
-	current_note = current_note->next;
+	if (x->replay != NULL && x->replay_file == x->record_file) {
+		musicbox_replay_stop(x); // Writing a mapped file under the replay would crash it
+	}
+	if (!eventlog_save(log, x->record_file->s_name)) {
+		post("record: could not write %s", x->record_file->s_name);
+	}
+	else if (log->dropped > 0) {
+		post("Recorded %ld events to %s, the last %ld did not fit", log->count, x->record_file->s_name, log->dropped);
+	}
+	else {
+		post("Recorded %ld events to %s", log->count, x->record_file->s_name);
+	}
+	eventlog_free(log);
 }
 
-void musicbox_create_piano_phrase(t_musicbox* x, phrase* current_phrase, int** progression, int piano_note) {
-	for (int i = 0; i < 4; i++) {
-		musicbox_create_piano(x, current_phrase->head, *(progression + i), piano_note);
-		current_phrase->repetitions = 1;
+/*
+replay <file>
+replay off
+Maps a recorded log and plays it straight away. While a log is loaded, bang plays it again
+instead of generating a song. Notes go out of the same outlets, or as batch lists in batch mode,
+at the current tempo (the recorded one if none is set), and are recorded and exported like any
+others. Nothing is generated or allocated while it plays.
+*/
+void musicbox_replay(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("replay: expected <file> or off");
+		return;
+	}
+
+	musicbox_replay_stop(x);
+	char* filename = atom_getsym(argv)->s_name;
+	if (strcmp(filename, "off") == 0) {
+		return;
+	}
+	if (x->recording != NULL && x->record_file == atom_getsym(argv)) {
+		musicbox_record_stop(x); // Replaying what is being recorded, write it out first
+	}
+
+	const char* error;
+	x->replay = eventlog_open(filename, &error);
+	if (x->replay == NULL) {
+		post("replay: %s %s", filename, error);
+		return;
+	}
+	x->replay_file = atom_getsym(argv);
+	x->replay_list = (t_atom*)malloc(sizeof(t_atom) * 3 * (x->replay->longest > 0 ? x->replay->longest : 1));
+	x->play = 0;
+	musicbox_bang(x);
+}
 
-		current_phrase->next = (phrase*)malloc(sizeof(phrase));
-		current_phrase->next->head = (note*)malloc(sizeof(note));
-		current_phrase->next->repetitions = 0;
-		current_phrase->next->next = NULL;
-		current_phrase = current_phrase->next;
+void musicbox_replay_stop(t_musicbox* x)
+{
+	if (x->replay == NULL) {
+		return;
 	}
+	if (x->replay_clock != NULL) {
+		musicbox_unset(x, STREAM_REPLAY);
+	}
+	x->play = 0;
+	eventlog_close(x->replay);
+	free(x->replay_list);
+	x->replay = NULL;
+	x->replay_list = NULL;
 }
 
-void musicbox_create_piano_section(t_musicbox* x, section* current_section, int*** progressions, int piano_note) {
-	for (int i = 0; i < 2; i++) {
-		musicbox_create_piano_phrase(x, current_section->head, *(progressions + i), piano_note);
-		current_section->repetitions = 2;
+/*
+Sends the records that share the next time, the way the track tasks or the batch task sent them,
+then waits for the time after. Piano records with the same time are one chord.
+*/
+void musicbox_replay_task(t_musicbox* x) {
+	const eventlog_record* records = x->replay->records;
+	long first = x->replay_next;
+
+	if (first >= x->replay->count) {
+		return;
+	}
+	TRACE_BEGIN(span);
+	long last = eventlog_group_end(x->replay, first);
+	x->replay_next = last;
+	if (last < x->replay->count) {
+		musicbox_at(x, STREAM_REPLAY, records[last].time);
+	}
 
-		current_section->next = (section*)malloc(sizeof(section));
-		current_section->next->head = (phrase*)malloc(sizeof(phrase));
-		current_section->next->head->head = (note*)malloc(sizeof(note));
-		current_section->next->repetitions = 0;
-		current_section->next->next = NULL;
-		current_section = current_section->next;
+	void* values[TRACK_COUNT] = {
+		NULL, x->bass_outlet_value, x->melody_outlet_value,
+		x->hat_outlet_value, x->ghost_outlet_value, x->snare_outlet_value, x->kick_outlet_value
+	};
+	void* lengths[TRACK_COUNT] = {
+		x->piano_outlet_length, x->bass_outlet_length, x->melody_outlet_length,
+		x->hat_outlet_length, x->ghost_outlet_length, x->snare_outlet_length, x->kick_outlet_length
+	};
+	void* piano[4] = { x->piano_outlet_value_1, x->piano_outlet_value_2, x->piano_outlet_value_3, x->piano_outlet_value_4 };
+	t_atom* list = x->replay_list;
+
+	if (x->batch) {
+		long n = 0;
+		for (long i = first; i < last; i++) {
+			const eventlog_record* r = &records[i];
+			if (r->value > 0) {
+				atom_setlong(list + 3 * n, r->track);
+				atom_setlong(list + 3 * n + 1, r->value);
+				atom_setfloat(list + 3 * n + 2, musicbox_ms(x, r->time, r->length));
+				n++;
+			}
+		}
+		if (n > 0) {
+			outlet_list(x->batch_outlet, NULL, (short)(3 * n), list);
+		}
 	}
-}
\ No newline at end of file
+
+	for (long i = first; i < last && !x->batch; ) {
+		const eventlog_record* r = &records[i];
+		double length = musicbox_ms(x, r->time, r->length);
+		if (r->track >= TRACK_COUNT) {
+			i++;
+			continue;
+		}
+		if (r->track != TRACK_PIANO) {
+			outlet_int(values[r->track], r->value);
+			outlet_float(lengths[r->track], length);
+			i++;
+			continue;
+		}
+
+		long voices = 0;
+		while (i + voices < last && records[i + voices].track == TRACK_PIANO) {
+			voices++;
+		}
+		if (voices > 4) {
+			for (long v = 0; v < voices; v++) {
+				atom_setlong(list + 3 * v, TRACK_PIANO);
+				atom_setlong(list + 3 * v + 1, records[i + v].value);
+				atom_setfloat(list + 3 * v + 2, length);
+			}
+			outlet_list(x->batch_outlet, NULL, (short)(3 * voices), list);
+		}
+		for (int v = 0; v < 4; v++) {
+			outlet_int(piano[v], records[i + v % voices].value);
+		}
+		outlet_float(x->piano_outlet_length, length);
+		i += voices;
+	}
+
+	for (long i = first; i < last; i++) {
+		const eventlog_record* r = &records[i];
+		if (x->batch && r->value <= 0) {
+			continue; // Batch mode never sent it
+		}
+		musicbox_publish_at(x, r->time, r->track, r->value, r->length);
+	}
+	TRACE_END(span, "musicbox_replay_task");
+}
+
+// PROFILING
+
+/*
+trace start
+trace stop
+trace <file>
+Records how long generation and playback take, then saves it as a Chrome trace, see trace.h
+*/
+void musicbox_trace(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+#ifdef MUSICBOX_TRACE
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("trace: expected start, stop or <file>");
+		return;
+	}
+
+	char* name = atom_getsym(argv)->s_name;
+	if (strcmp(name, "start") == 0) {
+		trace_start();
+	}
+	else if (strcmp(name, "stop") == 0) {
+		trace_stop();
+	}
+	else {
+		long spans = trace_save(name);
+		if (spans < 0) {
+			post("trace: could not write %s", name);
+		}
+		else {
+			post("Saved %ld spans to %s", spans, name);
+		}
+	}
+#else
+	post("trace: this build was made without MUSICBOX_TRACE");
+#endif
+}
+
+/*
+startup <n>
+Times making and deleting n more instances, roughly what opening a patch that holds them costs
+*/
+void musicbox_startup(t_musicbox* x, long n)
+{
+	if (n < 1) {
+		post("startup: expected a number of instances");
+		return;
+	}
+
+	t_object** made = (t_object**)malloc(sizeof(t_object*) * n);
+	double start = systimer_gettime();
+	for (long i = 0; i < n; i++) {
+		made[i] = (t_object*)object_new(CLASS_BOX, gensym("musicbox"));
+	}
+	double created = systimer_gettime();
+	for (long i = 0; i < n; i++) {
+		object_free(made[i]);
+	}
+	double freed = systimer_gettime();
+	free(made);
+
+	post("startup: %ld instances made in %.3f ms, %.2f us each, freed in %.3f ms",
+		n, created - start, (created - start) * 1000.0 / n, freed - created);
+}
+
+/*
+ingest <file> [<threads>]
+Times reading a pattern file the way the shared tables do and posts the throughput, then reads
+it again looking every word up in the note names the way it used to be read, posts that
+throughput and checks both gave the same words
+*/
+void musicbox_ingest(t_musicbox* x, t_symbol* s, long argc, t_atom* argv)
+{
+	if (argc < 1 || atom_gettype(argv) != A_SYM) {
+		post("ingest: expected <file> [<threads>]");
+		return;
+	}
+
+	char* filename = atom_getsym(argv)->s_name;
+	int threads = argc >= 2 ? (int)atom_getlong(argv + 1) : PATTERN_THREADS;
+	ht_t* hash_note_names = musicbox_tables(x)->hash_note_names;
+	double start = systimer_gettime();
+	pattern_file* f = pattern_load_threads(filename, NULL, threads);
+	double took = systimer_gettime() - start;
+	if (f == NULL) {
+		return;
+	}
+	start = systimer_gettime();
+	pattern_file* looked_up = pattern_load_threads(filename, hash_note_names, threads);
+	double took_lookup = systimer_gettime() - start;
+
+	double bytes = 0;
+	FILE* fp = fopen(filename, "rb");
+	if (fp != NULL) {
+		fseek(fp, 0, SEEK_END);
+		bytes = (double)ftell(fp);
+		fclose(fp);
+	}
+	post("ingest: %d rows, %d words, %.1f MB in %.3f ms on %d threads, %.1f MB/s",
+		f->row_count, f->token_count, bytes / 1e6, took, threads, took > 0 ? bytes / 1e3 / took : 0);
+
+	// Compare word by word, lengths as bits so -0 and NaN count too
+	int differ = -1;
+	if (looked_up == NULL || looked_up->token_count != f->token_count || looked_up->row_count != f->row_count
+		|| memcmp(looked_up->row_start, f->row_start, sizeof(int) * (f->row_count + 1)) != 0) {
+		differ = 0;
+	}
+	for (int i = 0; i < f->token_count && differ < 0; i++) {
+		if (memcmp(&looked_up->tokens[i], &f->tokens[i], sizeof(pattern_token)) != 0) {
+			differ = i;
+		}
+	}
+	if (differ >= 0) {
+		post("ingest: looking words up took %.3f ms, %.1f MB/s, and read them differently from word %d",
+			took_lookup, took_lookup > 0 ? bytes / 1e3 / took_lookup : 0, differ);
+	}
+	else {
+		post("ingest: looking words up took %.3f ms, %.1f MB/s, and read the same words",
+			took_lookup, took_lookup > 0 ? bytes / 1e3 / took_lookup : 0);
+	}
+	pattern_free(looked_up);
+	pattern_free(f);
+}
@@ -0,0 +1,335 @@
+/**
+	@file
+	musicbox~ - a signal version of musicbox, with note gates and pitches timed to the sample
+	Caden Kesey
+*/
+
+#include "ext.h"
+#include "ext_obex.h"
+#include "ext_systhread.h"
+#include "z_dsp.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "D:/music_algorithm/trace.h"
+#include "D:/music_algorithm/hash.h"
+#include "D:/music_algorithm/midi_notes.h"
+#include "D:/music_algorithm/extra.h"
+#include "D:/music_algorithm/scales.h"
+#include "D:/music_algorithm/chords.h"
+#include "D:/music_algorithm/markov.h"
+#include "D:/music_algorithm/tables.h"
+#include "D:/music_algorithm/taskgraph.h"
+#include "D:/music_algorithm/generator.h"
+#include "D:/music_algorithm/events.h"
+
+// Voices, each has a pitch and a gate outlet, in outlet order from the left
+
+enum {
+	VOICE_KICK,
+	VOICE_SNARE,
+	VOICE_GHOST,
+	VOICE_HAT,
+	VOICE_MELODY,
+	VOICE_BASS,
+	VOICE_PIANO1,
+	VOICE_PIANO2,
+	VOICE_PIANO3,
+	VOICE_PIANO4,
+	VOICE_COUNT
+};
+
+// OBJECT STRUCT
+
+typedef struct voice_state {
+	event_list events; // Every note of the voice, in time order
+	long next; // Next event to start
+	double off; // Beat the sounding note ends
+	double pitch;
+	double gate;
+} voice_state;
+
+typedef struct _musicbox_tilde
+{
+	t_pxobject p_ob; // The object itself
+
+	voice_state voices[VOICE_COUNT];
+	double beat; // Song position in beats, advanced by the perform routine
+	double song_beats; // Length of the song in beats
+	double samplerate;
+	t_systhread_mutex lock; // Held by bang while it swaps in a new song
+
+	unsigned int seed; // Seed for random number generation
+	long tempo; // Tempo of the song
+	int play;
+
+	tables* tables; // Note names, patterns, chords and melody model, shared with every other instance
+
+} t_musicbox_tilde;
+
+// FUNCTION PROTOTYPES
+
+void musicbox_tilde_bang(t_musicbox_tilde* x);
+void musicbox_tilde_in1(t_musicbox_tilde* x, long n);
+void musicbox_tilde_in2(t_musicbox_tilde* x, long n);
+void* musicbox_tilde_new(t_symbol* s, long argc, t_atom* argv);
+void musicbox_tilde_free(t_musicbox_tilde* x);
+void musicbox_tilde_assist(t_musicbox_tilde* x, void* b, long m, long a, char* s);
+void musicbox_tilde_dsp64(t_musicbox_tilde* x, t_object* dsp64, short* count, double samplerate, long maxvectorsize, long flags);
+void musicbox_tilde_perform64(t_musicbox_tilde* x, t_object* dsp64, double** ins, long numins, double** outs, long numouts, long sampleframes, long flags, void* userparam);
+
+// GLOBAL CLASS POINTER VARIABLE
+
+static t_class* musicbox_tilde_class;
+
+// MAIN METHOD
+
+void ext_main(void* r)
+{
+	t_class* c;
+
+	c = class_new("musicbox~", (method)musicbox_tilde_new, (method)musicbox_tilde_free, (long)sizeof(t_musicbox_tilde),
+				  0L, A_GIMME, 0);
+
+	class_addmethod(c, (method)musicbox_tilde_bang, "bang", 0);
+	class_addmethod(c, (method)musicbox_tilde_assist, "assist", A_CANT, 0);
+	class_addmethod(c, (method)musicbox_tilde_dsp64, "dsp64", A_CANT, 0);
+
+	class_addmethod(c, (method)musicbox_tilde_in1, "in1", A_LONG, 0);
+	class_addmethod(c, (method)musicbox_tilde_in2, "in2", A_LONG, 0);
+
+	class_dspinit(c);
+	class_register(CLASS_BOX, c);
+	musicbox_tilde_class = c;
+
+	post("Music box~ object has been loaded");
+}
+
+// OBJECT CREATION
+
+void* musicbox_tilde_new(t_symbol* s, long argc, t_atom* argv)
+{
+	t_musicbox_tilde* x = (t_musicbox_tilde*)object_alloc(musicbox_tilde_class);
+
+	// Inlets
+
+	dsp_setup((t_pxobject*)x, 1);
+	intin(x, 1);
+	intin(x, 2);
+
+	// Outlets, a pitch and a gate signal per voice
+
+	for (int i = 0; i < VOICE_COUNT * 2; i++) {
+		outlet_new(x, "signal");
+	}
+
+	// Voices
+
+	for (int v = 0; v < VOICE_COUNT; v++) {
+		events_init(&x->voices[v].events);
+		x->voices[v].next = 0;
+		x->voices[v].off = 0;
+		x->voices[v].pitch = 0;
+		x->voices[v].gate = 0;
+	}
+
+	// Other variables
+
+	x->beat = 0;
+	x->song_beats = 0;
+	x->samplerate = sys_getsr();
+	x->tempo = 0;
+	x->seed = 0;
+	x->play = 0;
+	systhread_mutex_new(&x->lock, 0);
+
+	// Tables, attached on the first bang so patches with many instances open quickly
+
+	x->tables = NULL;
+
+	return(x);
+}
+
+void musicbox_tilde_assist(t_musicbox_tilde* x, void* b, long m, long a, char* s)
+{
+	static const char* voice_names[VOICE_COUNT] = {
+		"Kick", "Snare", "Ghost", "Hi-hat", "Melody", "Bass", "Piano 1", "Piano 2", "Piano 3", "Piano 4"
+	};
+
+	// Inlets
+
+	if (m == ASSIST_INLET) {
+		if (a == 0) {
+			sprintf(s, "Start playing a sequence of notes");
+		}
+		else if (a == 1) {
+			sprintf(s, "Seed 1");
+		}
+		else if (a == 2) {
+			sprintf(s, "Tempo");
+		}
+	}
+
+	// Outlets
+
+	else if (a < VOICE_COUNT * 2) {
+		sprintf(s, "(signal) %s %s", voice_names[a / 2], (a % 2) ? "gate" : "pitch");
+	}
+}
+
+void musicbox_tilde_free(t_musicbox_tilde* x)
+{
+	dsp_free((t_pxobject*)x);
+	for (int v = 0; v < VOICE_COUNT; v++) {
+		events_clear(&x->voices[v].events);
+	}
+	systhread_mutex_free(x->lock);
+	tables_detach(x->tables);
+}
+
+// INPUTS
+
+void musicbox_tilde_bang(t_musicbox_tilde* x)
+{
+	if (x->play) {
+		x->play = 0;
+		return;
+	}
+
+	// Generate with the same core as musicbox, then flatten into timed events
+
+	if (x->tables == NULL) {
+		x->tables = tables_attach();
+	}
+	song* s = song_new(x->tables);
+	s->rng = x->seed;
+	if (!musicbox_generate(s)) {
+		song_free(s);
+		return;
+	}
+
+	section* sections[VOICE_COUNT] = {
+		s->kick_section, s->snare_section, s->ghost_section, s->hat_section, s->melody_section,
+		s->bass_section, s->piano_section, s->piano_section, s->piano_section, s->piano_section
+	};
+	int tracks[VOICE_COUNT] = {
+		TRACK_KICK, TRACK_SNARE, TRACK_GHOST, TRACK_HAT, TRACK_MELODY,
+		TRACK_BASS, TRACK_PIANO, TRACK_PIANO, TRACK_PIANO, TRACK_PIANO
+	};
+
+	systhread_mutex_lock(x->lock);
+	x->song_beats = 0;
+	for (int v = 0; v < VOICE_COUNT; v++) {
+		voice_state* voice = &x->voices[v];
+		voice->events.count = 0;
+		int chord_voice = v >= VOICE_PIANO1 ? v - VOICE_PIANO1 : -1; // Each piano outlet plays one pitch of the chords
+		float beats = section_voice_events(sections[v], tracks[v], chord_voice, &voice->events);
+		if (beats > x->song_beats) {
+			x->song_beats = beats;
+		}
+		voice->next = 0;
+		voice->off = 0;
+		voice->gate = 0;
+	}
+	x->beat = 0;
+	x->play = 1;
+	systhread_mutex_unlock(x->lock);
+
+	song_free(s);
+}
+
+void musicbox_tilde_in1(t_musicbox_tilde* x, long n)
+{
+	x->tempo = n; // Picked up by the next signal vector
+}
+
+void musicbox_tilde_in2(t_musicbox_tilde* x, long n)
+{
+	x->seed = (unsigned int)n;
+}
+
+// SIGNAL PROCESSING
+
+void musicbox_tilde_dsp64(t_musicbox_tilde* x, t_object* dsp64, short* count, double samplerate, long maxvectorsize, long flags)
+{
+	x->samplerate = samplerate;
+	object_method(dsp64, gensym("dsp_add64"), x, musicbox_tilde_perform64, 0, NULL);
+}
+
+/*
+Fills one voice's outlets for a vector. Instead of testing every sample, it jumps from one note
+start or end to the next and fills the samples in between, so the cost is per note, not per sample.
+Notes end one sample early so back to back notes still show a gap in the gate.
+*/
+void musicbox_tilde_voice(voice_state* voice, double beat, double inc, double* pitch_out, double* gate_out, long frames)
+{
+	long i = 0;
+	while (i < frames) {
+		double now = beat + i * inc + inc * 1e-6; // Allow for rounding in the running beat count
+
+		// Apply every change due by this sample
+		for (;;) {
+			if (voice->next < voice->events.count && voice->events.events[voice->next].time <= now) {
+				event* e = &voice->events.events[voice->next];
+				voice->pitch = e->value;
+				voice->gate = 1;
+				voice->off = e->time + e->length - inc;
+				voice->next++;
+			}
+			else if (voice->gate != 0 && voice->off <= now) {
+				voice->gate = 0;
+			}
+			else {
+				break;
+			}
+		}
+
+		// Fill up to the next change
+		long stop = frames;
+		double change = -1;
+		if (voice->next < voice->events.count) {
+			change = voice->events.events[voice->next].time;
+		}
+		if (voice->gate != 0 && (change < 0 || voice->off < change)) {
+			change = voice->off;
+		}
+		if (change >= 0) {
+			double until = ceil((change - now) / inc); // First sample at or after the change
+			if (until < 1) {
+				until = 1;
+			}
+			if (until < frames - i) {
+				stop = i + (long)until;
+			}
+		}
+		for (; i < stop; i++) {
+			pitch_out[i] = voice->pitch;
+			gate_out[i] = voice->gate;
+		}
+	}
+}
+
+void musicbox_tilde_perform64(t_musicbox_tilde* x, t_object* dsp64, double** ins, long numins, double** outs, long numouts, long sampleframes, long flags, void* userparam)
+{
+	// Skip the vector rather than wait if bang is swapping songs
+	if (!x->play || x->tempo <= 0 || systhread_mutex_trylock(x->lock) != 0) {
+		for (long o = 0; o < numouts; o++) {
+			memset(outs[o], 0, sizeof(double) * sampleframes);
+		}
+		return;
+	}
+
+	double inc = (double)x->tempo / (60.0 * x->samplerate); // Beats per sample
+
+	for (int v = 0; v < VOICE_COUNT; v++) {
+		musicbox_tilde_voice(&x->voices[v], x->beat, inc, outs[v * 2], outs[v * 2 + 1], sampleframes);
+	}
+
+	x->beat += inc * sampleframes;
+	if (x->beat >= x->song_beats) {
+		x->play = 0;
+	}
+	systhread_mutex_unlock(x->lock);
+}
@@ -0,0 +1,309 @@
+/**
+	@file
+	playlist - a queue of seeds to play one after another, generated ahead on a background thread
+	Caden Kesey
+*/
+
+/*
+Entries are played from the front. A worker thread generates the first depth entries that don't
+have a song yet, so by the time the song before them ends they are ready and the hand-off only
+swaps pointers. Songs that have finished playing are handed back to the worker to free, so the
+scheduler thread never generates or frees a song while the queue keeps up.
+
+If the next song isn't ready when it is needed (depth 0, or generation slower than a song) the
+hand-off waits for it and counts as late.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLAYLIST_MAX_DEPTH 16 // Most songs generated ahead
+#define PLAYLIST_DEFAULT_DEPTH 1
+
+enum {
+	ENTRY_WAITING, // Not generated yet
+	ENTRY_GENERATING,
+	ENTRY_READY,
+	ENTRY_FAILED
+};
+
+typedef struct playlist_entry {
+	unsigned int seed;
+	long tempo; // 0 keeps the tempo playing when the song starts
+	int voices; // Piano chord width when it was queued
+	int state;
+	song* song; // Set once ready
+} playlist_entry;
+
+typedef struct playlist {
+	tables* tables; // Shared, the instance that owns the playlist keeps them attached
+
+	playlist_entry* entries; // Queue, first entry at head
+	long head;
+	long count; // Entries after head
+	long size;
+	long depth; // Entries generated ahead of the one playing
+	int urgent; // Set while a hand-off waits, so depth 0 still gets its song made
+
+	song** retired; // Played songs for the worker to free
+	long retired_count;
+	long retired_size;
+
+	volatile int stop;
+	t_systhread thread;
+	t_systhread_mutex lock;
+	t_systhread_cond changed; // Signalled when there is work for the worker or a song is ready
+
+	// Stats
+
+	long played; // Songs taken from the queue
+	long late; // Taken before they were ready
+	long failed;
+	double waited; // Milliseconds spent waiting for late songs
+	long generated;
+	double generate_total; // Milliseconds
+	double generate_longest;
+} playlist;
+
+// Worker
+
+// Next entry within the prefetch depth that needs a song, -1 if none. Called with the lock held.
+long playlist_pending(playlist* p) {
+	long depth = p->depth > 0 ? p->depth : p->urgent;
+	for (long i = 0; i < p->count && i < depth; i++) {
+		if (p->entries[p->head + i].state == ENTRY_WAITING) {
+			return p->head + i;
+		}
+	}
+	return -1;
+}
+
+// Generates songs when there is room ahead and frees retired ones, until stopped
+void* playlist_worker(playlist* p) {
+	systhread_mutex_lock(p->lock);
+	while (!p->stop) {
+		if (p->retired_count > 0) {
+			song* done = p->retired[--p->retired_count];
+			systhread_mutex_unlock(p->lock);
+			song_free(done);
+			systhread_mutex_lock(p->lock);
+			continue;
+		}
+
+		long i = playlist_pending(p);
+		if (i < 0) {
+			systhread_cond_wait(p->changed, p->lock);
+			continue;
+		}
+
+		playlist_entry* e = &p->entries[i];
+		unsigned int seed = e->seed;
+		int voices = e->voices;
+		e->state = ENTRY_GENERATING;
+		systhread_mutex_unlock(p->lock);
+
+		double start = systimer_gettime();
+		song* s = song_new(p->tables);
+		s->rng = seed;
+		s->piano_voices = voices;
+		int ok = musicbox_generate(s);
+		double took = systimer_gettime() - start;
+
+		systhread_mutex_lock(p->lock);
+		e = &p->entries[i]; // The queue may have moved while unlocked, indexes stay valid
+		if (e->state == ENTRY_GENERATING && ok) {
+			e->song = s;
+			e->state = ENTRY_READY;
+		}
+		else { // Failed, or cleared while generating
+			if (e->state == ENTRY_GENERATING) {
+				e->state = ENTRY_FAILED;
+			}
+			song_free(s);
+		}
+		p->generated++;
+		p->generate_total += took;
+		if (took > p->generate_longest) {
+			p->generate_longest = took;
+		}
+		systhread_cond_broadcast(p->changed);
+	}
+	systhread_mutex_unlock(p->lock);
+
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+// Playlist lifetime
+
+playlist* playlist_new(tables* shared) {
+	playlist* p = (playlist*)malloc(sizeof(playlist));
+	memset(p, 0, sizeof(playlist));
+	p->tables = shared;
+	p->depth = PLAYLIST_DEFAULT_DEPTH;
+	systhread_mutex_new(&p->lock, 0);
+	systhread_cond_new(&p->changed, 0);
+	systhread_create((method)playlist_worker, p, 0, 0, 0, &p->thread);
+	return p;
+}
+
+// Drops every entry, songs being generated are freed by the worker when they finish
+void playlist_clear(playlist* p) {
+	systhread_mutex_lock(p->lock);
+	for (long i = p->head; i < p->head + p->count; i++) {
+		song_free(p->entries[i].song);
+		p->entries[i].song = NULL;
+		p->entries[i].state = ENTRY_FAILED;
+	}
+	p->head += p->count;
+	p->count = 0;
+	systhread_mutex_unlock(p->lock);
+}
+
+void playlist_free(playlist* p) {
+	unsigned int ret;
+	if (p == NULL) {
+		return;
+	}
+	systhread_mutex_lock(p->lock);
+	p->stop = 1;
+	systhread_cond_broadcast(p->changed);
+	systhread_mutex_unlock(p->lock);
+	systhread_join(p->thread, &ret);
+
+	for (long i = p->head; i < p->head + p->count; i++) {
+		song_free(p->entries[i].song);
+	}
+	for (long i = 0; i < p->retired_count; i++) {
+		song_free(p->retired[i]);
+	}
+	systhread_cond_free(p->changed);
+	systhread_mutex_free(p->lock);
+	free(p->entries);
+	free(p->retired);
+	free(p);
+}
+
+// Queue
+
+void playlist_add(playlist* p, unsigned int seed, long tempo, int voices) {
+	systhread_mutex_lock(p->lock);
+	if (p->head + p->count == p->size) {
+		if (p->head > 0 && p->head >= p->size / 2) { // Reuse the room in front once it is half the queue
+			long i = 0;
+			while (i < p->count && p->entries[p->head + i].state != ENTRY_GENERATING) {
+				i++;
+			}
+			if (i == p->count) { // The worker holds no index into the queue
+				memmove(p->entries, p->entries + p->head, sizeof(playlist_entry) * p->count);
+				p->head = 0;
+			}
+		}
+		if (p->head + p->count == p->size) {
+			p->size = p->size ? p->size * 2 : 16;
+			p->entries = (playlist_entry*)realloc(p->entries, sizeof(playlist_entry) * p->size);
+		}
+	}
+	playlist_entry* e = &p->entries[p->head + p->count];
+	e->seed = seed;
+	e->tempo = tempo;
+	e->voices = voices;
+	e->state = ENTRY_WAITING;
+	e->song = NULL;
+	p->count++;
+	systhread_cond_broadcast(p->changed);
+	systhread_mutex_unlock(p->lock);
+}
+
+void playlist_set_depth(playlist* p, long depth) {
+	systhread_mutex_lock(p->lock);
+	p->depth = depth;
+	systhread_cond_broadcast(p->changed);
+	systhread_mutex_unlock(p->lock);
+}
+
+long playlist_count(playlist* p) {
+	systhread_mutex_lock(p->lock);
+	long n = p->count;
+	systhread_mutex_unlock(p->lock);
+	return n;
+}
+
+/*
+Takes the first entry's song, waiting for the worker if it isn't ready. Returns NULL when the
+queue is empty. Entries that failed to generate are skipped. seed and tempo are set from the
+entry taken.
+*/
+song* playlist_take(playlist* p, unsigned int* seed, long* tempo) {
+	song* s = NULL;
+	systhread_mutex_lock(p->lock);
+	while (s == NULL && p->count > 0) {
+		playlist_entry* e = &p->entries[p->head];
+		if (e->state == ENTRY_WAITING || e->state == ENTRY_GENERATING) {
+			double start = systimer_gettime();
+			p->urgent = 1;
+			systhread_cond_broadcast(p->changed);
+			while (e->state == ENTRY_WAITING || e->state == ENTRY_GENERATING) {
+				systhread_cond_wait(p->changed, p->lock);
+				if (p->count == 0) { // Cleared while waiting
+					break;
+				}
+				e = &p->entries[p->head];
+			}
+			p->urgent = 0;
+			p->late++;
+			p->waited += systimer_gettime() - start;
+			if (p->count == 0) {
+				break;
+			}
+		}
+		if (e->state == ENTRY_FAILED) {
+			p->failed++;
+		}
+		else {
+			s = e->song;
+			*seed = e->seed;
+			*tempo = e->tempo;
+			p->played++;
+		}
+		e->song = NULL;
+		p->head++;
+		p->count--;
+	}
+	if (p->count == 0) {
+		p->head = 0;
+	}
+	systhread_cond_broadcast(p->changed); // Room for one more ahead
+	systhread_mutex_unlock(p->lock);
+	return s;
+}
+
+// Hands a song that has finished playing to the worker to free
+void playlist_retire(playlist* p, song* s) {
+	if (s == NULL) {
+		return;
+	}
+	systhread_mutex_lock(p->lock);
+	if (p->retired_count == p->retired_size) {
+		p->retired_size = p->retired_size ? p->retired_size * 2 : 4;
+		p->retired = (song**)realloc(p->retired, sizeof(song*) * p->retired_size);
+	}
+	p->retired[p->retired_count++] = s;
+	systhread_cond_broadcast(p->changed);
+	systhread_mutex_unlock(p->lock);
+}
+
+void playlist_post_stats(playlist* p) {
+	systhread_mutex_lock(p->lock);
+	long ready = 0;
+	for (long i = p->head; i < p->head + p->count; i++) {
+		ready += p->entries[i].state == ENTRY_READY;
+	}
+	post("queue: %ld queued, %ld ready, prefetch depth %ld", p->count, ready, p->depth);
+	post("queue: %ld played, %ld late (%.3f ms waited), %ld failed", p->played, p->late, p->waited, p->failed);
+	post("queue: %ld generated, %.3f ms average, %.3f ms longest", p->generated,
+		p->generated > 0 ? p->generate_total / p->generated : 0, p->generate_longest);
+	systhread_mutex_unlock(p->lock);
+}
@@ -0,0 +1,431 @@
+/**
+	@file
+	render - synthesizes a song straight to a WAV file, faster than real time
+	Caden Kesey
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RENDER_SSE 1
+#endif
+
+#define RENDER_RATE 44100 // Samples per second
+#define RENDER_TAIL 1.0 // Seconds left after the last note for it to ring out
+#define RENDER_RELEASE 0.03 // Seconds for a tone to fade once its note ends
+#define RENDER_ATTACK 64 // Samples for a tone to fade in
+#define RENDER_PARTIALS 5 // Harmonics per tone
+#define RENDER_PATH 1024 // Room for the file prefix of a batch
+
+// Structs
+
+typedef struct voice {
+	float partials[RENDER_PARTIALS]; // Level of each harmonic
+	float gain;
+	float decay; // Seconds to fall to about a third while the note is held
+} voice;
+
+typedef struct render_track {
+	event_list events;
+	int track;
+	float* buffer;
+	long frames;
+	double beat_seconds;
+	unsigned int noise; // Noise generator state
+	t_systhread thread;
+} render_track;
+
+// A range of seeds being rendered one after another on a worker thread
+typedef struct render_batch {
+	tables* tables; // Shared, the instance that started it keeps them attached
+	int piano_voices;
+	double tempo;
+	char prefix[RENDER_PATH]; // Each file is this followed by the seed and .wav
+
+	unsigned int first_seed;
+	long count;
+	long rendered; // Files written
+	long failed; // Seeds that didn't generate or couldn't be written
+	volatile int stop;
+	int finished;
+
+	t_systhread thread;
+	t_systhread_mutex lock;
+	void* report; // Qelem set when the worker finishes
+	double started;
+} render_batch;
+
+// Tone shapes for the pitched tracks
+
+const voice render_piano = { { 1.0f, 0.5f, 0.25f, 0.12f, 0.06f }, 0.10f, 1.2f };
+const voice render_bass = { { 1.0f, 0.35f, 0.1f, 0.0f, 0.0f }, 0.30f, 0.8f };
+const voice render_melody = { { 1.0f, 0.0f, 0.33f, 0.0f, 0.2f }, 0.18f, 0.6f };
+
+float midi_to_hz(int value) {
+	return 440.0f * powf(2.0f, (value - 69) / 12.0f);
+}
+
+// Oscillators
+
+/*
+sin(2 pi p) for p in [0, 1), from a parabola with one correction step.
+Close enough for auditioning and needs no tables, so it vectorizes.
+*/
+float render_sin(float p) {
+	float x = p + p - 1.0f;
+	float y = 4.0f * x * (1.0f - fabsf(x));
+	y = 0.225f * (y * fabsf(y) - y) + y;
+	return -y;
+}
+
+#ifdef RENDER_SSE
+__m128 render_sin4(__m128 p) {
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 x = _mm_sub_ps(_mm_add_ps(p, p), one);
+	__m128 y = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), x), _mm_sub_ps(one, _mm_andnot_ps(sign, x)));
+	y = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.225f), _mm_sub_ps(_mm_mul_ps(y, _mm_andnot_ps(sign, y)), y)), y);
+	return _mm_xor_ps(y, sign);
+}
+
+__m128 render_frac4(__m128 v) {
+	return _mm_sub_ps(v, _mm_cvtepi32_ps(_mm_cvttps_epi32(v)));
+}
+#endif
+
+/*
+Adds frames samples of a decaying additive tone to out. Phase and level carry over between
+calls so a note can be rendered in a held part and a released part. Four samples at a time
+with SSE2, one at a time otherwise.
+*/
+void render_partials(float* out, long frames, const voice* v, float* phase, float inc, float* level, float decay) {
+	long i = 0;
+	float p = *phase;
+	float env = *level;
+
+#ifdef RENDER_SSE
+	float d2 = decay * decay;
+	__m128 envs = _mm_set_ps(env * d2 * decay, env * d2, env * decay, env);
+	__m128 decay4 = _mm_set1_ps(d2 * d2);
+	__m128 steps = _mm_set_ps(3.0f * inc, 2.0f * inc, inc, 0.0f);
+
+	for (; i + 4 <= frames; i += 4) {
+		__m128 ps = _mm_add_ps(_mm_set1_ps(p), steps);
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < RENDER_PARTIALS; k++) {
+			if (v->partials[k] != 0.0f) {
+				__m128 pk = render_frac4(_mm_mul_ps(ps, _mm_set1_ps((float)(k + 1))));
+				sum = _mm_add_ps(sum, _mm_mul_ps(render_sin4(pk), _mm_set1_ps(v->partials[k])));
+			}
+		}
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(sum, envs)));
+		envs = _mm_mul_ps(envs, decay4);
+
+		p += 4.0f * inc;
+		p -= (float)(int)p;
+	}
+	_mm_store_ss(&env, envs);
+#endif
+
+	for (; i < frames; i++) {
+		float sum = 0;
+		for (int k = 0; k < RENDER_PARTIALS; k++) {
+			if (v->partials[k] != 0.0f) {
+				float pk = p * (k + 1);
+				sum += render_sin(pk - (float)(int)pk) * v->partials[k];
+			}
+		}
+		out[i] += sum * env;
+		env *= decay;
+		p += inc;
+		p -= (float)(int)p;
+	}
+
+	*phase = p;
+	*level = env;
+}
+
+void render_tone(float* out, long frames, int value, float length, const voice* v) {
+	float inc = midi_to_hz(value) / RENDER_RATE;
+	float phase = 0;
+	float level = v->gain;
+	long held = (long)(length * RENDER_RATE);
+	long release = (long)(RENDER_RELEASE * RENDER_RATE);
+
+	if (held > frames) {
+		held = frames;
+	}
+	if (held + release > frames) {
+		release = frames - held;
+	}
+
+	render_partials(out, held, v, &phase, inc, &level, expf(-1.0f / (v->decay * RENDER_RATE)));
+	render_partials(out + held, release, v, &phase, inc, &level, expf(-5.0f / release));
+
+	// Fade in to avoid a click
+	for (long i = 0; i < RENDER_ATTACK && i < held; i++) {
+		out[i] *= (float)i / RENDER_ATTACK;
+	}
+}
+
+// Drums, built from noise and a swept sine
+
+float render_noise(unsigned int* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return (float)(*state & 0xffff) / 32768.0f - 1.0f;
+}
+
+void render_drum(float* out, long frames, int track, unsigned int* noise) {
+	float seconds = track == TRACK_KICK ? 0.35f : track == TRACK_HAT ? 0.06f : 0.18f;
+	long length = (long)(seconds * RENDER_RATE);
+	float decay = expf(-5.0f / length);
+	float env = 1.0f;
+	float phase = 0;
+	float last = 0;
+
+	if (length > frames) {
+		length = frames;
+	}
+
+	for (long i = 0; i < length; i++) {
+		float sample = 0;
+		if (track == TRACK_KICK) {
+			float hz = 50.0f + 100.0f * env * env; // Pitch falls with the level
+			phase += hz / RENDER_RATE;
+			phase -= (float)(int)phase;
+			sample = 0.9f * render_sin(phase);
+		}
+		else if (track == TRACK_HAT) {
+			float n = render_noise(noise);
+			sample = 0.25f * (n - last); // Differencing keeps only the top of the noise
+			last = n;
+		}
+		else {
+			phase += 180.0f / RENDER_RATE;
+			phase -= (float)(int)phase;
+			sample = 0.35f * render_noise(noise) + 0.25f * render_sin(phase);
+			if (track == TRACK_GHOST) {
+				sample *= 0.35f;
+			}
+		}
+		out[i] += sample * env;
+		env *= decay;
+	}
+}
+
+// Tracks
+
+void* render_track_thread(render_track* t) {
+	for (long i = 0; i < t->events.count; i++) {
+		event* e = &t->events.events[i];
+		long start = (long)(e->time * t->beat_seconds * RENDER_RATE);
+		if (start >= t->frames) {
+			continue;
+		}
+		float* out = t->buffer + start;
+		long frames = t->frames - start;
+
+		if (t->track == TRACK_PIANO) {
+			render_tone(out, frames, e->value, e->length * (float)t->beat_seconds, &render_piano);
+		}
+		else if (t->track == TRACK_BASS) {
+			render_tone(out, frames, e->value, e->length * (float)t->beat_seconds, &render_bass);
+		}
+		else if (t->track == TRACK_MELODY) {
+			render_tone(out, frames, e->value, e->length * (float)t->beat_seconds, &render_melody);
+		}
+		else {
+			render_drum(out, frames, t->track, &t->noise);
+		}
+	}
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+// WAV output
+
+void render_write_u32(FILE* fp, unsigned int v) {
+	unsigned char b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+	fwrite(b, 1, 4, fp);
+}
+
+void render_write_u16(FILE* fp, unsigned int v) {
+	unsigned char b[2] = { v & 0xff, (v >> 8) & 0xff };
+	fwrite(b, 1, 2, fp);
+}
+
+int render_write_wav(char* filename, float* samples, long frames) {
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		post("Could not open file %s", filename);
+		return 0;
+	}
+
+	// 16 bit mono PCM
+	fwrite("RIFF", 1, 4, fp);
+	render_write_u32(fp, 36 + frames * 2);
+	fwrite("WAVEfmt ", 1, 8, fp);
+	render_write_u32(fp, 16);
+	render_write_u16(fp, 1);
+	render_write_u16(fp, 1);
+	render_write_u32(fp, RENDER_RATE);
+	render_write_u32(fp, RENDER_RATE * 2);
+	render_write_u16(fp, 2);
+	render_write_u16(fp, 16);
+	fwrite("data", 1, 4, fp);
+	render_write_u32(fp, frames * 2);
+
+	short* pcm = (short*)malloc(sizeof(short) * frames);
+	for (long i = 0; i < frames; i++) {
+		pcm[i] = (short)(samples[i] * 32767.0f);
+	}
+	fwrite(pcm, sizeof(short), frames, fp); // WAV is little endian, like every platform Max runs on
+	free(pcm);
+
+	fclose(fp);
+	return 1;
+}
+
+/*
+Renders a song to a WAV file. Each track is synthesized on its own thread into its own buffer,
+then the buffers are mixed down and scaled to fit. Returns 0 if the file couldn't be written.
+*/
+int render_song(song* s, double tempo, char* filename) {
+	section* sections[TRACK_COUNT] = {
+		s->piano_section, s->bass_section, s->melody_section,
+		s->hat_section, s->ghost_section, s->snare_section, s->kick_section
+	};
+	render_track tracks[TRACK_COUNT];
+	double beat_seconds = 60.0 / tempo;
+	float beats = 0;
+
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		events_init(&tracks[t].events);
+		float length = section_events(sections[t], t, &tracks[t].events);
+		if (length > beats) {
+			beats = length;
+		}
+	}
+
+	long frames = (long)((beats * beat_seconds + RENDER_TAIL) * RENDER_RATE);
+
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		tracks[t].track = t;
+		tracks[t].frames = frames;
+		tracks[t].beat_seconds = beat_seconds;
+		tracks[t].noise = 0x9e3779b9u + t;
+		tracks[t].buffer = (float*)calloc(frames, sizeof(float));
+		systhread_create((method)render_track_thread, &tracks[t], 0, 0, 0, &tracks[t].thread);
+	}
+
+	// Mix down
+	float* mix = (float*)calloc(frames, sizeof(float));
+	float peak = 0;
+	unsigned int ret;
+	for (int t = 0; t < TRACK_COUNT; t++) {
+		systhread_join(tracks[t].thread, &ret);
+		for (long i = 0; i < frames; i++) {
+			mix[i] += tracks[t].buffer[i];
+		}
+		free(tracks[t].buffer);
+		events_clear(&tracks[t].events);
+	}
+	for (long i = 0; i < frames; i++) {
+		if (fabsf(mix[i]) > peak) {
+			peak = fabsf(mix[i]);
+		}
+	}
+	if (peak > 0.95f) {
+		float scale = 0.95f / peak;
+		for (long i = 0; i < frames; i++) {
+			mix[i] *= scale;
+		}
+	}
+
+	int written = render_write_wav(filename, mix, frames);
+	free(mix);
+	return written;
+}
+
+// Batches
+
+void* render_batch_worker(render_batch* job) {
+	char filename[RENDER_PATH + 16]; // The prefix, a seed of up to 10 digits and .wav
+	for (long i = 0; i < job->count && !job->stop; i++) {
+		unsigned int seed = job->first_seed + (unsigned int)i;
+		TRACE_BEGIN(span);
+		song* s = song_new(job->tables);
+		s->rng = seed;
+		s->piano_voices = job->piano_voices;
+		snprintf(filename, sizeof(filename), "%s%u.wav", job->prefix, seed);
+		int written = musicbox_generate(s) && render_song(s, job->tempo, filename);
+		song_free(s);
+		systhread_mutex_lock(job->lock);
+		if (written) {
+			job->rendered++;
+		}
+		else {
+			job->failed++;
+		}
+		systhread_mutex_unlock(job->lock);
+		TRACE_END(span, "render_seed");
+	}
+	systhread_mutex_lock(job->lock);
+	job->finished = 1;
+	systhread_mutex_unlock(job->lock);
+	qelem_set(job->report); // Lets the main thread see the batch is done
+
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+/*
+Starts rendering count seeds from first_seed to files named prefix followed by the seed, on one
+worker thread; each song's tracks are still synthesized on threads of their own. Returns NULL
+if the prefix is too long to name the files.
+*/
+render_batch* render_batch_start(tables* shared, int piano_voices, double tempo, const char* prefix, unsigned int first_seed, long count, void* report) {
+	if (strlen(prefix) >= RENDER_PATH) {
+		return NULL;
+	}
+	render_batch* job = (render_batch*)malloc(sizeof(render_batch));
+	memset(job, 0, sizeof(render_batch));
+	job->tables = shared;
+	job->piano_voices = piano_voices;
+	job->tempo = tempo;
+	strcpy(job->prefix, prefix);
+	job->first_seed = first_seed;
+	job->count = count > 0 ? count : 0;
+	job->report = report;
+	job->started = systimer_gettime();
+	systhread_mutex_new(&job->lock, 0);
+	systhread_create((method)render_batch_worker, job, 0, 0, 0, &job->thread);
+	return job;
+}
+
+// Stops the worker after the song it is on and frees the batch
+void render_batch_free(render_batch* job) {
+	unsigned int ret;
+	if (job == NULL) {
+		return;
+	}
+	job->stop = 1;
+	systhread_join(job->thread, &ret);
+	systhread_mutex_free(job->lock);
+	free(job);
+}
+
+int render_batch_finished(render_batch* job) {
+	systhread_mutex_lock(job->lock);
+	int finished = job->finished;
+	systhread_mutex_unlock(job->lock);
+	return finished;
+}
@@ -0,0 +1,303 @@
+/**
+	@file
+	ring - publishes note events into shared memory for other processes on the same machine
+	Caden Kesey
+*/
+
+/*
+Layout of the shared memory, all values little endian:
+
+	offset 0	uint32	magic, RING_MAGIC ("MBXR")
+	offset 4	uint32	version, RING_VERSION
+	offset 8	uint32	capacity, slots in the ring, a power of two
+	offset 12	uint32	slot size in bytes, 32
+	offset 16	uint64	write index, events published so far
+	offset 24	float	beat length in milliseconds at the time of the last event
+	offset 28	...	padding up to 64 bytes
+	offset 64	slots, capacity of them
+
+	Each slot:
+	offset 0	uint64	sequence, index of the event + 1, 0 while it is being written
+	offset 8	uint64	stamp, monotonic clock in nanoseconds when it was published
+	offset 16	float	time, beats from the start of the song
+	offset 20	float	length, beats
+	offset 24	int32	track, TRACK_PIANO to TRACK_KICK
+	offset 28	int32	value, midi note
+
+Event i lives in slot i & (capacity - 1). There is one writer, which never waits: it clears the
+sequence, writes the event, sets the sequence, then bumps the write index. Readers keep their own
+index and may be lapped, in which case ring_read skips them ahead and reports how many were lost.
+A reader checks the sequence before and after reading a slot, so a torn event is never returned.
+
+The ring needs nothing from Max, so reader programs can include this file on its own.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define RING_MAGIC 0x5258424du // "MBXR"
+#define RING_VERSION 1
+#define RING_DEFAULT_SLOTS 4096
+#define RING_HEADER 64
+
+// Loads and stores that are ordered across threads and processes
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RING_LOAD(p) (_ReadWriteBarrier(), *(p))
+#define RING_STORE(p, v) do { _ReadWriteBarrier(); *(p) = (v); _ReadWriteBarrier(); } while (0)
+#define RING_FENCE() MemoryBarrier()
+#else
+#define RING_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define RING_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+// Structs
+
+typedef unsigned int ring_u32;
+typedef unsigned long long ring_u64;
+
+typedef struct ring_header {
+	ring_u32 magic;
+	ring_u32 version;
+	ring_u32 capacity;
+	ring_u32 slot_size;
+	volatile ring_u64 write_index;
+	float beat;
+	char padding[RING_HEADER - 28];
+} ring_header;
+
+typedef struct ring_slot {
+	volatile ring_u64 sequence;
+	ring_u64 stamp;
+	float time;
+	float length;
+	int track;
+	int value;
+} ring_slot;
+
+typedef struct ring {
+	ring_header* header;
+	ring_slot* slots;
+	ring_u64 mask;
+	ring_u64 read_index; // Readers only
+	size_t size;
+	int owner; // Set for the writer, which removes the name when it closes
+	char name[128];
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+} ring;
+
+// Monotonic time in nanoseconds, comparable between processes on the same machine
+ring_u64 ring_now(void) {
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (ring_u64)((double)count.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ring_u64)ts.tv_sec * 1000000000ull + (ring_u64)ts.tv_nsec;
+#endif
+}
+
+// Shared memory
+
+void ring_close(ring* r) {
+	if (r == NULL) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(r->header);
+	CloseHandle(r->mapping);
+#else
+	munmap(r->header, r->size);
+	if (r->owner) {
+		shm_unlink(r->name);
+	}
+#endif
+	free(r);
+}
+
+/*
+Maps the shared memory called name. The writer creates it with capacity slots (rounded up to a
+power of two), readers pass 0 and get whatever the writer made. Returns NULL on failure.
+*/
+ring* ring_map(const char* name, unsigned int capacity) {
+	int create = capacity > 0;
+	unsigned int slots = 1;
+	while (slots < capacity) {
+		slots <<= 1;
+	}
+
+	ring* r = (ring*)malloc(sizeof(ring));
+	memset(r, 0, sizeof(ring));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->owner = create;
+
+#ifdef _WIN32
+	if (create) {
+		r->size = RING_HEADER + sizeof(ring_slot) * slots;
+		r->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)r->size, name);
+	}
+	else {
+		r->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	}
+	if (r->mapping == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->header = (ring_header*)MapViewOfFile(r->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (r->header == NULL) {
+		CloseHandle(r->mapping);
+		free(r);
+		return NULL;
+	}
+#else
+	if (name[0] != '/') { // POSIX names start with a slash
+		snprintf(r->name, sizeof(r->name), "/%s", name);
+	}
+
+	int fd = shm_open(r->name, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+	if (fd < 0) {
+		free(r);
+		return NULL;
+	}
+	if (create) {
+		r->size = RING_HEADER + sizeof(ring_slot) * slots;
+		if (ftruncate(fd, (off_t)r->size) != 0) {
+			close(fd);
+			shm_unlink(r->name);
+			free(r);
+			return NULL;
+		}
+	}
+	else {
+		struct stat st;
+		fstat(fd, &st);
+		r->size = (size_t)st.st_size;
+	}
+	if (r->size < RING_HEADER) {
+		close(fd);
+		free(r);
+		return NULL;
+	}
+	r->header = (ring_header*)mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->header == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+#endif
+
+	r->slots = (ring_slot*)((char*)r->header + RING_HEADER);
+
+	if (create) {
+		memset(r->header, 0, RING_HEADER + sizeof(ring_slot) * slots);
+		r->header->capacity = slots;
+		r->header->slot_size = sizeof(ring_slot);
+		r->header->version = RING_VERSION;
+		RING_STORE(&r->header->magic, RING_MAGIC); // Last, so readers never see a half made header
+	}
+	else if (RING_LOAD(&r->header->magic) != RING_MAGIC || r->header->version != RING_VERSION
+		|| r->header->slot_size != sizeof(ring_slot)) {
+		r->owner = 0;
+		ring_close(r);
+		return NULL;
+	}
+
+	r->mask = r->header->capacity - 1;
+	r->read_index = RING_LOAD(&r->header->write_index); // Readers start with the next event
+	return r;
+}
+
+ring* ring_create(const char* name, unsigned int capacity) {
+	return ring_map(name, capacity > 0 ? capacity : RING_DEFAULT_SLOTS);
+}
+
+ring* ring_open(const char* name) {
+	return ring_map(name, 0);
+}
+
+// Writer
+
+void ring_publish(ring* r, float time, float length, int track, int value, float beat) {
+	ring_u64 index = r->header->write_index; // Only the writer changes it
+	ring_slot* slot = &r->slots[index & r->mask];
+
+	RING_STORE(&slot->sequence, 0);
+	RING_FENCE();
+	slot->stamp = ring_now();
+	slot->time = time;
+	slot->length = length;
+	slot->track = track;
+	slot->value = value;
+	r->header->beat = beat;
+	RING_STORE(&slot->sequence, index + 1);
+	RING_STORE(&r->header->write_index, index + 1);
+}
+
+// Readers
+
+/*
+Returns the next event in place, or NULL if there is nothing new. The pointer is into the shared
+memory, so nothing is copied, but the writer may reuse the slot: read what you need from it, then
+call ring_done, which returns 1 if the event was still intact. lost is set to how many events were
+skipped because the writer lapped this reader.
+*/
+const ring_slot* ring_peek(ring* r, ring_u64* lost) {
+	ring_u64 written = RING_LOAD(&r->header->write_index);
+	*lost = 0;
+	if (written - r->read_index > r->mask + 1) {
+		*lost = written - (r->mask + 1) - r->read_index;
+		r->read_index = written - (r->mask + 1);
+	}
+	if (r->read_index == written) {
+		return NULL;
+	}
+	ring_slot* slot = &r->slots[r->read_index & r->mask];
+	if (RING_LOAD(&slot->sequence) != r->read_index + 1) {
+		return NULL; // Being rewritten, will be skipped once the write index moves on
+	}
+	return slot;
+}
+
+int ring_done(ring* r, const ring_slot* slot) {
+	RING_FENCE();
+	int intact = RING_LOAD(&slot->sequence) == r->read_index + 1;
+	r->read_index++;
+	return intact;
+}
+
+// Copies the next event into out, returns 1 if there was one
+int ring_read(ring* r, ring_slot* out, ring_u64* lost) {
+	ring_u64 skipped = 0;
+	for (;;) {
+		const ring_slot* slot = ring_peek(r, lost);
+		skipped += *lost;
+		if (slot == NULL) {
+			*lost = skipped;
+			return 0;
+		}
+		*out = *slot;
+		if (ring_done(r, slot)) {
+			*lost = skipped;
+			return 1;
+		}
+		skipped++; // Overwritten while it was read
+	}
+}
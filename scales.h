@@ -0,0 +1,139 @@
+/**
+	@file
+	scales - keys and modes as 12 bit pitch class masks, bit 0 is C
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Modes with their root on C
+
+#define MODE_IONIAN 0xAB5 // C D E F G A B
+#define MODE_DORIAN 0x6AD // C D Eb F G A Bb
+#define MODE_PHRYGIAN 0x5AB // C Db Eb F G Ab Bb
+#define MODE_LYDIAN 0xAD5 // C D E F# G A B
+#define MODE_MIXOLYDIAN 0x6B5 // C D E F G A Bb
+#define MODE_AEOLIAN 0x5AD // C D Eb F G Ab Bb
+#define MODE_LOCRIAN 0x56B // C Db Eb F Gb Ab Bb
+#define MODE_HARMONIC_MINOR 0x9AD // C D Eb F G Ab B
+#define MODE_MELODIC_MINOR 0xAAD // C D Eb F G A B
+#define MODE_MAJOR_PENTATONIC 0x295 // C D E G A
+#define MODE_MINOR_PENTATONIC 0x4A9 // C Eb F G Bb
+
+#define MODE_COUNT 11
+
+// Moves a mask up by n semitones, 0 to 11, pitch classes wrap round the octave
+#define SCALE_ROTATE(mask, n) (((((mask) << (n)) | ((mask) >> (12 - (n)))) & 0xFFF))
+
+// A mode starting on root, 0 for C to 11 for B
+#define SCALE_KEY(mode, root) SCALE_ROTATE(mode, root)
+
+// Moves a key by any number of semitones
+#define SCALE_TRANSPOSE(mask, semitones) SCALE_ROTATE(mask, (((semitones) % 12) + 12) % 12)
+
+// Whether a midi note is in a key
+#define SCALE_HAS(mask, value) (((mask) >> ((value) % 12)) & 1)
+
+#define SCALE_HOME SCALE_KEY(MODE_AEOLIAN, 9) // A minor, the key the patterns were written in
+
+const unsigned short scale_modes[MODE_COUNT] = {
+	MODE_IONIAN, MODE_DORIAN, MODE_PHRYGIAN, MODE_LYDIAN, MODE_MIXOLYDIAN, MODE_AEOLIAN,
+	MODE_LOCRIAN, MODE_HARMONIC_MINOR, MODE_MELODIC_MINOR, MODE_MAJOR_PENTATONIC, MODE_MINOR_PENTATONIC
+};
+
+const char* scale_mode_names[MODE_COUNT] = {
+	"ionian", "dorian", "phrygian", "lydian", "mixolydian", "aeolian",
+	"locrian", "harmonic", "melodic", "majorpentatonic", "minorpentatonic"
+};
+
+// Lowest and highest set bit, v must not be 0
+
+#ifdef _MSC_VER
+int scale_ctz(unsigned int v) {
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return (int)i;
+}
+
+int scale_clz(unsigned int v) {
+	unsigned long i;
+	_BitScanReverse(&i, v);
+	return 31 - (int)i;
+}
+
+int scale_popcount(unsigned int v) {
+	return (int)__popcnt(v);
+}
+#else
+#define scale_ctz(v) __builtin_ctz(v)
+#define scale_clz(v) __builtin_clz(v)
+#define scale_popcount(v) __builtin_popcount(v)
+#endif
+
+// Key lookups
+
+/*
+The in key note closest to value, going up on a tie. The key is written out twice so the notes
+above and below can each be found with one bit scan, without wrapping round the octave.
+*/
+int scale_nearest(unsigned short mask, int value) {
+	if (mask == 0 || value < 0) {
+		return value;
+	}
+	int pc = value % 12;
+	unsigned int twice = mask | ((unsigned int)mask << 12);
+	int up = scale_ctz(twice >> pc);
+	int down = scale_clz(twice << (19 - pc)); // Bit pc + 12 moves to the top
+	return up <= down || down > value ? value + up : value - down;
+}
+
+// The note steps places up the key from the first in key note at or above from
+int scale_step(unsigned short mask, int from, int steps) {
+	if (mask == 0) {
+		return from + steps;
+	}
+	unsigned int twice = mask | ((unsigned int)mask << 12);
+	int value = from + scale_ctz(twice >> (from % 12));
+	for (int i = 0; i < steps; i++) {
+		value++;
+		value += scale_ctz(twice >> (value % 12));
+	}
+	return value;
+}
+
+// Pitch classes used by a list of notes
+unsigned short scale_of(int* values, int count) {
+	unsigned short mask = 0;
+	for (int i = 0; i < count; i++) {
+		if (values[i] >= 0) {
+			mask |= 1 << (values[i] % 12);
+		}
+	}
+	return mask;
+}
+
+/*
+The key that holds the most of a set of pitch classes. preferred wins any tie, then the modes
+in the order of scale_modes, so notes that fit several keys keep the home key where they can.
+*/
+unsigned short scale_fit(unsigned short classes, unsigned short preferred) {
+	unsigned short best = preferred;
+	int best_count = scale_popcount(classes & preferred);
+	for (int m = 0; m < MODE_COUNT; m++) {
+		for (int root = 0; root < 12; root++) {
+			unsigned short key = SCALE_KEY(scale_modes[m], root);
+			int count = scale_popcount(classes & key);
+			if (count > best_count) {
+				best = key;
+				best_count = count;
+			}
+		}
+	}
+	return best;
+}
@@ -0,0 +1,189 @@
+/**
+	@file
+	search - looks for seeds whose songs meet a set of constraints, using several threads
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_MAX_THREADS 32 // Most worker threads one search may start
+#define SEARCH_BLOCK 16 // Seeds a worker claims at a time
+
+typedef struct search {
+	constraints limits; // Copied when the search starts so later edits don't race the workers
+	tables* tables; // Shared, the instance that started the search keeps them attached
+	int piano_voices; // Chord width of the songs searched
+
+	unsigned int first_seed;
+	long count; // Seeds to try
+	long next; // Seeds handed out to workers so far
+	long tried;
+	long matches;
+	volatile int stop;
+
+	long thread_count;
+	long running; // Workers still going
+	t_systhread threads[SEARCH_MAX_THREADS];
+	t_systhread_mutex lock;
+
+	unsigned int* found; // Matching seeds waiting to be sent out by the qelem
+	long found_count;
+	long found_size;
+	void* report; // Qelem that streams matches out on the main thread
+} search;
+
+// Track and row names used by the constrain message
+
+const char* track_names[TRACK_COUNT] = { "piano", "bass", "melody", "hat", "ghost", "snare", "kick" };
+const char* row_names[ROW_COUNT] = { "hat", "ghost", "snare", "kick", "verse", "chorus" };
+
+int search_track_index(const char* name) {
+	for (int i = 0; i < TRACK_COUNT; i++) {
+		if (strcmp(track_names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int search_row_index(const char* name) {
+	for (int i = 0; i < ROW_COUNT; i++) {
+		if (strcmp(row_names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void constraints_clear(constraints* c) {
+	memset(c, 0, sizeof(constraints));
+}
+
+// Workers
+
+void search_add_match(search* job, unsigned int seed) {
+	systhread_mutex_lock(job->lock);
+	if (job->found_count == job->found_size) {
+		job->found_size = job->found_size ? job->found_size * 2 : 64;
+		job->found = (unsigned int*)realloc(job->found, sizeof(unsigned int) * job->found_size);
+	}
+	job->found[job->found_count] = seed;
+	job->found_count++;
+	job->matches++;
+	systhread_mutex_unlock(job->lock);
+	qelem_set(job->report);
+}
+
+void* search_worker(search* job) {
+	for (;;) {
+		// Claim the next block of seeds
+		systhread_mutex_lock(job->lock);
+		long start = job->next;
+		long end = start + SEARCH_BLOCK;
+		if (end > job->count) {
+			end = job->count;
+		}
+		job->next = end;
+		systhread_mutex_unlock(job->lock);
+
+		if (start >= end || job->stop) {
+			break;
+		}
+
+		for (long i = start; i < end && !job->stop; i++) {
+			unsigned int seed = job->first_seed + (unsigned int)i;
+			song* s = song_new(job->tables);
+			s->rng = seed;
+			s->limits = &job->limits;
+			s->piano_voices = job->piano_voices;
+			if (musicbox_generate(s)) {
+				search_add_match(job, seed);
+			}
+			song_free(s);
+		}
+
+		systhread_mutex_lock(job->lock);
+		job->tried += end - start;
+		systhread_mutex_unlock(job->lock);
+	}
+
+	systhread_mutex_lock(job->lock);
+	job->running--;
+	systhread_mutex_unlock(job->lock);
+	qelem_set(job->report); // Lets the main thread see that this worker finished
+
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+// Search lifetime
+
+search* search_start(constraints* limits, tables* shared, int piano_voices, unsigned int first_seed, long count, long thread_count, void* report) {
+	search* job = (search*)malloc(sizeof(search));
+	job->limits = *limits;
+	job->tables = shared;
+	job->piano_voices = piano_voices;
+	job->first_seed = first_seed;
+	job->count = count;
+	job->next = 0;
+	job->tried = 0;
+	job->matches = 0;
+	job->stop = 0;
+	job->found = NULL;
+	job->found_count = 0;
+	job->found_size = 0;
+	job->report = report;
+
+	if (thread_count < 1) {
+		thread_count = 1;
+	}
+	if (thread_count > SEARCH_MAX_THREADS) {
+		thread_count = SEARCH_MAX_THREADS;
+	}
+	job->thread_count = thread_count;
+	job->running = thread_count;
+
+	systhread_mutex_new(&job->lock, 0);
+	for (long i = 0; i < thread_count; i++) {
+		systhread_create((method)search_worker, job, 0, 0, 0, &job->threads[i]);
+	}
+	return job;
+}
+
+/*
+Moves any seeds found since the last call into seeds, returns how many were moved.
+Called from the main thread by the report qelem.
+*/
+long search_take_matches(search* job, unsigned int* seeds, long max) {
+	systhread_mutex_lock(job->lock);
+	long n = job->found_count < max ? job->found_count : max;
+	memcpy(seeds, job->found, sizeof(unsigned int) * n);
+	memmove(job->found, job->found + n, sizeof(unsigned int) * (job->found_count - n));
+	job->found_count -= n;
+	systhread_mutex_unlock(job->lock);
+	return n;
+}
+
+int search_finished(search* job) {
+	systhread_mutex_lock(job->lock);
+	int finished = job->running == 0 && job->found_count == 0;
+	systhread_mutex_unlock(job->lock);
+	return finished;
+}
+
+void search_free(search* job) {
+	unsigned int ret;
+	if (job == NULL) {
+		return;
+	}
+	job->stop = 1;
+	for (long i = 0; i < job->thread_count; i++) {
+		systhread_join(job->threads[i], &ret);
+	}
+	systhread_mutex_free(job->lock);
+	free(job->found);
+	free(job);
+}
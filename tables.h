@@ -0,0 +1,543 @@
+/**
+	@file
+	tables - note names, drum patterns, chords and the melody model, loaded once and shared by every instance
+	Caden Kesey
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Drum pattern files
+
+enum {
+	PATTERN_HAT,
+	PATTERN_HAT2,
+	PATTERN_GHOST,
+	PATTERN_SNARE,
+	PATTERN_KICK,
+	PATTERN_COUNT
+};
+
+const char* pattern_filenames[PATTERN_COUNT] = {
+	"D:/music_algorithm/patterns/hat.txt",
+	"D:/music_algorithm/patterns/hat2.txt",
+	"D:/music_algorithm/patterns/ghost.txt",
+	"D:/music_algorithm/patterns/snare.txt",
+	"D:/music_algorithm/patterns/kick.txt"
+};
+
+// Trace span names for loading each file
+const char* pattern_spans[PATTERN_COUNT] = {
+	"pattern_load hat",
+	"pattern_load hat2",
+	"pattern_load ghost",
+	"pattern_load snare",
+	"pattern_load kick"
+};
+
+// Structs
+
+// A word of a pattern line, either a note name or the length of the note before it
+typedef struct pattern_token {
+	int value; // Midi note, -1 for a rest, 0 if the word is a length
+	float length;
+} pattern_token;
+
+typedef struct pattern_file {
+	int lines; // Newlines + 1, what number_of_lines counts
+	int row_count; // Lines with anything on them, a final line without a newline included
+	int* row_start; // First token of each row, row_count + 1 of them
+	pattern_token* tokens;
+	int token_count;
+} pattern_file;
+
+/*
+Everything here is read only once it is loaded, so any number of instances and search or render
+threads can use it at once. references counts the instances attached.
+*/
+typedef struct tables {
+	long references;
+	ht_t* hash_note_names; // Hashtable for getting Midi note values
+	chord_library* verse_chords;
+	chord_library* chorus_chords;
+	markov_model* melody_model; // NULL if there is no model file
+	pattern_file* patterns[PATTERN_COUNT];
+} tables;
+
+tables* tables_shared = NULL; // The one set of tables every instance attaches to
+
+// Pattern files
+
+#define PATTERN_THREADS 4 // Threads that parse one large pattern file
+#define PATTERN_MAX_THREADS 32 // Most threads pattern_load_threads will start
+#define PATTERN_PARALLEL_BYTES 65536 // Files smaller than this are parsed on the calling thread
+#define PATTERN_WORD 64 // Longest word read with strtof, longer ones can't be note names anyway
+
+// A file mapped read only into memory
+typedef struct pattern_text {
+	const char* text;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+} pattern_text;
+
+// Rows one thread turns into tokens
+typedef struct pattern_job {
+	const char* text;
+	size_t* line_start; // Offset of every line, and one past the end of the last
+	int first_row;
+	int last_row;
+	ht_t* hash_note_names; // NULL reads words with pattern_word, else they are looked up as before
+	pattern_token* tokens;
+	int token_count;
+	int token_size;
+	int* row_start; // First token of each of the job's rows, relative to tokens
+	t_systhread thread;
+} pattern_job;
+
+int pattern_map(const char* filename, pattern_text* t) {
+	t->text = NULL;
+	t->size = 0;
+#ifdef _WIN32
+	t->mapping = NULL;
+	t->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (t->file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(t->file, &size);
+	t->size = (size_t)size.QuadPart;
+	if (t->size == 0) {
+		return 1; // Nothing to map, an empty file has no rows
+	}
+	t->mapping = CreateFileMappingA(t->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (t->mapping != NULL) {
+		t->text = (const char*)MapViewOfFile(t->mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	if (t->text == NULL) {
+		if (t->mapping != NULL) {
+			CloseHandle(t->mapping);
+		}
+		CloseHandle(t->file);
+		return 0;
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	t->size = (size_t)st.st_size;
+	if (t->size > 0) {
+		void* text = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text == MAP_FAILED) {
+			close(fd);
+			return 0;
+		}
+		t->text = (const char*)text;
+	}
+	close(fd);
+#endif
+	return 1;
+}
+
+void pattern_unmap(pattern_text* t) {
+#ifdef _WIN32
+	if (t->text != NULL) {
+		UnmapViewOfFile(t->text);
+		CloseHandle(t->mapping);
+	}
+	CloseHandle(t->file);
+#else
+	if (t->text != NULL) {
+		munmap((void*)t->text, t->size);
+	}
+#endif
+}
+
+// Start of every line, found with memchr so the scan runs at memory speed. Returns the row count.
+int pattern_lines(const char* text, size_t size, size_t** line_start) {
+	int size_rows = 64;
+	int rows = 0;
+	size_t* starts = (size_t*)malloc(sizeof(size_t) * size_rows);
+	size_t offset = 0;
+
+	while (offset < size) {
+		if (rows + 2 > size_rows) {
+			size_rows *= 2;
+			starts = (size_t*)realloc(starts, sizeof(size_t) * size_rows);
+		}
+		starts[rows++] = offset;
+		const char* newline = (const char*)memchr(text + offset, '\n', size - offset);
+		offset = newline != NULL ? (size_t)(newline - text) + 1 : size;
+	}
+	starts[rows] = size;
+	*line_start = starts;
+	return rows;
+}
+
+#define PATTERN_LOWEST 21 // A0, the first of note_names
+#define PATTERN_HIGHEST 92 // Gs6, the last
+#define PATTERN_DIGITS 7 // Longest length read directly, every one of these reads exactly as strtof does
+
+const int pattern_semitones[7] = {9, 11, 0, 2, 4, 5, 7}; // A to G, from C
+const double pattern_tens[PATTERN_DIGITS + 1] = {1, 10, 100, 1e3, 1e4, 1e5, 1e6, 1e7};
+
+// Reads a word the way the patterns used to be read: looked up as a note name, or as a length with strtof
+void pattern_lookup(ht_t* hash_note_names, const char* word, size_t length, pattern_token* t) {
+	char buffer[PATTERN_WORD];
+	if (length >= PATTERN_WORD) {
+		length = PATTERN_WORD - 1;
+	}
+	memcpy(buffer, word, length);
+	buffer[length] = 0;
+	t->value = ht_get(hash_note_names, buffer);
+	t->length = t->value == 0 ? strtof(buffer, NULL) : 0;
+}
+
+/*
+Reads a word in place, telling what it is from its first letter. Note names are a letter, s for
+a sharp and the octave, so the Midi note is worked out from them; lengths of digits and at most
+one point are read as a whole number over a power of ten. Words that are neither, which the
+files only hold by mistake, are copied out and read with strtof so they still read as before.
+*/
+void pattern_word(const char* word, size_t length, pattern_token* t) {
+	t->value = 0;
+	t->length = 0;
+	if (length == 0) {
+		return;
+	}
+	char first = word[0];
+	if (first >= 'A' && first <= 'G') {
+		int note = pattern_semitones[first - 'A'];
+		size_t i = 1;
+		if (i < length && word[i] == 's' && first != 'B' && first != 'E') {
+			note++;
+			i++;
+		}
+		if (i + 1 == length && word[i] >= '0' && word[i] <= '9') {
+			note += (word[i] - '0' + 1) * 12;
+			if (note >= PATTERN_LOWEST && note <= PATTERN_HIGHEST) {
+				t->value = note;
+				return;
+			}
+		}
+	}
+	else if (first == 'r') {
+		if (length == 4 && memcmp(word, "rest", 4) == 0) {
+			t->value = -1;
+			return;
+		}
+	}
+	else if ((first >= '0' && first <= '9') || first == '.') {
+		unsigned int whole = 0;
+		int digits = 0;
+		int places = -1; // Digits after the point, -1 before it
+		size_t i = 0;
+		for (; i < length && digits <= PATTERN_DIGITS; i++) {
+			if (word[i] >= '0' && word[i] <= '9') {
+				whole = whole * 10 + (word[i] - '0');
+				digits++;
+				places += places >= 0;
+			}
+			else if (word[i] == '.' && places < 0) {
+				places = 0;
+			}
+			else {
+				break;
+			}
+		}
+		if (i == length && digits > 0 && digits <= PATTERN_DIGITS) {
+			t->length = places > 0 ? (float)(whole / pattern_tens[places]) : (float)whole;
+			return;
+		}
+	}
+
+	// Not a note or a plain length, only ever a length as far as strtof reads one
+	char buffer[PATTERN_WORD];
+	if (length >= PATTERN_WORD) {
+		length = PATTERN_WORD - 1;
+	}
+	memcpy(buffer, word, length);
+	buffer[length] = 0;
+	t->length = strtof(buffer, NULL);
+}
+
+void pattern_add(pattern_job* job, const char* word, size_t length) {
+	if (job->token_count == job->token_size) {
+		job->token_size *= 2;
+		job->tokens = (pattern_token*)realloc(job->tokens, sizeof(pattern_token) * job->token_size);
+	}
+	pattern_token* t = &job->tokens[job->token_count++];
+	if (job->hash_note_names != NULL) {
+		pattern_lookup(job->hash_note_names, word, length, t);
+	}
+	else {
+		pattern_word(word, length, t);
+	}
+}
+
+/*
+Splits the job's rows into words at spaces and reads each one in place as a note name or the
+length of the note before it. A row that ends in a space before its newline, or is empty, ends in an
+empty word (a length of 0), the way the patterns were always read. \r\n counts as a newline.
+*/
+void* pattern_parse(pattern_job* job) {
+	TRACE_BEGIN(span);
+	job->token_size = 256;
+	job->token_count = 0;
+	job->tokens = (pattern_token*)malloc(sizeof(pattern_token) * job->token_size);
+	job->row_start = (int*)malloc(sizeof(int) * (job->last_row - job->first_row + 1));
+
+	for (int r = job->first_row; r < job->last_row; r++) {
+		const char* c = job->text + job->line_start[r];
+		const char* end = job->text + job->line_start[r + 1];
+		int newline = end > c && end[-1] == '\n';
+		if (newline) {
+			end--;
+			if (end > c && end[-1] == '\r') {
+				end--;
+			}
+		}
+		job->row_start[r - job->first_row] = job->token_count;
+
+		while (c < end) {
+			while (c < end && *c == ' ') {
+				c++;
+			}
+			const char* word = c;
+			while (c < end && *c != ' ') {
+				c++;
+			}
+			if (c > word) {
+				pattern_add(job, word, c - word);
+			}
+		}
+		if (newline && (end == job->text + job->line_start[r] || end[-1] == ' ')) {
+			pattern_add(job, end, 0);
+		}
+	}
+	job->row_start[job->last_row - job->first_row] = job->token_count;
+	TRACE_END(span, "pattern_parse"); // One for each thread's rows
+	return NULL;
+}
+
+void* pattern_parse_thread(pattern_job* job) {
+	pattern_parse(job);
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+/*
+Maps the file and indexes its lines, then splits the rows between up to threads threads, each
+parsing its share into its own tokens, which are joined in order at the end. hash_note_names is
+NULL to read words directly, or the note names to look them up the old way for comparison.
+Returns NULL if the file can't be opened.
+*/
+pattern_file* pattern_load_threads(const char* filename, ht_t* hash_note_names, int threads) {
+	pattern_text text;
+	if (!pattern_map(filename, &text)) {
+		post("Could not open file %s", filename);
+		return NULL;
+	}
+
+	size_t* line_start;
+	int rows = pattern_lines(text.text, text.size, &line_start);
+
+	if (threads < 1 || text.size < PATTERN_PARALLEL_BYTES) {
+		threads = 1;
+	}
+	if (threads > rows) {
+		threads = rows > 0 ? rows : 1;
+	}
+
+	pattern_job jobs[PATTERN_MAX_THREADS];
+	if (threads > PATTERN_MAX_THREADS) {
+		threads = PATTERN_MAX_THREADS;
+	}
+	for (int i = 0; i < threads; i++) {
+		jobs[i].text = text.text;
+		jobs[i].line_start = line_start;
+		jobs[i].first_row = (int)((long long)rows * i / threads);
+		jobs[i].last_row = (int)((long long)rows * (i + 1) / threads);
+		jobs[i].hash_note_names = hash_note_names;
+	}
+	if (threads == 1) {
+		pattern_parse(&jobs[0]);
+	}
+	else {
+		unsigned int ret;
+		for (int i = 0; i < threads; i++) {
+			systhread_create((method)pattern_parse_thread, &jobs[i], 0, 0, 0, &jobs[i].thread);
+		}
+		for (int i = 0; i < threads; i++) {
+			systhread_join(jobs[i].thread, &ret);
+		}
+	}
+
+	// Join the jobs' tokens in row order
+	pattern_file* f = (pattern_file*)malloc(sizeof(pattern_file));
+	f->row_count = rows;
+	f->lines = 1;
+	f->token_count = 0;
+	for (int i = 0; i < threads; i++) {
+		f->token_count += jobs[i].token_count;
+	}
+	f->tokens = (pattern_token*)malloc(sizeof(pattern_token) * (f->token_count + 1));
+	f->row_start = (int*)malloc(sizeof(int) * (rows + 1));
+
+	int base = 0;
+	for (int i = 0; i < threads; i++) {
+		pattern_job* job = &jobs[i];
+		memcpy(f->tokens + base, job->tokens, sizeof(pattern_token) * job->token_count);
+		for (int r = job->first_row; r < job->last_row; r++) {
+			f->row_start[r] = base + job->row_start[r - job->first_row];
+		}
+		base += job->token_count;
+		free(job->tokens);
+		free(job->row_start);
+	}
+	f->row_start[rows] = base;
+
+	// Newlines + 1, what number_of_lines used to count
+	for (int r = 0; r < rows; r++) {
+		if (text.text[line_start[r + 1] - 1] == '\n') {
+			f->lines++;
+		}
+	}
+
+	free(line_start);
+	pattern_unmap(&text);
+	return f;
+}
+
+pattern_file* pattern_load(const char* filename) {
+	return pattern_load_threads(filename, NULL, PATTERN_THREADS);
+}
+
+void pattern_free(pattern_file* f) {
+	if (f == NULL) {
+		return;
+	}
+	free(f->row_start);
+	free(f->tokens);
+	free(f);
+}
+
+// Lifetime
+
+tables* tables_load(void) {
+	TRACE_BEGIN(span);
+	tables* t = (tables*)malloc(sizeof(tables));
+	t->references = 1;
+
+	// Create hashtable for midi note values
+
+	t->hash_note_names = ht_create();
+
+	for (int i = 0; note_names[i]; ++i) {
+		ht_set(t->hash_note_names, note_names[i], i + 21);
+	}
+	ht_set(t->hash_note_names, "rest", -1);
+
+	// Load chord progressions
+
+	TRACE_BEGIN(verse);
+	t->verse_chords = chords_load("D:/music_algorithm/patterns/chords.txt");
+	TRACE_END(verse, "chords_load verse");
+	TRACE_BEGIN(chorus);
+	t->chorus_chords = chords_load("D:/music_algorithm/patterns/chords2.txt");
+	TRACE_END(chorus, "chords_load chorus");
+
+	// Load melody model
+
+	TRACE_BEGIN(melody);
+	t->melody_model = markov_load("D:/music_algorithm/patterns/melody.txt");
+	TRACE_END(melody, "markov_load");
+
+	// Load drum patterns
+
+	for (int i = 0; i < PATTERN_COUNT; i++) {
+		TRACE_BEGIN(load);
+		t->patterns[i] = pattern_load(pattern_filenames[i]);
+		TRACE_END(load, pattern_spans[i]);
+	}
+	TRACE_END(span, "tables_load");
+	return t;
+}
+
+void tables_free(tables* t) {
+	ht_free(t->hash_note_names);
+	chords_free(t->verse_chords);
+	chords_free(t->chorus_chords);
+	markov_free(t->melody_model);
+	for (int i = 0; i < PATTERN_COUNT; i++) {
+		pattern_free(t->patterns[i]);
+	}
+	free(t);
+}
+
+/*
+Returns the shared tables, loading them if this is the first instance. Loading happens outside
+the critical region so the scheduler isn't held up by file reads; if two instances race, the
+loser frees its copy and attaches to the winner's.
+*/
+tables* tables_attach(void) {
+	critical_enter(0);
+	tables* t = tables_shared;
+	if (t != NULL) {
+		t->references++;
+	}
+	critical_exit(0);
+	if (t != NULL) {
+		return t;
+	}
+
+	tables* loaded = tables_load();
+	critical_enter(0);
+	t = tables_shared;
+	if (t != NULL) {
+		t->references++;
+	}
+	else {
+		tables_shared = loaded;
+		t = loaded;
+		loaded = NULL;
+	}
+	critical_exit(0);
+	if (loaded != NULL) {
+		tables_free(loaded);
+	}
+	return t;
+}
+
+// Frees the tables when the last instance lets go of them
+void tables_detach(tables* t) {
+	int last = 0;
+	if (t == NULL) {
+		return;
+	}
+	critical_enter(0);
+	if (--t->references == 0) {
+		tables_shared = NULL;
+		last = 1;
+	}
+	critical_exit(0);
+	if (last) {
+		tables_free(t);
+	}
+}
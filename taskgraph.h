@@ -0,0 +1,173 @@
+/**
+	@file
+	taskgraph - runs a small graph of dependent tasks on a pool of threads
+	Caden Kesey
+*/
+
+/*
+A graph is an array of tasks, each with the bits of the tasks that have to finish before it can
+start. taskgraph_run hands tasks to the pool's threads as soon as their inputs are done, runs
+tasks on the calling thread too while it waits, and returns once every task has finished. Once a
+task fails no more are started, the ones running finish and the rest count as failed.
+
+Without a pool, or while another thread has the pool running a graph, the tasks run one after
+another on the calling thread in array order, so the array has to be in an order the graph
+allows. Either way a task sees everything its inputs wrote.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TASKGRAPH_MAX_TASKS 32
+#define TASKGRAPH_MAX_THREADS 8
+
+typedef int (*task_method)(void* arg); // Returns 0 on failure
+
+typedef struct task {
+	task_method fn;
+	void* arg;
+	unsigned int after; // Bits of the tasks that have to finish first
+} task;
+
+typedef struct taskgraph_pool {
+	t_systhread threads[TASKGRAPH_MAX_THREADS];
+	int thread_count;
+	volatile int stop;
+	t_systhread_mutex busy; // Held while a graph runs, so only one graph has the pool at a time
+	t_systhread_mutex lock; // Guards the graph below
+	t_systhread_cond changed; // Signalled when a graph starts or a task finishes
+
+	// The graph running, tasks is NULL when idle
+
+	task* tasks;
+	int count;
+	unsigned int started;
+	unsigned int done;
+	unsigned int failed;
+} taskgraph_pool;
+
+// Graph
+
+// Next task that can start, -1 if none can yet. Called with the lock held.
+int taskgraph_next(taskgraph_pool* p) {
+	for (int i = 0; i < p->count; i++) {
+		unsigned int bit = 1u << i;
+		if (p->started & bit) {
+			continue;
+		}
+		if (p->failed) { // Given up, what hasn't started never will
+			p->started |= bit;
+			p->done |= bit;
+			p->failed |= bit;
+			continue;
+		}
+		if (p->tasks[i].after & ~p->done) {
+			continue;
+		}
+		p->started |= bit;
+		return i;
+	}
+	return -1;
+}
+
+// Runs task i with the lock released. Called with the lock held.
+void taskgraph_work(taskgraph_pool* p, int i) {
+	task* t = &p->tasks[i];
+	systhread_mutex_unlock(p->lock);
+	int ok = t->fn(t->arg);
+	systhread_mutex_lock(p->lock);
+	p->done |= 1u << i;
+	if (!ok) {
+		p->failed |= 1u << i;
+	}
+	systhread_cond_broadcast(p->changed);
+}
+
+void* taskgraph_worker(taskgraph_pool* p) {
+	systhread_mutex_lock(p->lock);
+	while (!p->stop) {
+		int i = p->tasks != NULL ? taskgraph_next(p) : -1;
+		if (i < 0) {
+			systhread_cond_wait(p->changed, p->lock);
+			continue;
+		}
+		taskgraph_work(p, i);
+	}
+	systhread_mutex_unlock(p->lock);
+
+	TRACE_THREAD_DONE();
+	systhread_exit(0);
+	return NULL;
+}
+
+// Pool lifetime
+
+// threads is how many threads help the caller, 1 to TASKGRAPH_MAX_THREADS
+taskgraph_pool* taskgraph_new(int threads) {
+	taskgraph_pool* p = (taskgraph_pool*)malloc(sizeof(taskgraph_pool));
+	memset(p, 0, sizeof(taskgraph_pool));
+	p->thread_count = threads < 1 ? 1 : threads > TASKGRAPH_MAX_THREADS ? TASKGRAPH_MAX_THREADS : threads;
+	systhread_mutex_new(&p->busy, 0);
+	systhread_mutex_new(&p->lock, 0);
+	systhread_cond_new(&p->changed, 0);
+	for (int i = 0; i < p->thread_count; i++) {
+		systhread_create((method)taskgraph_worker, p, 0, 0, 0, &p->threads[i]);
+	}
+	return p;
+}
+
+void taskgraph_free(taskgraph_pool* p) {
+	unsigned int ret;
+	if (p == NULL) {
+		return;
+	}
+	systhread_mutex_lock(p->lock);
+	p->stop = 1;
+	systhread_cond_broadcast(p->changed);
+	systhread_mutex_unlock(p->lock);
+	for (int i = 0; i < p->thread_count; i++) {
+		systhread_join(p->threads[i], &ret);
+	}
+	systhread_cond_free(p->changed);
+	systhread_mutex_free(p->lock);
+	systhread_mutex_free(p->busy);
+	free(p);
+}
+
+// Running
+
+// Runs every task, returns 1 if none failed
+int taskgraph_run(taskgraph_pool* p, task* tasks, int count) {
+	unsigned int all = count >= TASKGRAPH_MAX_TASKS ? 0xffffffffu : (1u << count) - 1;
+
+	if (p == NULL || systhread_mutex_trylock(p->busy) != 0) { // In order on this thread
+		for (int i = 0; i < count; i++) {
+			if (!tasks[i].fn(tasks[i].arg)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	systhread_mutex_lock(p->lock);
+	p->tasks = tasks;
+	p->count = count;
+	p->started = 0;
+	p->done = 0;
+	p->failed = 0;
+	systhread_cond_broadcast(p->changed);
+	while (p->done != all) {
+		int i = taskgraph_next(p);
+		if (i < 0) {
+			systhread_cond_wait(p->changed, p->lock);
+			continue;
+		}
+		taskgraph_work(p, i);
+	}
+	int ok = p->failed == 0;
+	p->tasks = NULL;
+	systhread_mutex_unlock(p->lock);
+	systhread_mutex_unlock(p->busy);
+	return ok;
+}
@@ -0,0 +1,111 @@
+/**
+	@file
+	tempo - converts positions in beats to scheduler time through constant tempos and ramps
+	Caden Kesey
+*/
+
+#include <math.h>
+
+#define TEMPO_MIN 1.0 // Slowest tempo in beats per minute, keeps every beat a finite length
+
+/*
+The map only holds the segment in effect now: a ramp that starts at a beat and time, and a
+constant tempo after it. A constant tempo is a ramp of 0 beats. A tempo change starts a new
+segment where the song is at that moment, so it costs the same however long the song has run.
+*/
+typedef struct tempo_map {
+	double start_ms; // Scheduler time the segment starts at
+	double start_beat; // Song position the segment starts at
+	double from; // Tempo at the start of the ramp
+	double to; // Tempo at the end of the ramp and after it
+	double ramp; // Beats the ramp lasts
+} tempo_map;
+
+double tempo_clamp(double bpm) {
+	return bpm > TEMPO_MIN ? bpm : TEMPO_MIN;
+}
+
+// Starts the song at beat 0 at the scheduler time now
+void tempo_start(tempo_map* m, double now, double bpm) {
+	m->start_ms = now;
+	m->start_beat = 0;
+	m->from = tempo_clamp(bpm);
+	m->to = m->from;
+	m->ramp = 0;
+}
+
+// Change in tempo per beat during the ramp
+double tempo_slope(tempo_map* m) {
+	return m->ramp > 0 ? (m->to - m->from) / m->ramp : 0;
+}
+
+// Tempo at a song position
+double tempo_at(tempo_map* m, double beat) {
+	double d = beat - m->start_beat;
+	if (d <= 0) {
+		return m->from;
+	}
+	if (d >= m->ramp) {
+		return m->to;
+	}
+	return m->from + tempo_slope(m) * d;
+}
+
+// Milliseconds from the start of the segment to d beats into the ramp, d no more than the ramp
+double tempo_ramp_ms(tempo_map* m, double d) {
+	double k = tempo_slope(m);
+	if (fabs(k) < 1e-9) {
+		return d * 60000.0 / m->from;
+	}
+	return 60000.0 / k * log((m->from + k * d) / m->from); // Integral of 60000 / (from + k b) db
+}
+
+// Scheduler time of a song position
+double tempo_ms(tempo_map* m, double beat) {
+	double d = beat - m->start_beat;
+	if (d <= 0) {
+		return m->start_ms + d * 60000.0 / m->from;
+	}
+	if (d <= m->ramp) {
+		return m->start_ms + tempo_ramp_ms(m, d);
+	}
+	return m->start_ms + tempo_ramp_ms(m, m->ramp) + (d - m->ramp) * 60000.0 / m->to;
+}
+
+// Song position at a scheduler time
+double tempo_beat(tempo_map* m, double ms) {
+	double e = ms - m->start_ms;
+	if (e <= 0) {
+		return m->start_beat + e * m->from / 60000.0;
+	}
+	double ramp_ms = tempo_ramp_ms(m, m->ramp);
+	if (e <= ramp_ms) {
+		double k = tempo_slope(m);
+		if (fabs(k) < 1e-9) {
+			return m->start_beat + e * m->from / 60000.0;
+		}
+		return m->start_beat + m->from * (exp(k * e / 60000.0) - 1.0) / k;
+	}
+	return m->start_beat + m->ramp + (e - ramp_ms) * m->to / 60000.0;
+}
+
+// Milliseconds a note of length beats starting at beat lasts
+double tempo_length(tempo_map* m, double beat, double length) {
+	return tempo_ms(m, beat + length) - tempo_ms(m, beat);
+}
+
+/*
+Moves to bpm from the scheduler time now, straight away if beats is 0 or ramping over that
+many beats otherwise. Positions already played keep the times they had.
+*/
+void tempo_change(tempo_map* m, double now, double bpm, double beats) {
+	double beat = tempo_beat(m, now);
+	m->from = tempo_at(m, beat);
+	m->start_ms = now;
+	m->start_beat = beat;
+	m->to = tempo_clamp(bpm);
+	m->ramp = beats > 0 ? beats : 0;
+	if (m->ramp == 0) {
+		m->from = m->to;
+	}
+}
@@ -0,0 +1,123 @@
+/**
+	@file
+	ext - stand-in for the Max SDK header, declares the parts of the Max API that musicbox uses
+	Caden Kesey
+*/
+
+/*
+Only for building musicbox against maxsim.c on machines without Max. Types keep the Max names
+and layouts that musicbox reads, everything else about them is maxsim's own.
+*/
+
+#ifndef MAXSIM_EXT_H
+#define MAXSIM_EXT_H
+
+#include <stddef.h>
+
+// Types
+
+typedef long t_atom_long;
+typedef double t_atom_float;
+typedef long t_max_err;
+
+typedef void* (*method)();
+
+typedef struct symbol {
+	char* s_name;
+	struct symbol* s_next; // maxsim's symbol table
+} t_symbol;
+
+typedef struct _class t_class;
+
+// Every object starts with one, clocks and qelems too so object_free can tell them apart
+typedef struct object {
+	t_class* o_class;
+} t_object;
+
+enum {
+	A_NOTHING = 0,
+	A_LONG,
+	A_FLOAT,
+	A_SYM,
+	A_OBJ,
+	A_DEFLONG,
+	A_DEFFLOAT,
+	A_DEFSYM,
+	A_GIMME,
+	A_CANT
+};
+
+typedef struct atom {
+	short a_type;
+	union {
+		t_atom_long w_long;
+		t_atom_float w_float;
+		t_symbol* w_sym;
+		t_object* w_obj;
+	} a_w;
+} t_atom;
+
+#define MAX_ERR_NONE 0
+#define MAX_ERR_GENERIC -1
+
+#define ASSIST_INLET 1
+#define ASSIST_OUTLET 2
+
+#define CLASS_BOX gensym("box")
+
+// Console
+
+void post(const char* fmt, ...);
+
+// Classes and objects
+
+t_class* class_new(const char* name, method mnew, method mfree, long size, method mmenu, short type, ...);
+t_max_err class_addmethod(t_class* c, method m, const char* name, ...);
+t_max_err class_register(t_symbol* name_space, t_class* c);
+void* object_alloc(t_class* c);
+void* object_new(t_symbol* name_space, t_symbol* classname, ...);
+t_max_err object_free(void* x);
+
+// Inlets and outlets
+
+void* intin(void* x, short n);
+void* floatin(void* x, short n);
+void* outlet_new(void* x, const char* s);
+void* intout(void* x);
+void* floatout(void* x);
+void* listout(void* x);
+void* outlet_int(void* o, t_atom_long n);
+void* outlet_float(void* o, double f);
+void* outlet_list(void* o, t_symbol* s, short ac, t_atom* av);
+
+// Atoms and symbols
+
+t_symbol* gensym(const char* s);
+long atom_gettype(const t_atom* a);
+t_atom_long atom_getlong(const t_atom* a);
+t_atom_float atom_getfloat(const t_atom* a);
+t_symbol* atom_getsym(const t_atom* a);
+t_max_err atom_setlong(t_atom* a, t_atom_long b);
+t_max_err atom_setfloat(t_atom* a, double b);
+t_max_err atom_setsym(t_atom* a, t_symbol* b);
+
+// Scheduler, in virtual milliseconds
+
+void* clock_new(void* obj, method fn);
+void clock_delay(void* c, long time);
+void clock_fdelay(void* c, double time);
+void clock_unset(void* c);
+void clock_getftime(double* time);
+
+void* qelem_new(void* obj, method fn);
+void qelem_set(void* q);
+void qelem_unset(void* q);
+void qelem_free(void* q);
+
+void critical_enter(void* region);
+void critical_exit(void* region);
+
+// Wall clock milliseconds, for timing real work
+double systimer_gettime(void);
+
+#endif
@@ -0,0 +1,7 @@
+/**
+	@file
+	ext_obex - stand-in for the Max SDK header, everything musicbox needs is in ext.h
+	Caden Kesey
+*/
+
+#include "ext.h"
@@ -0,0 +1,875 @@
+/**
+	@file
+	maxsim - the Max API from ext.h for running externals as ordinary programs, see maxsim.h
+	Caden Kesey
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ext.h"
+#include "ext_systhread.h"
+#include "maxsim.h"
+
+#define MAXSIM_SYMBOL_BUCKETS 256
+#define MAXSIM_METHODS 64 // Most messages one class can have
+#define MAXSIM_ARGS 4 // Most typed arguments one message can have
+
+// Structs
+
+typedef struct maxsim_method {
+	const char* name;
+	method fn;
+	short types[MAXSIM_ARGS];
+	int arg_count;
+} maxsim_method;
+
+struct _class {
+	char* name;
+	method mnew;
+	method mfree;
+	long size;
+	maxsim_method methods[MAXSIM_METHODS];
+	int method_count;
+	struct _class* next; // Registered classes
+};
+
+// Each object made by object_alloc, so outlets can be numbered and freed with it
+typedef struct maxsim_box {
+	t_object* object;
+	int id; // Order the object was made in
+	int outlets;
+	struct maxsim_outlet* outlet_list;
+	struct maxsim_box* next;
+} maxsim_box;
+
+typedef struct maxsim_outlet {
+	maxsim_box* box;
+	int index; // Order the outlet was made in, Max puts the first on the right
+	struct maxsim_outlet* next;
+} maxsim_outlet;
+
+typedef struct maxsim_clock {
+	t_object ob;
+	void* owner;
+	method fn;
+	unsigned long generation; // Changes whenever the clock is set or unset, so old heap entries are skipped
+} maxsim_clock;
+
+// A clock waiting to fire
+typedef struct maxsim_due {
+	double when;
+	unsigned long order; // Breaks ties so clocks due together fire in the order they were set
+	unsigned long generation;
+	maxsim_clock* clock;
+} maxsim_due;
+
+typedef struct maxsim_qelem {
+	t_object ob;
+	void* owner;
+	method fn;
+	int set;
+	int queued;
+	struct maxsim_qelem* next; // Queue of set qelems
+} maxsim_qelem;
+
+// State
+
+t_symbol* maxsim_symbols[MAXSIM_SYMBOL_BUCKETS];
+t_class* maxsim_classes = NULL;
+maxsim_box* maxsim_boxes = NULL;
+int maxsim_box_count = 0;
+
+t_class maxsim_clock_class; // Marks clocks and qelems for object_free
+t_class maxsim_qelem_class;
+
+double maxsim_time = 0;
+unsigned long maxsim_order = 0;
+maxsim_due* maxsim_heap = NULL;
+long maxsim_heap_count = 0;
+long maxsim_heap_size = 0;
+
+maxsim_qelem* maxsim_queue = NULL;
+maxsim_qelem* maxsim_queue_last = NULL;
+pthread_mutex_t maxsim_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t maxsim_critical;
+
+int maxsim_recording = 0;
+maxsim_event* maxsim_log = NULL;
+long maxsim_log_count = 0;
+long maxsim_log_size = 0;
+t_atom* maxsim_log_atoms = NULL;
+long maxsim_log_atom_count = 0;
+long maxsim_log_atom_size = 0;
+
+char maxsim_posted[1024]; // Last line posted
+pthread_mutex_t maxsim_post_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Setup
+
+void maxsim_init(void) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); // Max's critical regions nest
+	pthread_mutex_init(&maxsim_critical, &attr);
+	pthread_mutexattr_destroy(&attr);
+	maxsim_time = 0;
+}
+
+void maxsim_quit(void) {
+	free(maxsim_heap);
+	maxsim_heap = NULL;
+	maxsim_heap_count = 0;
+	maxsim_heap_size = 0;
+	maxsim_clear();
+	free(maxsim_log);
+	free(maxsim_log_atoms);
+	maxsim_log = NULL;
+	maxsim_log_atoms = NULL;
+	maxsim_log_size = 0;
+	maxsim_log_atom_size = 0;
+	pthread_mutex_destroy(&maxsim_critical);
+}
+
+// Console
+
+void post(const char* fmt, ...) {
+	va_list args;
+	pthread_mutex_lock(&maxsim_post_lock);
+	va_start(args, fmt);
+	vsnprintf(maxsim_posted, sizeof(maxsim_posted), fmt, args);
+	va_end(args);
+	puts(maxsim_posted);
+	pthread_mutex_unlock(&maxsim_post_lock);
+}
+
+void maxsim_last_post(char* line, size_t size) {
+	pthread_mutex_lock(&maxsim_post_lock);
+	snprintf(line, size, "%s", maxsim_posted);
+	pthread_mutex_unlock(&maxsim_post_lock);
+}
+
+// Symbols
+
+t_symbol* gensym(const char* s) {
+	unsigned int hash = 2166136261u;
+	for (const char* c = s; *c; c++) {
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	}
+	t_symbol** bucket = &maxsim_symbols[hash % MAXSIM_SYMBOL_BUCKETS];
+	for (t_symbol* sym = *bucket; sym != NULL; sym = sym->s_next) {
+		if (strcmp(sym->s_name, s) == 0) {
+			return sym;
+		}
+	}
+	t_symbol* sym = (t_symbol*)malloc(sizeof(t_symbol));
+	sym->s_name = strdup(s);
+	sym->s_next = *bucket;
+	*bucket = sym;
+	return sym;
+}
+
+// Atoms
+
+long atom_gettype(const t_atom* a) {
+	return a->a_type;
+}
+
+t_atom_long atom_getlong(const t_atom* a) {
+	if (a->a_type == A_FLOAT) {
+		return (t_atom_long)a->a_w.w_float;
+	}
+	return a->a_type == A_LONG ? a->a_w.w_long : 0;
+}
+
+t_atom_float atom_getfloat(const t_atom* a) {
+	if (a->a_type == A_LONG) {
+		return (t_atom_float)a->a_w.w_long;
+	}
+	return a->a_type == A_FLOAT ? a->a_w.w_float : 0;
+}
+
+t_symbol* atom_getsym(const t_atom* a) {
+	return a->a_type == A_SYM ? a->a_w.w_sym : gensym("");
+}
+
+t_max_err atom_setlong(t_atom* a, t_atom_long b) {
+	a->a_type = A_LONG;
+	a->a_w.w_long = b;
+	return MAX_ERR_NONE;
+}
+
+t_max_err atom_setfloat(t_atom* a, double b) {
+	a->a_type = A_FLOAT;
+	a->a_w.w_float = b;
+	return MAX_ERR_NONE;
+}
+
+t_max_err atom_setsym(t_atom* a, t_symbol* b) {
+	a->a_type = A_SYM;
+	a->a_w.w_sym = b;
+	return MAX_ERR_NONE;
+}
+
+// Classes
+
+t_class* class_new(const char* name, method mnew, method mfree, long size, method mmenu, short type, ...) {
+	t_class* c = (t_class*)calloc(1, sizeof(t_class));
+	c->name = strdup(name);
+	c->mnew = mnew;
+	c->mfree = mfree;
+	c->size = size;
+	return c;
+}
+
+// Argument types follow the name and end with 0, as in Max
+t_max_err class_addmethod(t_class* c, method m, const char* name, ...) {
+	if (c->method_count == MAXSIM_METHODS) {
+		post("maxsim: too many methods in %s", c->name);
+		return MAX_ERR_GENERIC;
+	}
+	maxsim_method* mm = &c->methods[c->method_count++];
+	va_list args;
+	mm->name = name;
+	mm->fn = m;
+	mm->arg_count = 0;
+	va_start(args, name);
+	for (;;) {
+		int type = va_arg(args, int);
+		if (type == A_NOTHING || mm->arg_count == MAXSIM_ARGS) {
+			break;
+		}
+		mm->types[mm->arg_count++] = (short)type;
+	}
+	va_end(args);
+	return MAX_ERR_NONE;
+}
+
+t_max_err class_register(t_symbol* name_space, t_class* c) {
+	c->next = maxsim_classes;
+	maxsim_classes = c;
+	return MAX_ERR_NONE;
+}
+
+maxsim_method* maxsim_find_method(t_class* c, const char* name) {
+	for (int i = 0; i < c->method_count; i++) {
+		if (strcmp(c->methods[i].name, name) == 0) {
+			return &c->methods[i];
+		}
+	}
+	return NULL;
+}
+
+// Objects
+
+maxsim_box* maxsim_find_box(void* x) {
+	for (maxsim_box* b = maxsim_boxes; b != NULL; b = b->next) {
+		if ((void*)b->object == x) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+void* object_alloc(t_class* c) {
+	t_object* x = (t_object*)calloc(1, c->size);
+	x->o_class = c;
+
+	maxsim_box* b = (maxsim_box*)calloc(1, sizeof(maxsim_box));
+	b->object = x;
+	b->id = maxsim_box_count++;
+	b->next = maxsim_boxes;
+	maxsim_boxes = b;
+	return x;
+}
+
+void* maxsim_new(const char* classname, long argc, t_atom* argv) {
+	for (t_class* c = maxsim_classes; c != NULL; c = c->next) {
+		if (strcmp(c->name, classname) == 0) {
+			return ((void* (*)(t_symbol*, long, t_atom*))c->mnew)(gensym(classname), argc, argv);
+		}
+	}
+	post("maxsim: no class %s", classname);
+	return NULL;
+}
+
+void* object_new(t_symbol* name_space, t_symbol* classname, ...) {
+	return maxsim_new(classname->s_name, 0, NULL);
+}
+
+void maxsim_clock_free(maxsim_clock* c);
+void maxsim_qelem_free(maxsim_qelem* q);
+
+t_max_err object_free(void* x) {
+	t_object* ob = (t_object*)x;
+	if (ob == NULL) {
+		return MAX_ERR_GENERIC;
+	}
+	if (ob->o_class == &maxsim_clock_class) {
+		maxsim_clock_free((maxsim_clock*)ob);
+		return MAX_ERR_NONE;
+	}
+	if (ob->o_class == &maxsim_qelem_class) {
+		maxsim_qelem_free((maxsim_qelem*)ob);
+		return MAX_ERR_NONE;
+	}
+
+	if (ob->o_class->mfree != NULL) {
+		((void (*)(void*))ob->o_class->mfree)(x);
+	}
+	maxsim_box** link = &maxsim_boxes;
+	while (*link != NULL && (*link)->object != ob) {
+		link = &(*link)->next;
+	}
+	if (*link != NULL) {
+		maxsim_box* b = *link;
+		*link = b->next;
+		while (b->outlet_list != NULL) {
+			maxsim_outlet* next = b->outlet_list->next;
+			free(b->outlet_list);
+			b->outlet_list = next;
+		}
+		free(b);
+	}
+	free(x);
+	return MAX_ERR_NONE;
+}
+
+/*
+Sends a message the way a patch cord would, converting the atoms to the argument types the
+class gave for it. Returns 0 if the object doesn't understand the message.
+*/
+int maxsim_send(void* x, const char* message, long argc, t_atom* argv) {
+	t_class* c = ((t_object*)x)->o_class;
+	maxsim_method* m = maxsim_find_method(c, message);
+	if (m == NULL || (m->arg_count > 0 && m->types[0] == A_CANT)) {
+		post("%s: doesn't understand \"%s\"", c->name, message);
+		return 0;
+	}
+	if (m->arg_count > 0 && m->types[0] == A_GIMME) {
+		((void (*)(void*, t_symbol*, long, t_atom*))m->fn)(x, gensym(message), argc, argv);
+		return 1;
+	}
+
+	// Typed arguments, missing ones are 0 like in Max
+	char signature[MAXSIM_ARGS + 1];
+	t_atom_long longs[MAXSIM_ARGS];
+	double floats[MAXSIM_ARGS];
+	t_symbol* symbols[MAXSIM_ARGS];
+	for (int i = 0; i < m->arg_count; i++) {
+		t_atom* a = i < argc ? argv + i : NULL;
+		switch (m->types[i]) {
+		case A_LONG:
+		case A_DEFLONG:
+			signature[i] = 'l';
+			longs[i] = a != NULL ? atom_getlong(a) : 0;
+			break;
+		case A_FLOAT:
+		case A_DEFFLOAT:
+			signature[i] = 'f';
+			floats[i] = a != NULL ? atom_getfloat(a) : 0;
+			break;
+		default:
+			signature[i] = 's';
+			symbols[i] = a != NULL ? atom_getsym(a) : gensym("");
+			break;
+		}
+	}
+	signature[m->arg_count] = 0;
+
+	if (strcmp(signature, "") == 0) {
+		((void (*)(void*))m->fn)(x);
+	}
+	else if (strcmp(signature, "l") == 0) {
+		((void (*)(void*, t_atom_long))m->fn)(x, longs[0]);
+	}
+	else if (strcmp(signature, "f") == 0) {
+		((void (*)(void*, double))m->fn)(x, floats[0]);
+	}
+	else if (strcmp(signature, "s") == 0) {
+		((void (*)(void*, t_symbol*))m->fn)(x, symbols[0]);
+	}
+	else if (strcmp(signature, "ll") == 0) {
+		((void (*)(void*, t_atom_long, t_atom_long))m->fn)(x, longs[0], longs[1]);
+	}
+	else if (strcmp(signature, "ff") == 0) {
+		((void (*)(void*, double, double))m->fn)(x, floats[0], floats[1]);
+	}
+	else {
+		post("maxsim: can't call %s with arguments %s", message, signature);
+		return 0;
+	}
+	return 1;
+}
+
+// Inlets and outlets
+
+void* intin(void* x, short n) {
+	return NULL; // Messages to inlet n arrive as "in<n>", send those instead
+}
+
+void* floatin(void* x, short n) {
+	return NULL;
+}
+
+void* outlet_new(void* x, const char* s) {
+	maxsim_box* b = maxsim_find_box(x);
+	maxsim_outlet* o = (maxsim_outlet*)malloc(sizeof(maxsim_outlet));
+	o->box = b;
+	o->index = b != NULL ? b->outlets++ : 0;
+	o->next = NULL;
+	if (b != NULL) {
+		o->next = b->outlet_list;
+		b->outlet_list = o;
+	}
+	return o;
+}
+
+void* intout(void* x) {
+	return outlet_new(x, NULL);
+}
+
+void* floatout(void* x) {
+	return outlet_new(x, NULL);
+}
+
+void* listout(void* x) {
+	return outlet_new(x, NULL);
+}
+
+maxsim_event* maxsim_add_event(void* o, char type) {
+	maxsim_outlet* out = (maxsim_outlet*)o;
+	if (maxsim_log_count == maxsim_log_size) {
+		maxsim_log_size = maxsim_log_size > 0 ? maxsim_log_size * 2 : 4096;
+		maxsim_log = (maxsim_event*)realloc(maxsim_log, sizeof(maxsim_event) * maxsim_log_size);
+	}
+	maxsim_event* e = &maxsim_log[maxsim_log_count++];
+	e->time = maxsim_time;
+	e->object = out->box != NULL ? out->box->id : -1;
+	e->outlet = out->box != NULL ? out->box->outlets - 1 - out->index : 0;
+	e->type = type;
+	e->value = 0;
+	e->atoms = 0;
+	e->count = 0;
+	return e;
+}
+
+void* outlet_int(void* o, t_atom_long n) {
+	if (maxsim_recording) {
+		maxsim_add_event(o, 'i')->value = (double)n;
+	}
+	return NULL;
+}
+
+void* outlet_float(void* o, double f) {
+	if (maxsim_recording) {
+		maxsim_add_event(o, 'f')->value = f;
+	}
+	return NULL;
+}
+
+void* outlet_list(void* o, t_symbol* s, short ac, t_atom* av) {
+	if (!maxsim_recording) {
+		return NULL;
+	}
+	maxsim_event* e = maxsim_add_event(o, 'l');
+	if (maxsim_log_atom_count + ac > maxsim_log_atom_size) {
+		while (maxsim_log_atom_count + ac > maxsim_log_atom_size) {
+			maxsim_log_atom_size = maxsim_log_atom_size > 0 ? maxsim_log_atom_size * 2 : 4096;
+		}
+		maxsim_log_atoms = (t_atom*)realloc(maxsim_log_atoms, sizeof(t_atom) * maxsim_log_atom_size);
+	}
+	e->atoms = maxsim_log_atom_count;
+	e->count = ac;
+	memcpy(maxsim_log_atoms + maxsim_log_atom_count, av, sizeof(t_atom) * ac);
+	maxsim_log_atom_count += ac;
+	return NULL;
+}
+
+// Clocks
+
+void maxsim_heap_swap(long a, long b) {
+	maxsim_due t = maxsim_heap[a];
+	maxsim_heap[a] = maxsim_heap[b];
+	maxsim_heap[b] = t;
+}
+
+int maxsim_earlier(maxsim_due* a, maxsim_due* b) {
+	return a->when < b->when || (a->when == b->when && a->order < b->order);
+}
+
+void maxsim_heap_down(long i) {
+	for (;;) {
+		long l = 2 * i + 1;
+		long r = l + 1;
+		long first = i;
+		if (l < maxsim_heap_count && maxsim_earlier(&maxsim_heap[l], &maxsim_heap[first])) {
+			first = l;
+		}
+		if (r < maxsim_heap_count && maxsim_earlier(&maxsim_heap[r], &maxsim_heap[first])) {
+			first = r;
+		}
+		if (first == i) {
+			return;
+		}
+		maxsim_heap_swap(i, first);
+		i = first;
+	}
+}
+
+void maxsim_heap_push(maxsim_due d) {
+	if (maxsim_heap_count == maxsim_heap_size) {
+		maxsim_heap_size = maxsim_heap_size > 0 ? maxsim_heap_size * 2 : 256;
+		maxsim_heap = (maxsim_due*)realloc(maxsim_heap, sizeof(maxsim_due) * maxsim_heap_size);
+	}
+	long i = maxsim_heap_count++;
+	maxsim_heap[i] = d;
+	while (i > 0 && maxsim_earlier(&maxsim_heap[i], &maxsim_heap[(i - 1) / 2])) {
+		maxsim_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+void maxsim_heap_pop(void) {
+	maxsim_heap[0] = maxsim_heap[--maxsim_heap_count];
+	maxsim_heap_down(0);
+}
+
+// Drops entries for clocks that were unset or set again since, returns the next live one or NULL
+maxsim_due* maxsim_heap_top(void) {
+	while (maxsim_heap_count > 0 && maxsim_heap[0].generation != maxsim_heap[0].clock->generation) {
+		maxsim_heap_pop();
+	}
+	return maxsim_heap_count > 0 ? &maxsim_heap[0] : NULL;
+}
+
+void* clock_new(void* obj, method fn) {
+	maxsim_clock* c = (maxsim_clock*)calloc(1, sizeof(maxsim_clock));
+	c->ob.o_class = &maxsim_clock_class;
+	c->owner = obj;
+	c->fn = fn;
+	return c;
+}
+
+void clock_fdelay(void* c, double time) {
+	maxsim_clock* clock = (maxsim_clock*)c;
+	maxsim_due d;
+	d.when = maxsim_time + (time > 0 ? time : 0);
+	d.order = maxsim_order++;
+	d.generation = ++clock->generation;
+	d.clock = clock;
+	maxsim_heap_push(d);
+}
+
+void clock_delay(void* c, long time) {
+	clock_fdelay(c, (double)time);
+}
+
+void clock_unset(void* c) {
+	((maxsim_clock*)c)->generation++;
+}
+
+void clock_getftime(double* time) {
+	*time = maxsim_time;
+}
+
+// Takes the clock's entries out of the heap before it goes
+void maxsim_clock_free(maxsim_clock* c) {
+	long kept = 0;
+	for (long i = 0; i < maxsim_heap_count; i++) {
+		if (maxsim_heap[i].clock != c) {
+			maxsim_heap[kept++] = maxsim_heap[i];
+		}
+	}
+	maxsim_heap_count = kept;
+	for (long i = kept / 2 - 1; i >= 0; i--) {
+		maxsim_heap_down(i);
+	}
+	free(c);
+}
+
+// Qelems
+
+void* qelem_new(void* obj, method fn) {
+	maxsim_qelem* q = (maxsim_qelem*)calloc(1, sizeof(maxsim_qelem));
+	q->ob.o_class = &maxsim_qelem_class;
+	q->owner = obj;
+	q->fn = fn;
+	return q;
+}
+
+// Safe from any thread, like in Max
+void qelem_set(void* q) {
+	maxsim_qelem* qe = (maxsim_qelem*)q;
+	pthread_mutex_lock(&maxsim_queue_lock);
+	qe->set = 1;
+	if (!qe->queued) {
+		qe->queued = 1;
+		qe->next = NULL;
+		if (maxsim_queue_last != NULL) {
+			maxsim_queue_last->next = qe;
+		}
+		else {
+			maxsim_queue = qe;
+		}
+		maxsim_queue_last = qe;
+	}
+	pthread_mutex_unlock(&maxsim_queue_lock);
+}
+
+void qelem_unset(void* q) {
+	pthread_mutex_lock(&maxsim_queue_lock);
+	((maxsim_qelem*)q)->set = 0;
+	pthread_mutex_unlock(&maxsim_queue_lock);
+}
+
+void maxsim_qelem_free(maxsim_qelem* q) {
+	pthread_mutex_lock(&maxsim_queue_lock);
+	maxsim_qelem* previous = NULL;
+	for (maxsim_qelem* e = maxsim_queue; e != NULL; previous = e, e = e->next) {
+		if (e == q) {
+			if (previous != NULL) {
+				previous->next = e->next;
+			}
+			else {
+				maxsim_queue = e->next;
+			}
+			if (maxsim_queue_last == e) {
+				maxsim_queue_last = previous;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&maxsim_queue_lock);
+	free(q);
+}
+
+void qelem_free(void* q) {
+	maxsim_qelem_free((maxsim_qelem*)q);
+}
+
+void maxsim_idle(void) {
+	for (;;) {
+		pthread_mutex_lock(&maxsim_queue_lock);
+		maxsim_qelem* q = maxsim_queue;
+		int set = 0;
+		if (q != NULL) {
+			maxsim_queue = q->next;
+			if (maxsim_queue == NULL) {
+				maxsim_queue_last = NULL;
+			}
+			q->queued = 0;
+			set = q->set;
+			q->set = 0;
+		}
+		pthread_mutex_unlock(&maxsim_queue_lock);
+		if (q == NULL) {
+			return;
+		}
+		if (set) {
+			((void (*)(void*))q->fn)(q->owner);
+		}
+	}
+}
+
+void critical_enter(void* region) {
+	pthread_mutex_lock(&maxsim_critical);
+}
+
+void critical_exit(void* region) {
+	pthread_mutex_unlock(&maxsim_critical);
+}
+
+// Scheduler
+
+double maxsim_now(void) {
+	return maxsim_time;
+}
+
+long maxsim_run(double until) {
+	long fired = 0;
+	maxsim_due* d;
+	while ((d = maxsim_heap_top()) != NULL && d->when <= until) {
+		maxsim_clock* c = d->clock;
+		maxsim_time = d->when;
+		c->generation++; // Fired, so no longer set
+		maxsim_heap_pop();
+		((void (*)(void*))c->fn)(c->owner);
+		fired++;
+		maxsim_idle();
+	}
+	if (until > maxsim_time && isfinite(until)) {
+		maxsim_time = until;
+	}
+	return fired;
+}
+
+long maxsim_run_all(void) {
+	return maxsim_run(INFINITY);
+}
+
+double systimer_gettime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Recording
+
+void maxsim_record(int on) {
+	maxsim_recording = on;
+}
+
+long maxsim_event_count(void) {
+	return maxsim_log_count;
+}
+
+maxsim_event* maxsim_events(void) {
+	return maxsim_log;
+}
+
+t_atom* maxsim_event_atoms(maxsim_event* e) {
+	return maxsim_log_atoms + e->atoms;
+}
+
+void maxsim_clear(void) {
+	maxsim_log_count = 0;
+	maxsim_log_atom_count = 0;
+}
+
+// One event as a line of text, returns its length
+int maxsim_format(maxsim_event* e, char* line, int size) {
+	int n = snprintf(line, size, "%.3f %d:%d", e->time, e->object, e->outlet);
+	if (e->type == 'i') {
+		n += snprintf(line + n, size - n, " int %ld\n", (long)e->value);
+	}
+	else if (e->type == 'f') {
+		n += snprintf(line + n, size - n, " float %.3f\n", e->value);
+	}
+	else {
+		n += snprintf(line + n, size - n, " list");
+		t_atom* a = maxsim_event_atoms(e);
+		for (int i = 0; i < e->count && n < size - 32; i++) {
+			if (a[i].a_type == A_FLOAT) {
+				n += snprintf(line + n, size - n, " %.3f", a[i].a_w.w_float);
+			}
+			else if (a[i].a_type == A_SYM) {
+				n += snprintf(line + n, size - n, " %s", a[i].a_w.w_sym->s_name);
+			}
+			else {
+				n += snprintf(line + n, size - n, " %ld", (long)a[i].a_w.w_long);
+			}
+		}
+		n += snprintf(line + n, size - n, "\n");
+	}
+	return n < size ? n : size - 1;
+}
+
+void maxsim_write(FILE* fp) {
+	char line[1024];
+	for (long i = 0; i < maxsim_log_count; i++) {
+		maxsim_format(&maxsim_log[i], line, sizeof(line));
+		fputs(line, fp);
+	}
+}
+
+// FNV-1a over the lines maxsim_write would print
+unsigned int maxsim_checksum(void) {
+	char line[1024];
+	unsigned int hash = 2166136261u;
+	for (long i = 0; i < maxsim_log_count; i++) {
+		int n = maxsim_format(&maxsim_log[i], line, sizeof(line));
+		for (int k = 0; k < n; k++) {
+			hash = (hash ^ (unsigned char)line[k]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+// Threads
+
+long systhread_create(method entryproc, void* arg, long stacksize, long priority, long flags, t_systhread* thread) {
+	pthread_t* t = (pthread_t*)malloc(sizeof(pthread_t));
+	if (pthread_create(t, NULL, (void* (*)(void*))entryproc, arg) != 0) {
+		free(t);
+		*thread = NULL;
+		return 1;
+	}
+	*thread = t;
+	return 0;
+}
+
+long systhread_join(t_systhread thread, unsigned int* retval) {
+	if (thread == NULL) {
+		return 1;
+	}
+	pthread_join(*(pthread_t*)thread, NULL);
+	free(thread);
+	if (retval != NULL) {
+		*retval = 0;
+	}
+	return 0;
+}
+
+void systhread_exit(long status) {
+	pthread_exit(NULL);
+}
+
+void systhread_sleep(int milliseconds) {
+	struct timespec ts = { milliseconds / 1000, (milliseconds % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+}
+
+long systhread_mutex_new(t_systhread_mutex* pmutex, long flags) {
+	pthread_mutex_t* m = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(m, NULL);
+	*pmutex = m;
+	return 0;
+}
+
+long systhread_mutex_free(t_systhread_mutex pmutex) {
+	pthread_mutex_destroy((pthread_mutex_t*)pmutex);
+	free(pmutex);
+	return 0;
+}
+
+long systhread_mutex_lock(t_systhread_mutex pmutex) {
+	return pthread_mutex_lock((pthread_mutex_t*)pmutex);
+}
+
+long systhread_mutex_unlock(t_systhread_mutex pmutex) {
+	return pthread_mutex_unlock((pthread_mutex_t*)pmutex);
+}
+
+long systhread_mutex_trylock(t_systhread_mutex pmutex) {
+	return pthread_mutex_trylock((pthread_mutex_t*)pmutex);
+}
+
+long systhread_cond_new(t_systhread_cond* pcond, long flags) {
+	pthread_cond_t* c = (pthread_cond_t*)malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(c, NULL);
+	*pcond = c;
+	return 0;
+}
+
+long systhread_cond_free(t_systhread_cond pcond) {
+	pthread_cond_destroy((pthread_cond_t*)pcond);
+	free(pcond);
+	return 0;
+}
+
+long systhread_cond_wait(t_systhread_cond pcond, t_systhread_mutex pmutex) {
+	return pthread_cond_wait((pthread_cond_t*)pcond, (pthread_mutex_t*)pmutex);
+}
+
+long systhread_cond_signal(t_systhread_cond pcond) {
+	return pthread_cond_signal((pthread_cond_t*)pcond);
+}
+
+long systhread_cond_broadcast(t_systhread_cond pcond) {
+	return pthread_cond_broadcast((pthread_cond_t*)pcond);
+}
@@ -0,0 +1,65 @@
+/**
+	@file
+	maxsim - drives Max objects without Max: virtual time scheduler, messages and outlet recording
+	Caden Kesey
+*/
+
+/*
+maxsim.c implements the Max API declared in ext.h so an external can be built and run as an
+ordinary program. Clocks fire in virtual time: maxsim_run jumps straight from one clock to the
+next, so a song plays as fast as its callbacks run. Clocks due at the same moment fire in the
+order they were set. Qelems run after each clock callback, on the thread that called maxsim_run.
+
+Every outlet call can be recorded with the virtual time it happened at, for checking the exact
+output of an object or counting how fast it runs.
+*/
+
+#ifndef MAXSIM_H
+#define MAXSIM_H
+
+#include <stdio.h>
+#include "ext.h"
+
+// One outlet call
+typedef struct maxsim_event {
+	double time; // Virtual milliseconds
+	int object; // Order the object was made in, from 0
+	int outlet; // Counted from the left, like the Max inspector
+	char type; // 'i', 'f' or 'l'
+	double value; // int and float outlets
+	long atoms; // list outlets, first atom in the recording's atom store
+	short count;
+} maxsim_event;
+
+// Setup
+
+void maxsim_init(void);
+void maxsim_quit(void);
+
+// Objects
+
+void* maxsim_new(const char* classname, long argc, t_atom* argv);
+int maxsim_send(void* x, const char* message, long argc, t_atom* argv);
+
+// Console
+
+void maxsim_last_post(char* line, size_t size); // Copies the last line posted, cut to size
+
+// Scheduler
+
+double maxsim_now(void);
+long maxsim_run(double until); // Runs clocks due up to until, returns how many fired
+long maxsim_run_all(void); // Runs until no clock is set
+void maxsim_idle(void); // Runs qelems set by other threads
+
+// Recording
+
+void maxsim_record(int on);
+long maxsim_event_count(void);
+maxsim_event* maxsim_events(void);
+t_atom* maxsim_event_atoms(maxsim_event* e);
+void maxsim_clear(void);
+void maxsim_write(FILE* fp); // One line per outlet call
+unsigned int maxsim_checksum(void);
+
+#endif
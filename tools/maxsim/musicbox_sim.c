@@ -0,0 +1,858 @@
+/**
+	@file
+	musicbox_sim - plays the musicbox object on maxsim, for checking its output and timing it
+	Caden Kesey
+*/
+
+/*
+musicbox_sim play <seed> [<tempo>] [<log>]
+	Plays one song in virtual time and reports the clock callbacks, outlet calls and how much
+	faster than real time it ran. With a log file every outlet call is written to it, one line
+	each: virtual milliseconds, object:outlet counted from the left, type and value.
+musicbox_sim bench [<songs>] [<instances>]
+	Plays songs on several instances at once, seeds 0 up, and reports the throughput
+musicbox_sim replay <seed> [<log>] [<ms>]
+	Records one song into an event log, replays the log and checks every outlet call came out
+	the same at the same time relative to the start. With ms the song is stopped and started
+	over that many milliseconds in, and the log has to hold both
+musicbox_sim playlist <songs> [<depth>]
+	Queues seeds 0 up on one instance and checks it plays exactly what the seeds play on their
+	own, back to back with no gap, then posts the queue stats
+musicbox_sim retime <songs> [<ms>]
+	Plays seeds 0 up, then plays each again changing tempo that far in, once faster and once
+	slower, and checks every outlet gets as many calls as it did with no change
+musicbox_sim regenerate <seed> [<seconds>]
+	Plays one song, then plays it again and regenerates the kick part way through. Checks the
+	kick and bass, which follows it, change from the next measure on and nothing else changes
+musicbox_sim threads <songs> [<threads>]
+	Plays seeds 0 up with their tracks made one after another, then again with threads helping,
+	and checks every outlet call is the same. Reports how long the bangs took each way.
+musicbox_sim analyze <songs> [<threads>] [<file>]
+	Measures the features of seeds 0 up, checks the vectors are sane and that one thread gives
+	the same file, and reports songs measured a minute
+musicbox_sim render <songs>
+	Renders seeds 0 up to WAV files as one range, checks the message returned without waiting
+	for them and that each file is the same as rendering that seed on its own, and reports songs
+	rendered a minute
+
+musicbox_sim ingest <rows> [<threads>]
+	Writes a pattern file of made up rows, with every kind of word the files hold and some they
+	only hold by mistake, then has the object read it and each real pattern file directly and the
+	old way, checking both read the same words and reporting how fast each was
+musicbox_sim transport <instances> [<late>]
+	Plays seeds 0 up on that many instances with their own clocks, then on as many instances
+	sharing one transport, and checks each plays the same. One more joins the transport late
+	milliseconds in and has to start on the next bar line. Reports the clock callbacks each way.
+
+musicbox.c is built unchanged, see the Makefile next to this file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ext.h"
+#include "ext_systhread.h"
+#include "maxsim.h"
+
+void ext_main(void* r);
+
+void send_long(void* x, const char* message, long n) {
+	t_atom a;
+	atom_setlong(&a, n);
+	maxsim_send(x, message, 1, &a);
+}
+
+int play(unsigned int seed, long tempo, const char* log) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", tempo);
+	send_long(x, "in2", (long)seed);
+
+	maxsim_record(1);
+	double start = systimer_gettime();
+	double virtual_start = maxsim_now();
+	maxsim_send(x, "bang", 0, NULL);
+	long fired = maxsim_run_all();
+	double took = systimer_gettime() - start;
+	double played = maxsim_now() - virtual_start;
+
+	printf("seed %u at %ld bpm: %ld clock callbacks, %ld outlet calls, checksum %08x\n",
+		seed, tempo, fired, maxsim_event_count(), maxsim_checksum());
+	printf("%.1f virtual seconds in %.3f ms, %.0f times real time\n",
+		played / 1000.0, took, took > 0 ? played / took : 0);
+
+	if (log != NULL) {
+		FILE* fp = fopen(log, "w");
+		if (fp == NULL) {
+			printf("Could not open %s\n", log);
+			object_free(x);
+			return 1;
+		}
+		maxsim_write(fp);
+		fclose(fp);
+	}
+	object_free(x);
+	return 0;
+}
+
+int bench(long songs, long instances) {
+	void** boxes = (void**)malloc(sizeof(void*) * instances);
+	long fired = 0;
+	long outlets = 0;
+	double played = 0;
+
+	for (long i = 0; i < instances; i++) {
+		boxes[i] = maxsim_new("musicbox", 0, NULL);
+		send_long(boxes[i], "in1", 120);
+	}
+
+	maxsim_record(1);
+	double start = systimer_gettime();
+	for (long song = 0; song < songs; song += instances) {
+		double virtual_start = maxsim_now();
+		for (long i = 0; i < instances && song + i < songs; i++) {
+			send_long(boxes[i], "in2", song + i);
+			maxsim_send(boxes[i], "bang", 0, NULL);
+			if (song > 0) { // The first bang stopped the last song
+				maxsim_send(boxes[i], "bang", 0, NULL);
+			}
+		}
+		fired += maxsim_run_all();
+		outlets += maxsim_event_count();
+		played += maxsim_now() - virtual_start;
+		maxsim_clear();
+	}
+	double took = systimer_gettime() - start;
+
+	printf("%ld songs on %ld instances: %ld clock callbacks, %ld outlet calls in %.3f ms\n",
+		songs, instances, fired, outlets, took);
+	printf("%.0f outlet calls per second, %.1f virtual seconds played, %.0f times real time\n",
+		took > 0 ? outlets * 1000.0 / took : 0, played / 1000.0, took > 0 ? played / took : 0);
+
+	for (long i = 0; i < instances; i++) {
+		object_free(boxes[i]);
+	}
+	free(boxes);
+	return 0;
+}
+
+void send_symbol(void* x, const char* message, const char* s) {
+	t_atom a;
+	atom_setsym(&a, gensym(s));
+	maxsim_send(x, message, 1, &a);
+}
+
+int replay(unsigned int seed, const char* log, double restart) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", 120);
+	send_long(x, "in2", (long)seed);
+
+	// Generate and record
+
+	maxsim_record(1);
+	send_symbol(x, "record", log);
+	double start = maxsim_now();
+	maxsim_send(x, "bang", 0, NULL);
+	if (restart > 0) {
+		maxsim_run(start + restart);
+		maxsim_send(x, "bang", 0, NULL);
+		maxsim_send(x, "bang", 0, NULL);
+	}
+	maxsim_run_all();
+	send_symbol(x, "record", "stop");
+
+	long count = maxsim_event_count();
+	maxsim_event* played = (maxsim_event*)malloc(sizeof(maxsim_event) * (count > 0 ? count : 1));
+	memcpy(played, maxsim_events(), sizeof(maxsim_event) * count);
+	for (long i = 0; i < count; i++) {
+		played[i].time -= start;
+	}
+	maxsim_clear();
+
+	// Replay
+
+	start = maxsim_now();
+	double took = systimer_gettime();
+	send_symbol(x, "replay", log);
+	maxsim_run_all();
+	took = systimer_gettime() - took;
+
+	long replayed = maxsim_event_count();
+	maxsim_event* events = maxsim_events();
+	long differ = replayed == count ? 0 : -1;
+	double slack = restart > 0 ? 1e-3 : 0; // Log times are floats, a restart off the beat can't be held exactly
+	for (long i = 0; i < count && differ == 0; i++) {
+		maxsim_event* a = &played[i];
+		maxsim_event* b = &events[i];
+		if (fabs(a->time - (b->time - start)) > slack || a->object != b->object || a->outlet != b->outlet
+			|| a->type != b->type || a->value != b->value || a->count != b->count) {
+			printf("outlet call %ld differs: %.3f %d:%d %c %g, replayed %.3f %d:%d %c %g\n", i,
+				a->time, a->object, a->outlet, a->type, a->value, b->time - start, b->object, b->outlet, b->type, b->value);
+			differ = 1;
+		}
+	}
+
+	if (differ < 0) {
+		printf("seed %u: played %ld outlet calls, replayed %ld\n", seed, count, replayed);
+	}
+	else if (differ == 0) {
+		printf("seed %u: %ld outlet calls replayed the same from %s in %.3f ms\n", seed, count, log, took);
+	}
+	free(played);
+	object_free(x);
+	return differ != 0;
+}
+
+int playlist(long songs, long depth) {
+	// Each seed on its own, shifted to where it should fall in the playlist
+
+	long count = 0;
+	long size = 0;
+	maxsim_event* expected = NULL;
+	double offset = 0;
+	maxsim_record(1);
+	for (long i = 0; i < songs; i++) {
+		void* x = maxsim_new("musicbox", 0, NULL);
+		send_long(x, "in1", 120);
+		send_long(x, "in2", i);
+		double start = maxsim_now();
+		maxsim_send(x, "bang", 0, NULL);
+		maxsim_run_all();
+
+		long n = maxsim_event_count();
+		if (count + n > size) {
+			size = (count + n) * 2;
+			expected = (maxsim_event*)realloc(expected, sizeof(maxsim_event) * size);
+		}
+		memcpy(expected + count, maxsim_events(), sizeof(maxsim_event) * n);
+		for (long k = count; k < count + n; k++) {
+			expected[k].time += offset - start;
+		}
+		count += n;
+		offset += maxsim_now() - start;
+		maxsim_clear();
+		object_free(x);
+	}
+
+	// All of them queued on one instance
+
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", 120);
+	send_long(x, "prefetch", depth);
+	for (long i = 0; i < songs; i++) {
+		send_long(x, "queue", i);
+	}
+	double start = maxsim_now();
+	double took = systimer_gettime();
+	maxsim_send(x, "bang", 0, NULL);
+	maxsim_run_all();
+	took = systimer_gettime() - took;
+
+	long played = maxsim_event_count();
+	maxsim_event* events = maxsim_events();
+	int differ = played != count;
+	for (long i = 0; i < count && !differ; i++) {
+		maxsim_event* a = &expected[i];
+		maxsim_event* b = &events[i];
+		if (fabs(a->time - (b->time - start)) > 1e-6 || a->outlet != b->outlet || a->type != b->type
+			|| a->value != b->value || a->count != b->count) {
+			printf("outlet call %ld differs: %.3f %d %c %g, queued %.3f %d %c %g\n", i,
+				a->time, a->outlet, a->type, a->value, b->time - start, b->outlet, b->type, b->value);
+			differ = 1;
+		}
+	}
+	if (played != count) {
+		printf("%ld songs: %ld outlet calls on their own, %ld queued\n", songs, count, played);
+	}
+	else if (!differ) {
+		printf("%ld songs queued with prefetch %ld: %ld outlet calls the same as each seed on its own, %.1f virtual seconds with no gaps, %.3f ms\n",
+			songs, depth, count, (maxsim_now() - start) / 1000.0, took);
+	}
+	send_symbol(x, "queue", "stats");
+	free(expected);
+	object_free(x);
+	return differ;
+}
+
+// Plays one seed at 120 bpm, changing to bpm at ms if bpm isn't 0, and counts each outlet's calls
+void retime_counts(unsigned int seed, double ms, long bpm, long counts[19]) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", 120);
+	send_long(x, "in2", (long)seed);
+	maxsim_clear();
+	double start = maxsim_now();
+	maxsim_send(x, "bang", 0, NULL);
+	if (bpm > 0) {
+		maxsim_run(start + ms);
+		send_long(x, "in1", bpm);
+	}
+	maxsim_run_all();
+	for (int outlet = 0; outlet < 19; outlet++) {
+		counts[outlet] = 0;
+	}
+	maxsim_event* events = maxsim_events();
+	for (long i = 0; i < maxsim_event_count(); i++) {
+		counts[events[i].outlet]++;
+	}
+	maxsim_clear();
+	object_free(x);
+}
+
+int retime(long songs, double ms) {
+	const long tempos[2] = { 240, 60 };
+	int differ = 0;
+	maxsim_record(1);
+	for (long i = 0; i < songs && !differ; i++) {
+		long expected[19];
+		retime_counts((unsigned int)i, 0, 0, expected);
+		for (int k = 0; k < 2 && !differ; k++) {
+			long counts[19];
+			retime_counts((unsigned int)i, ms, tempos[k], counts);
+			for (int outlet = 0; outlet < 19; outlet++) {
+				if (counts[outlet] != expected[outlet]) {
+					printf("seed %ld: changing to %ld bpm at %.0f ms gave outlet %d %ld calls, %ld without\n",
+						i, tempos[k], ms, outlet, counts[outlet], expected[outlet]);
+					differ = 1;
+				}
+			}
+		}
+	}
+	if (!differ) {
+		printf("%ld songs: changing tempo at %.0f ms, faster or slower, sent every note\n", songs, ms);
+	}
+	return differ;
+}
+
+// Outlets counted from the left, the kick pair is leftmost and the bass pair is 10 and 11
+int regenerated_outlet(int outlet) {
+	return outlet <= 1 || outlet == 10 || outlet == 11;
+}
+
+int regenerate(unsigned int seed, double seconds) {
+	// As generated
+
+	maxsim_record(1);
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", 120);
+	send_long(x, "in2", (long)seed);
+	double start = maxsim_now();
+	maxsim_send(x, "bang", 0, NULL);
+	maxsim_run_all();
+	long count = maxsim_event_count();
+	maxsim_event* expected = (maxsim_event*)malloc(sizeof(maxsim_event) * (count > 0 ? count : 1));
+	memcpy(expected, maxsim_events(), sizeof(maxsim_event) * count);
+	for (long i = 0; i < count; i++) {
+		expected[i].time -= start;
+	}
+	maxsim_clear();
+
+	// Again, with the kick remade part way through
+
+	start = maxsim_now();
+	maxsim_send(x, "bang", 0, NULL); // Stops the song that ended
+	maxsim_send(x, "bang", 0, NULL);
+	maxsim_run(start + seconds * 1000.0);
+	double asked = maxsim_now() - start;
+	send_symbol(x, "regenerate", "kick");
+	maxsim_run_all();
+
+	long played = maxsim_event_count();
+	maxsim_event* events = maxsim_events();
+	int differ = 0;
+	long changed = 0;
+	for (int outlet = 0; outlet <= 18 && !differ; outlet++) {
+		long a = 0;
+		long b = 0;
+		while (!differ) {
+			while (a < count && expected[a].outlet != outlet) {
+				a++;
+			}
+			while (b < played && events[b].outlet != outlet) {
+				b++;
+			}
+			if (a == count || b == played) {
+				if ((a < count || b < played) && !regenerated_outlet(outlet)) {
+					printf("outlet %d: %s has more outlet calls\n", outlet, a < count ? "the original" : "the regenerated song");
+					differ = 1;
+				}
+				break;
+			}
+			maxsim_event* e = &expected[a];
+			maxsim_event* r = &events[b];
+			if (e->time != r->time - start || e->type != r->type || e->value != r->value) {
+				if (!regenerated_outlet(outlet) || fmin(e->time, r->time - start) < asked) {
+					printf("outlet %d differs: %.3f %c %g, regenerated %.3f %c %g\n", outlet,
+						e->time, e->type, e->value, r->time - start, r->type, r->value);
+					differ = 1;
+				}
+				changed++;
+			}
+			a++;
+			b++;
+		}
+	}
+	if (!differ && changed == 0) {
+		printf("seed %u: regenerating the kick changed nothing\n", seed);
+		differ = 1;
+	}
+	else if (!differ) {
+		printf("seed %u: kick regenerated at %.1f s, %ld kick and bass outlet calls changed after it, everything else the same\n",
+			seed, asked / 1000.0, changed);
+	}
+	free(expected);
+	object_free(x);
+	return differ;
+}
+
+// Plays seeds 0 up on one instance, returns the outlet calls and sets took to the time spent in bang
+maxsim_event* play_seeds(long songs, long threads, long* count, double* took) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	send_long(x, "in1", 120);
+	send_long(x, "threads", threads);
+	maxsim_clear();
+	*took = 0;
+	for (long i = 0; i < songs; i++) {
+		send_long(x, "in2", i);
+		if (i > 0) {
+			maxsim_send(x, "bang", 0, NULL); // Stops the song that ended
+		}
+		double start = systimer_gettime();
+		maxsim_send(x, "bang", 0, NULL);
+		*took += systimer_gettime() - start;
+		maxsim_run_all();
+	}
+	*count = maxsim_event_count();
+	maxsim_event* events = (maxsim_event*)malloc(sizeof(maxsim_event) * (*count > 0 ? *count : 1));
+	memcpy(events, maxsim_events(), sizeof(maxsim_event) * *count);
+	maxsim_clear();
+	object_free(x);
+	return events;
+}
+
+int threads(long songs, long threads) {
+	long count;
+	long played;
+	double took;
+	double took_threads;
+	maxsim_record(1);
+	maxsim_event* expected = play_seeds(songs, 0, &count, &took);
+	maxsim_event* events = play_seeds(songs, threads, &played, &took_threads);
+	double shift = played > 0 && count > 0 ? events[0].time - expected[0].time : 0; // Virtual time carries on
+
+	int differ = played != count;
+	for (long i = 0; i < count && !differ; i++) {
+		maxsim_event* a = &expected[i];
+		maxsim_event* b = &events[i];
+		if (fabs(b->time - a->time - shift) > 1e-6 || a->outlet != b->outlet
+			|| a->type != b->type || a->value != b->value || a->count != b->count) {
+			printf("outlet call %ld differs: %.3f %d %c %g, with threads %.3f %d %c %g\n", i,
+				a->time, a->outlet, a->type, a->value, b->time, b->outlet, b->type, b->value);
+			differ = 1;
+		}
+	}
+	if (played != count) {
+		printf("%ld songs: %ld outlet calls in order, %ld with threads\n", songs, count, played);
+	}
+	else if (!differ) {
+		printf("%ld songs with %ld threads: %ld outlet calls the same as in order, bang took %.4f ms each with threads, %.4f ms in order\n",
+			songs, threads, count, took_threads / songs, took / songs);
+	}
+	free(expected);
+	free(events);
+	return differ;
+}
+
+// Runs an analyze message to the end and reads the file back, returns the rows or NULL
+float* analyze_seeds(void* x, long songs, long threads, const char* file, long* rows, long* width, double* took) {
+	t_atom args[4];
+	atom_setlong(args, 0);
+	atom_setlong(args + 1, songs);
+	atom_setsym(args + 2, gensym(file));
+	atom_setlong(args + 3, threads);
+	remove(file);
+
+	FILE* fp = NULL;
+	*took = systimer_gettime();
+	maxsim_send(x, "analyze", 4, args);
+	while ((fp = fopen(file, "rb")) == NULL) { // Written by the report qelem once the workers are done
+		systhread_sleep(1);
+		maxsim_idle();
+	}
+	*took = systimer_gettime() - *took;
+
+	unsigned int header[4];
+	float* data = NULL;
+	if (fread(header, sizeof(header), 1, fp) == 1 && header[0] == 0x4658424du) {
+		*width = header[2] + 1;
+		*rows = header[3];
+		data = (float*)malloc(sizeof(float) * *width * (*rows > 0 ? *rows : 1));
+		if (fread(data, sizeof(float) * *width, *rows, fp) != (size_t)*rows) {
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(fp);
+	return data;
+}
+
+int analyze(long songs, long threads, const char* file) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	long rows;
+	long width;
+	long rows_one;
+	long width_one;
+	double took;
+	double took_one;
+	float* data = analyze_seeds(x, songs, threads, file, &rows, &width, &took);
+	float* one = analyze_seeds(x, songs, 1, file, &rows_one, &width_one, &took_one);
+	int bad = data == NULL || one == NULL || rows != songs || rows_one != rows || width_one != width
+		|| memcmp(data, one, sizeof(float) * width * rows) != 0;
+	if (bad) {
+		printf("analyze: %ld rows with %ld threads, %ld with one, files %s\n", rows, threads, rows_one,
+			data != NULL && one != NULL ? "differ" : "unreadable");
+	}
+
+	// Rows are the seed then the vector, see features.h for the order
+
+	for (long i = 0; i < rows && !bad; i++) {
+		unsigned int seed;
+		float* f = data + i * width + 1;
+		memcpy(&seed, data + i * width, sizeof(seed));
+		float pitches = 0;
+		for (int c = 0; c < 12; c++) {
+			pitches += f[7 + c];
+		}
+		int sane = seed == (unsigned int)i && fabsf(pitches - 1) < 1e-4f && f[width - 2] > 0;
+		for (int k = 0; k < 4; k++) {
+			sane = sane && f[19 + k] >= 0 && f[19 + k] <= 1;
+		}
+		for (int t = 0; t < 7; t++) {
+			sane = sane && f[t] > 0;
+		}
+		if (!sane) {
+			printf("seed %u: vector out of range\n", seed);
+			bad = 1;
+		}
+	}
+	if (!bad) {
+		printf("%ld songs measured: %.0f songs a minute on %ld threads, %.0f on one, the same %ld features each\n",
+			songs, songs * 60000.0 / took, threads, songs * 60000.0 / took_one, width - 1);
+	}
+	free(data);
+	free(one);
+	object_free(x);
+	return bad;
+}
+
+// Reads a whole file, returns NULL if it can't
+char* read_file(const char* file, long* size) {
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char* data = (char*)malloc(*size > 0 ? *size : 1);
+	if (fread(data, 1, *size, fp) != (size_t)*size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+int render(long songs) {
+	void* x = maxsim_new("musicbox", 0, NULL);
+	char line[1024];
+	t_atom args[3];
+	atom_setsym(args, gensym("render_"));
+	atom_setlong(args + 1, 0);
+	atom_setlong(args + 2, songs);
+
+	double took = systimer_gettime();
+	maxsim_send(x, "render", 3, args);
+	double returned = systimer_gettime() - took;
+	do { // Posted by the report qelem once the worker is done
+		systhread_sleep(1);
+		maxsim_idle();
+		maxsim_last_post(line, sizeof(line));
+	} while (strncmp(line, "Render finished", 15) != 0);
+	took = systimer_gettime() - took;
+
+	int bad = 0;
+	for (long i = 0; i < songs && !bad; i++) {
+		char name[64];
+		long size;
+		long size_one;
+		snprintf(name, sizeof(name), "render_%ld.wav", i);
+		char* data = read_file(name, &size);
+		atom_setsym(args, gensym("render_one.wav"));
+		atom_setlong(args + 1, i);
+		maxsim_send(x, "render", 2, args);
+		char* one = read_file("render_one.wav", &size_one);
+		if (data == NULL || one == NULL || size != size_one || memcmp(data, one, size) != 0) {
+			printf("render: seed %ld in the range differs from rendering it on its own\n", i);
+			bad = 1;
+		}
+		free(data);
+		free(one);
+	}
+	if (!bad) {
+		printf("%ld songs rendered on a worker thread, the message returned in %.3f ms, %.0f songs a minute, each the same as rendered on its own\n",
+			songs, returned, songs * 60000.0 / took);
+	}
+	object_free(x);
+	return bad;
+}
+
+// Words for ingest, the kinds the pattern files hold and some they shouldn't
+const char* ingest_words[] = {"rest", "rests", "r", "Cs2.5", "57,", ":", "-1", "+2", "1e2", "0x10",
+	"inf", "length", "Bs1", "Es2", "C0", "A7", "Gs6", "Ds", "..5", "1.2.3", "007", "."};
+
+const char* ingest_files[] = {"hat", "hat2", "ghost", "snare", "kick"};
+
+int ingest_file(void* x, const char* file, long threads) {
+	t_atom args[2];
+	char line[1024];
+	atom_setsym(args, gensym(file));
+	atom_setlong(args + 1, threads);
+	maxsim_send(x, "ingest", 2, args);
+	maxsim_last_post(line, sizeof(line));
+	if (strstr(line, "read the same words") == NULL) {
+		printf("ingest: %s was read differently\n", file);
+		return 1;
+	}
+	return 0;
+}
+
+int ingest(long rows, long threads) {
+	const char* file = "ingest.txt";
+	const char* letters = "ABCDEFG";
+	FILE* fp = fopen(file, "wb");
+	if (fp == NULL) {
+		printf("ingest: could not write %s\n", file);
+		return 1;
+	}
+	srand(1);
+	for (long r = 0; r < rows; r++) {
+		int words = rand() % 12;
+		for (int w = 0; w < words; w++) {
+			int kind = rand() % 8;
+			if (w > 0) {
+				fputs(rand() % 16 ? " " : "  ", fp);
+			}
+			if (kind < 3) { // Note name, some out of range or with a sharp that doesn't exist
+				fprintf(fp, "%c%s%d", letters[rand() % 7], rand() % 3 ? "" : "s", rand() % 8);
+			}
+			else if (kind < 6) { // Length, some too long to read directly
+				int digits = 1 + rand() % 9;
+				int point = rand() % (digits + 2) - 1;
+				for (int d = 0; d < digits; d++) {
+					if (d == point) {
+						fputc('.', fp);
+					}
+					fputc('0' + rand() % 10, fp);
+				}
+			}
+			else if (kind == 6) {
+				fputs(rand() % 2 ? "rest" : ".5", fp);
+			}
+			else {
+				fputs(ingest_words[rand() % (sizeof(ingest_words) / sizeof(ingest_words[0]))], fp);
+			}
+		}
+		int end = rand() % 8;
+		fputs(end == 0 ? " \n" : end == 1 ? "\r\n" : "\n", fp);
+	}
+	fclose(fp);
+
+	void* x = maxsim_new("musicbox", 0, NULL);
+	int bad = ingest_file(x, file, threads) || ingest_file(x, file, 1);
+	for (int i = 0; i < 5; i++) {
+		char name[256];
+		snprintf(name, sizeof(name), "D:/music_algorithm/patterns/%s.txt", ingest_files[i]);
+		bad |= ingest_file(x, name, threads);
+	}
+	if (!bad) {
+		printf("%ld made up rows and the pattern files read the same directly as looked up\n", rows);
+	}
+	object_free(x);
+	return bad;
+}
+
+// Checks one object's outlet calls match another's, times counted from their starts
+int same_object(maxsim_event* a, long a_count, int a_object, double a_start,
+	maxsim_event* b, long b_count, int b_object, double b_start) {
+	long i = 0;
+	long k = 0;
+	long matched = 0;
+	for (;;) {
+		while (i < a_count && a[i].object != a_object) {
+			i++;
+		}
+		while (k < b_count && b[k].object != b_object) {
+			k++;
+		}
+		if (i == a_count || k == b_count) {
+			if (i < a_count || k < b_count || matched == 0) {
+				printf("object %d: %ld outlet calls matched, then %s\n", b_object, matched,
+					matched == 0 ? "none played" : "one has more");
+				return 0;
+			}
+			return 1;
+		}
+		if (fabs((a[i].time - a_start) - (b[k].time - b_start)) > 1e-6 || a[i].outlet != b[k].outlet
+			|| a[i].type != b[k].type || a[i].value != b[k].value || a[i].count != b[k].count) {
+			printf("object %d outlet call %ld differs: %.3f %d %c %g, on the transport %.3f %d %c %g\n", b_object,
+				matched, a[i].time - a_start, a[i].outlet, a[i].type, a[i].value, b[k].time - b_start, b[k].outlet,
+				b[k].type, b[k].value);
+			return 0;
+		}
+		matched++;
+		i++;
+		k++;
+	}
+}
+
+int transport(long instances, double late) {
+	long n = instances + 1; // The last one joins late
+	void** boxes = (void**)malloc(sizeof(void*) * n * 2);
+
+	// Each on its own clocks, all started at once
+
+	maxsim_record(1);
+	for (long i = 0; i < n; i++) {
+		boxes[i] = maxsim_new("musicbox", 0, NULL);
+		send_long(boxes[i], "in1", 120);
+		send_long(boxes[i], "in2", i);
+	}
+	double start = maxsim_now();
+	double took_own = systimer_gettime();
+	for (long i = 0; i < n; i++) {
+		maxsim_send(boxes[i], "bang", 0, NULL);
+	}
+	long fired = maxsim_run_all();
+	took_own = systimer_gettime() - took_own;
+	long count = maxsim_event_count();
+	maxsim_event* expected = (maxsim_event*)malloc(sizeof(maxsim_event) * (count > 0 ? count : 1));
+	memcpy(expected, maxsim_events(), sizeof(maxsim_event) * count);
+	maxsim_clear();
+
+	// On one transport, the last banged late
+
+	for (long i = n; i < n * 2; i++) {
+		boxes[i] = maxsim_new("musicbox", 0, NULL);
+		send_symbol(boxes[i], "transport", "shared");
+		send_long(boxes[i], "in1", 120);
+		send_long(boxes[i], "in2", i - n);
+	}
+	double shared_start = maxsim_now();
+	double took = systimer_gettime();
+	for (long i = n; i < n * 2 - 1; i++) {
+		maxsim_send(boxes[i], "bang", 0, NULL);
+	}
+	long shared_fired = maxsim_run(shared_start + late);
+	double joined = maxsim_now();
+	maxsim_send(boxes[n * 2 - 1], "bang", 0, NULL);
+	shared_fired += maxsim_run_all();
+	took = systimer_gettime() - took;
+
+	long played = maxsim_event_count();
+	maxsim_event* events = maxsim_events();
+	int good = 1;
+	for (long i = 0; i < instances && good; i++) {
+		good = same_object(expected, count, (int)i, start, events, played, (int)(n + i), shared_start);
+	}
+
+	// The late one starts on the first bar line after it was banged, 2 s apart at 120 bpm
+
+	double first = joined;
+	for (long k = 0; k < played; k++) {
+		if (events[k].object == (int)(n * 2 - 1)) {
+			first = events[k].time;
+			break;
+		}
+	}
+	double bar = ceil((joined - shared_start) / 2000.0 - 1e-9) * 2000.0;
+	if (good && fabs(first - shared_start - bar) > 1e-6) {
+		printf("late instance banged at %.3f ms started at %.3f ms, not the bar line at %.3f ms\n",
+			joined - shared_start, first - shared_start, bar);
+		good = 0;
+	}
+	if (good) {
+		good = same_object(expected, count, (int)instances, start, events, played, (int)(n * 2 - 1), shared_start + bar);
+	}
+	if (good) {
+		printf("%ld instances on one transport played the same as on their own clocks, one more banged at %.0f ms started on the bar at %.0f ms\n",
+			instances, late, bar);
+		printf("%ld clock callbacks in %.3f ms on their own clocks, %ld in %.3f ms on the transport, %ld outlet calls\n",
+			fired, took_own, shared_fired, took, played);
+	}
+	send_symbol(boxes[n], "transport", "stats");
+
+	for (long i = 0; i < n * 2; i++) {
+		object_free(boxes[i]);
+	}
+	free(boxes);
+	free(expected);
+	return !good;
+}
+
+int main(int argc, char** argv) {
+	int result = 1;
+	maxsim_init();
+	ext_main(NULL);
+
+	if (argc >= 3 && strcmp(argv[1], "play") == 0) {
+		result = play((unsigned int)atol(argv[2]), argc >= 4 ? atol(argv[3]) : 120, argc >= 5 ? argv[4] : NULL);
+	}
+	else if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		long songs = argc >= 3 ? atol(argv[2]) : 100;
+		long instances = argc >= 4 ? atol(argv[3]) : 1;
+		result = bench(songs, instances > 0 ? instances : 1);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+		result = replay((unsigned int)atol(argv[2]), argc >= 4 ? argv[3] : "replay.mbl", argc >= 5 ? atof(argv[4]) : 0);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "playlist") == 0) {
+		result = playlist(atol(argv[2]), argc >= 4 ? atol(argv[3]) : 1);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "retime") == 0) {
+		result = retime(atol(argv[2]), argc >= 4 ? atof(argv[3]) : 700);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "regenerate") == 0) {
+		result = regenerate((unsigned int)atol(argv[2]), argc >= 4 ? atof(argv[3]) : 10);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "threads") == 0) {
+		result = threads(atol(argv[2]), argc >= 4 ? atol(argv[3]) : 2);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "analyze") == 0) {
+		result = analyze(atol(argv[2]), argc >= 4 ? atol(argv[3]) : 4, argc >= 5 ? argv[4] : "features.mbf");
+	}
+	else if (argc >= 3 && strcmp(argv[1], "render") == 0) {
+		result = render(atol(argv[2]));
+	}
+	else if (argc >= 3 && strcmp(argv[1], "transport") == 0) {
+		result = transport(atol(argv[2]), argc >= 4 ? atof(argv[3]) : 3300);
+	}
+	else if (argc >= 3 && strcmp(argv[1], "ingest") == 0) {
+		result = ingest(atol(argv[2]), argc >= 4 ? atol(argv[3]) : 4);
+	}
+	else {
+		printf("usage: musicbox_sim play <seed> [<tempo>] [<log>]\n");
+		printf("       musicbox_sim bench [<songs>] [<instances>]\n");
+		printf("       musicbox_sim replay <seed> [<log>] [<ms>]\n");
+		printf("       musicbox_sim playlist <songs> [<depth>]\n");
+		printf("       musicbox_sim retime <songs> [<ms>]\n");
+		printf("       musicbox_sim regenerate <seed> [<seconds>]\n");
+		printf("       musicbox_sim threads <songs> [<threads>]\n");
+		printf("       musicbox_sim analyze <songs> [<threads>] [<file>]\n");
+		printf("       musicbox_sim render <songs>\n");
+		printf("       musicbox_sim ingest <rows> [<threads>]\n");
+		printf("       musicbox_sim transport <instances> [<late>]\n");
+	}
+
+	maxsim_quit();
+	return result;
+}
@@ -0,0 +1,166 @@
+/**
+	@file
+	ring_test - reads musicbox events from shared memory, or times the ring on its own
+	Caden Kesey
+*/
+
+/*
+ring_test <name>
+	Prints every event a musicbox object publishes after "export <name>"
+ring_test bench [<readers>] [<events>]
+	Starts its own writer and reader processes and reports how long events take to arrive
+
+Build with: cc -O2 -o ring_test tools/ring_test.c (add -lrt on older Linux)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../ring.h"
+
+const char* ring_track_names[7] = { "piano", "bass", "melody", "hat", "ghost", "snare", "kick" };
+
+int compare_u64(const void* a, const void* b) {
+	ring_u64 x = *(const ring_u64*)a;
+	ring_u64 y = *(const ring_u64*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Prints events as they arrive until the writer goes away
+int watch(const char* name) {
+	ring* r = ring_open(name);
+	if (r == NULL) {
+		printf("Could not open shared memory %s\n", name);
+		return 1;
+	}
+	for (;;) {
+		ring_u64 lost;
+		const ring_slot* e = ring_peek(r, &lost);
+		if (lost > 0) {
+			printf("lost %llu events\n", lost);
+		}
+		if (e == NULL) {
+			usleep(200);
+			continue;
+		}
+		// Read straight out of the shared memory, then check the writer didn't lap us meanwhile
+		float time = e->time;
+		float length = e->length;
+		int track = e->track;
+		int value = e->value;
+		ring_u64 delay = ring_now() - e->stamp;
+		if (ring_done(r, e)) {
+			printf("%8.3f %-6s %3d %6.3f beats (%.1f us)\n", time, track >= 0 && track < 7 ? ring_track_names[track] : "?", value, length, delay / 1000.0);
+		}
+	}
+}
+
+// One reader process: spins on the ring and records the latency of every event
+int bench_reader(const char* name, long events, int id) {
+	ring* r = ring_open(name);
+	if (r == NULL) {
+		printf("reader %d: could not open %s\n", id, name);
+		return 1;
+	}
+	ring_u64* latency = (ring_u64*)calloc(events, sizeof(ring_u64)); // 0 for events that were lost
+	long received = 0;
+	ring_u64 lost_total = 0;
+	long checksum_errors = 0;
+
+	while (received < events) {
+		ring_u64 lost;
+		const ring_slot* e = ring_peek(r, &lost);
+		lost_total += lost;
+		received += (long)lost;
+		if (e == NULL || received >= events) {
+			sched_yield(); // Spin, but let the writer run on a machine with few cores
+			continue;
+		}
+		ring_u64 now = ring_now();
+		int value = e->value;
+		int track = e->track;
+		ring_u64 stamp = e->stamp;
+		if (ring_done(r, e)) {
+			if (value != (int)((r->read_index - 1) % 88) + 21 || track != (int)((r->read_index - 1) % 7)) {
+				checksum_errors++;
+			}
+			latency[received] = now - stamp;
+		}
+		else {
+			lost_total++;
+		}
+		received++;
+	}
+
+	long n = 0;
+	for (long i = 0; i < events; i++) {
+		if (latency[i] > 0) {
+			latency[n++] = latency[i];
+		}
+	}
+	qsort(latency, n, sizeof(ring_u64), compare_u64);
+	if (n > 0) {
+		printf("reader %d: %ld events, %llu lost, %ld bad, latency median %.1f us, 99%% %.1f us, max %.1f us\n",
+			id, n, lost_total, checksum_errors, latency[n / 2] / 1000.0, latency[n * 99 / 100] / 1000.0, latency[n - 1] / 1000.0);
+	}
+	int failed = checksum_errors > 0 || n == 0 || latency[n * 99 / 100] > 1000000;
+	free(latency);
+	ring_close(r);
+	return failed;
+}
+
+int bench(int readers, long events) {
+	char name[64];
+	snprintf(name, sizeof(name), "/musicbox_bench_%d", (int)getpid());
+
+	ring* w = ring_create(name, 1024);
+	if (w == NULL) {
+		printf("Could not create shared memory %s\n", name);
+		return 1;
+	}
+
+	for (int i = 0; i < readers; i++) {
+		if (fork() == 0) {
+			exit(bench_reader(name, events, i));
+		}
+	}
+	usleep(100000); // Let the readers attach before anything is written
+
+	// One event every 20 microseconds, about a 16th note at 750000 bpm
+	ring_u64 next = ring_now();
+	for (long i = 0; i < events; i++) {
+		while (ring_now() < next) {
+			sched_yield();
+		}
+		ring_publish(w, i * 0.25f, 0.25f, (int)(i % 7), (int)(i % 88) + 21, 500.0f);
+		next += 20000;
+	}
+
+	int failed = 0;
+	for (int i = 0; i < readers; i++) {
+		int status;
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	ring_close(w);
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
+
+int main(int argc, char** argv) {
+	if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+		int readers = argc >= 3 ? atoi(argv[2]) : 3;
+		long events = argc >= 4 ? atol(argv[3]) : 100000;
+		return bench(readers, events);
+	}
+	if (argc >= 2) {
+		return watch(argv[1]);
+	}
+	printf("usage: ring_test <name> | ring_test bench [<readers>] [<events>]\n");
+	return 1;
+}
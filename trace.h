@@ -0,0 +1,228 @@
+/**
+	@file
+	trace - timed spans of generation and playback, saved as Chrome trace_event JSON
+	Caden Kesey
+*/
+
+/*
+Spans are only recorded when the build defines MUSICBOX_TRACE. Without it TRACE_BEGIN and
+TRACE_END expand to nothing and none of the code below is compiled.
+
+	TRACE_BEGIN(span);
+	... work ...
+	TRACE_END(span, "name");
+
+The name must be a string that lives for the whole program, usually a literal. Each thread
+writes into its own buffer, so recording never takes a lock; when a buffer is full its oldest
+spans are overwritten. trace_save writes every thread's spans to a file that chrome://tracing
+or ui.perfetto.dev can open.
+
+Worker threads call TRACE_THREAD_DONE() before they exit, which hands their buffer to the next
+thread that starts recording. Each span keeps the id of the thread that recorded it, so a
+finished thread's spans stay on their own row until the buffer wraps over them. At most
+TRACE_MAX_THREADS threads can be recording at once.
+*/
+
+#ifdef MUSICBOX_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define TRACE_THREAD __declspec(thread)
+#define TRACE_ADD_ONE(p) (InterlockedIncrement((volatile long*)(p)) - 1)
+#define TRACE_CLAIM(p) (InterlockedCompareExchange((volatile long*)(p), 1, 0) == 0)
+#else
+#include <time.h>
+#define TRACE_THREAD __thread
+#define TRACE_ADD_ONE(p) __atomic_fetch_add(p, 1, __ATOMIC_ACQ_REL)
+#define TRACE_CLAIM(p) trace_claim(p)
+#endif
+
+#ifdef _MSC_VER
+#define TRACE_LOAD(p) (_ReadWriteBarrier(), *(p))
+#define TRACE_STORE(p, v) do { _ReadWriteBarrier(); *(p) = (v); _ReadWriteBarrier(); } while (0)
+#else
+#define TRACE_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TRACE_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+#define TRACE_SPANS 65536 // Spans kept per thread, a power of two
+#define TRACE_MAX_THREADS 64
+
+#define TRACE_BEGIN(span) trace_u64 span = TRACE_LOAD(&trace_enabled) ? trace_now() : 0
+#define TRACE_END(span, name) do { if (span) { trace_add(name, span); } } while (0)
+#define TRACE_THREAD_DONE() trace_release()
+
+// Structs
+
+typedef unsigned long long trace_u64;
+
+typedef struct trace_span {
+	const char* name;
+	trace_u64 start; // Nanoseconds
+	trace_u64 end;
+	int thread; // Order the thread first recorded in, used as its id in the file
+} trace_span;
+
+typedef struct trace_buffer {
+	volatile long owned; // Set while a thread records into it, cleared when the thread is done
+	int thread; // Id of the thread recording into it
+	volatile long written; // Spans recorded so far, the newest is written - 1
+	trace_span spans[TRACE_SPANS];
+} trace_buffer;
+
+// Shared by every instance and thread
+
+volatile int trace_enabled = 0;
+volatile long trace_thread_count = 0; // Buffers made, one per thread recording at once
+volatile long trace_thread_ids = 0; // Threads that have recorded
+volatile long trace_warned = 0; // Set once a thread has been told there is no buffer for it
+trace_buffer* trace_buffers[TRACE_MAX_THREADS];
+trace_u64 trace_origin = 0; // When tracing started, times in the file count from here
+
+TRACE_THREAD trace_buffer* trace_mine = NULL;
+TRACE_THREAD int trace_full = 0; // Set for threads that found every buffer in use, which record nothing
+
+#ifndef _WIN32
+int trace_claim(volatile long* owned) {
+	long expected = 0;
+	return __atomic_compare_exchange_n(owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#endif
+
+trace_u64 trace_now(void) {
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (trace_u64)((double)count.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (trace_u64)ts.tv_sec * 1000000000ull + (trace_u64)ts.tv_nsec;
+#endif
+}
+
+/*
+The calling thread's buffer, taken the first time the thread records a span: one a finished
+thread has given back if there is one, or a new one.
+*/
+trace_buffer* trace_thread(void) {
+	if (trace_mine != NULL || trace_full) {
+		return trace_mine;
+	}
+	trace_buffer* b = NULL;
+	for (long i = 0; i < TRACE_LOAD(&trace_thread_count) && i < TRACE_MAX_THREADS && b == NULL; i++) {
+		trace_buffer* given = TRACE_LOAD(&trace_buffers[i]);
+		if (given != NULL && TRACE_CLAIM(&given->owned)) {
+			b = given;
+		}
+	}
+	if (b == NULL) {
+		long index = TRACE_ADD_ONE(&trace_thread_count);
+		if (index >= TRACE_MAX_THREADS) {
+			trace_full = 1;
+			if (TRACE_ADD_ONE(&trace_warned) == 0) {
+				post("trace: more than %d threads recording at once, the rest record nothing", TRACE_MAX_THREADS);
+			}
+			return NULL;
+		}
+		b = (trace_buffer*)malloc(sizeof(trace_buffer));
+		b->owned = 1;
+		b->written = 0;
+		TRACE_STORE(&trace_buffers[index], b);
+	}
+	b->thread = (int)TRACE_ADD_ONE(&trace_thread_ids) + 1;
+	trace_mine = b;
+	return b;
+}
+
+// Gives the calling thread's buffer to the next thread that records, its spans stay until overwritten
+void trace_release(void) {
+	trace_buffer* b = trace_mine;
+	if (b == NULL) {
+		return;
+	}
+	trace_mine = NULL;
+	TRACE_STORE(&b->owned, 0);
+}
+
+void trace_add(const char* name, trace_u64 start) {
+	trace_u64 end = trace_now();
+	trace_buffer* b = trace_thread();
+	if (b == NULL) {
+		return;
+	}
+	long n = b->written;
+	trace_span* span = &b->spans[n & (TRACE_SPANS - 1)];
+	span->name = name;
+	span->start = start;
+	span->end = end;
+	span->thread = b->thread;
+	TRACE_STORE(&b->written, n + 1);
+}
+
+// Control
+
+// Forgets spans already recorded and starts recording
+void trace_start(void) {
+	for (long i = 0; i < TRACE_LOAD(&trace_thread_count) && i < TRACE_MAX_THREADS; i++) {
+		trace_buffer* b = TRACE_LOAD(&trace_buffers[i]);
+		if (b != NULL) {
+			TRACE_STORE(&b->written, 0);
+		}
+	}
+	trace_origin = trace_now();
+	TRACE_STORE(&trace_enabled, 1);
+}
+
+void trace_stop(void) {
+	TRACE_STORE(&trace_enabled, 0);
+}
+
+/*
+Writes the spans to filename as complete ("X") events in microseconds. Threads that are still
+recording keep going, so spans written while the file is saved may be left out. Returns the
+number of spans written, or -1 if the file could not be opened.
+*/
+long trace_save(const char* filename) {
+	FILE* fp = fopen(filename, "w");
+	long total = 0;
+	if (fp == NULL) {
+		return -1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (long i = 0; i < TRACE_LOAD(&trace_thread_count) && i < TRACE_MAX_THREADS; i++) {
+		trace_buffer* b = TRACE_LOAD(&trace_buffers[i]);
+		if (b == NULL) {
+			continue;
+		}
+		long written = TRACE_LOAD(&b->written);
+		long first = written > TRACE_SPANS ? written - TRACE_SPANS : 0;
+		for (long n = first; n < written; n++) {
+			trace_span* span = &b->spans[n & (TRACE_SPANS - 1)];
+			if (span->start < trace_origin) {
+				continue;
+			}
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				total > 0 ? ",\n" : "", span->name, span->thread,
+				(span->start - trace_origin) / 1000.0, (span->end - span->start) / 1000.0);
+			total++;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	return total;
+}
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name)
+#define TRACE_THREAD_DONE()
+
+#endif
@@ -0,0 +1,315 @@
+/**
+	@file
+	transport - one tempo, bar position and clock shared by every instance attached to it
+	Caden Kesey
+*/
+
+/*
+A transport is found by name, so any number of instances can attach to the same one. It holds
+the tempo map and a heap of streams, one for each thing an instance would otherwise have its own
+clock for, ordered by the beat they are due at. Its one clock fires at the first stream due,
+runs every stream due by then in beat order and is set again for the next, so a hundred
+instances playing together cost one clock callback for each moment something plays rather than
+one for every track of every instance.
+
+Streams are kept in beats, so a tempo change moves every one of them at once and attached
+instances can't drift apart. Streams due on the same beat run in the order they were set, the way
+clocks due at the same time do.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRANSPORT_TEMPO 120.0 // Tempo a new transport starts at
+#define TRANSPORT_SLACK 1e-6 // Milliseconds a stream may be due after the clock fires and still run
+
+typedef void (*transport_method)(void* owner);
+
+struct transport;
+
+// Something an instance schedules, the transport's stand-in for one of its clocks
+typedef struct transport_stream {
+	struct transport* transport; // NULL until attached
+	transport_method fn;
+	void* owner;
+	double beat; // Transport position it is due at
+	unsigned long order; // When it was set, streams due on the same beat run in this order
+	long slot; // Index in the heap, -1 when not set
+} transport_stream;
+
+typedef struct transport {
+	t_symbol* name;
+	long references; // Instances attached
+	struct transport* next; // Every transport, see transports
+
+	tempo_map timing; // Transport position to scheduler time
+	double bpm;
+	void* clock;
+	int running; // Set while transport_task runs streams, it sets the clock once they are done
+	int dead; // Detached by the last instance while running, transport_task frees it when done
+
+	transport_stream** heap; // Set streams, the first due at the top
+	long count;
+	long size;
+	unsigned long order;
+
+	// Stats
+
+	long fired; // Clock callbacks
+	long ran; // Streams run
+} transport;
+
+transport* transports = NULL; // Every transport attached to, found by name
+
+// Heap, called inside the critical region
+
+int transport_before(transport_stream* a, transport_stream* b) {
+	return a->beat < b->beat || (a->beat == b->beat && a->order < b->order);
+}
+
+void transport_place(transport* t, transport_stream* s, long slot) {
+	t->heap[slot] = s;
+	s->slot = slot;
+}
+
+void transport_up(transport* t, long slot) {
+	transport_stream* s = t->heap[slot];
+	while (slot > 0 && transport_before(s, t->heap[(slot - 1) / 2])) {
+		transport_place(t, t->heap[(slot - 1) / 2], slot);
+		slot = (slot - 1) / 2;
+	}
+	transport_place(t, s, slot);
+}
+
+void transport_down(transport* t, long slot) {
+	transport_stream* s = t->heap[slot];
+	for (;;) {
+		long child = slot * 2 + 1;
+		if (child >= t->count) {
+			break;
+		}
+		if (child + 1 < t->count && transport_before(t->heap[child + 1], t->heap[child])) {
+			child++;
+		}
+		if (!transport_before(t->heap[child], s)) {
+			break;
+		}
+		transport_place(t, t->heap[child], slot);
+		slot = child;
+	}
+	transport_place(t, s, slot);
+}
+
+void transport_remove(transport* t, transport_stream* s) {
+	long slot = s->slot;
+	s->slot = -1;
+	t->count--;
+	if (slot == t->count) {
+		return;
+	}
+	transport_stream* moved = t->heap[t->count];
+	transport_place(t, moved, slot);
+	transport_up(t, slot);
+	if (moved->slot == slot) {
+		transport_down(t, slot);
+	}
+}
+
+// Sets the clock for the first stream due, or unsets it if none is
+void transport_arm(transport* t) {
+	if (t->count == 0) {
+		clock_unset(t->clock);
+		return;
+	}
+	double now;
+	clock_getftime(&now);
+	double delay = tempo_ms(&t->timing, t->heap[0]->beat) - now;
+	clock_fdelay(t->clock, delay > 0 ? delay : 0);
+}
+
+// Clock
+
+void transport_free(transport* t) {
+	object_free(t->clock);
+	free(t->heap);
+	free(t);
+}
+
+// Runs every stream due now, first due first, then waits for the next
+void transport_task(transport* t) {
+	double now;
+	clock_getftime(&now);
+	critical_enter(0);
+	t->fired++;
+	t->running = 1;
+	while (t->count > 0 && tempo_ms(&t->timing, t->heap[0]->beat) <= now + TRANSPORT_SLACK) {
+		transport_stream* s = t->heap[0];
+		transport_remove(t, s);
+		t->ran++;
+		critical_exit(0);
+		s->fn(s->owner); // May set streams again, due now or later
+		critical_enter(0);
+	}
+	t->running = 0;
+	if (t->dead) {
+		critical_exit(0);
+		transport_free(t);
+		return;
+	}
+	transport_arm(t);
+	critical_exit(0);
+}
+
+// Streams
+
+// Sets a stream to run at a transport position, moving it if it was set already
+void transport_set(transport_stream* s, double beat) {
+	transport* t = s->transport;
+	critical_enter(0);
+	if (s->slot >= 0) {
+		transport_remove(t, s);
+	}
+	if (t->count == t->size) {
+		t->size = t->size ? t->size * 2 : 64;
+		t->heap = (transport_stream**)realloc(t->heap, sizeof(transport_stream*) * t->size);
+	}
+	s->beat = beat;
+	s->order = t->order++;
+	transport_place(t, s, t->count++);
+	transport_up(t, s->slot);
+	if (!t->running && t->heap[0] == s) { // Only a new first stream moves the clock
+		transport_arm(t);
+	}
+	critical_exit(0);
+}
+
+void transport_unset(transport_stream* s) {
+	transport* t = s->transport;
+	if (t == NULL) {
+		return;
+	}
+	critical_enter(0);
+	if (s->slot >= 0) {
+		transport_remove(t, s);
+	}
+	critical_exit(0);
+}
+
+void transport_stream_init(transport_stream* s, transport_method fn, void* owner) {
+	s->transport = NULL;
+	s->fn = fn;
+	s->owner = owner;
+	s->beat = 0;
+	s->order = 0;
+	s->slot = -1;
+}
+
+// Position and tempo
+
+// Transport position now
+double transport_now(transport* t) {
+	double now;
+	clock_getftime(&now);
+	return tempo_beat(&t->timing, now);
+}
+
+/*
+Where an instance starting now should put its first beat: the next bar line, or now if nothing
+is playing, when the transport starts over at beat 0 so the first instance doesn't wait.
+*/
+double transport_cue(transport* t) {
+	double now;
+	clock_getftime(&now);
+	critical_enter(0);
+	if (t->count == 0) {
+		tempo_start(&t->timing, now, t->bpm);
+	}
+	double beat = tempo_beat(&t->timing, now);
+	double bar = ceil(beat / MEASURE_BEATS - TRANSPORT_SLACK) * MEASURE_BEATS;
+	critical_exit(0);
+	return bar > 0 ? bar : 0;
+}
+
+// Changes tempo for every attached instance, straight away or ramping over beats
+void transport_tempo(transport* t, double bpm, double beats) {
+	double now;
+	clock_getftime(&now);
+	critical_enter(0);
+	t->bpm = tempo_clamp(bpm);
+	tempo_change(&t->timing, now, bpm, beats);
+	if (!t->running) {
+		transport_arm(t);
+	}
+	critical_exit(0);
+}
+
+// Lifetime
+
+// Finds the transport with this name, making it if no instance is attached to one yet, and joins the streams to it
+transport* transport_attach(t_symbol* name, transport_stream* streams, int count) {
+	critical_enter(0);
+	transport* t = transports;
+	while (t != NULL && t->name != name) {
+		t = t->next;
+	}
+	if (t == NULL) {
+		t = (transport*)malloc(sizeof(transport));
+		memset(t, 0, sizeof(transport));
+		t->name = name;
+		t->bpm = TRANSPORT_TEMPO;
+		tempo_start(&t->timing, 0, t->bpm);
+		t->clock = clock_new(t, (method)transport_task);
+		t->next = transports;
+		transports = t;
+	}
+	t->references++;
+	for (int i = 0; i < count; i++) {
+		transport_unset(&streams[i]);
+		streams[i].transport = t;
+	}
+	critical_exit(0);
+	return t;
+}
+
+/*
+Takes the streams off the transport, and frees it once nothing is attached. If the last instance
+detaches while transport_task is running streams, from inside one of them or from another thread,
+the transport is only marked dead and transport_task frees it once it is done with it.
+*/
+void transport_detach(transport* t, transport_stream* streams, int count) {
+	if (t == NULL) {
+		return;
+	}
+	critical_enter(0);
+	for (int i = 0; i < count; i++) {
+		transport_unset(&streams[i]);
+		streams[i].transport = NULL;
+	}
+	int last = --t->references == 0;
+	int dead = 0;
+	if (last) {
+		transport** link = &transports;
+		while (*link != t) {
+			link = &(*link)->next;
+		}
+		*link = t->next;
+		t->dead = dead = t->running;
+	}
+	else if (!t->running) {
+		transport_arm(t);
+	}
+	critical_exit(0);
+	if (last && !dead) { // t may already be freed if it was dead
+		transport_free(t);
+	}
+}
+
+void transport_post_stats(transport* t) {
+	critical_enter(0);
+	post("transport %s: %ld instances at %.2f bpm, beat %.3f, %ld streams waiting", t->name->s_name,
+		t->references, tempo_at(&t->timing, transport_now(t)), transport_now(t), t->count);
+	post("transport %s: %ld clock callbacks ran %ld streams, %.2f each", t->name->s_name,
+		t->fired, t->ran, t->fired > 0 ? (double)t->ran / t->fired : 0);
+	critical_exit(0);
+}